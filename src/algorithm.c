@@ -1,4 +1,6 @@
 #include "algorithm.h"
+#include "markov.h"
+#include "stride.h"
 #include <math.h>
 
 #define ABS(x) ((x) >= 0 ? (x) : -(x))
@@ -15,28 +17,41 @@
 #define IP_WEIGHT 1
 #endif
 
-#ifndef DEC_UP
-#define DEC_UP 0.01
-#endif
-
-#ifndef DEC_DOWN
-#define DEC_DOWN 0.0001
-#endif
-
 #ifndef DEC_DIST
 #define DEC_DIST 0.0001
 #endif
 
 
 
-struct tmem_page *page_history[HISTORY_SIZE];
-uint32_t page_his_idx = 0;
+struct algo_state algo_states[MAX_SCAN_THREADS];
+static _Thread_local struct algo_state *algo = &algo_states[0];
+
 double mig_time = 0;
 double mig_queue_time = 0;
 double mig_move_time = 0;
+double mig_page_time = 0;                       // cycles to move page_size bytes
+double mig_residency = CYC_COOL_THRESHOLD;      // cycles a promoted page stays before its demotion
+
+// Called by each scan thread before it processes samples
+void algo_set_shard(uint32_t shard) {
+    algo = &algo_states[shard];
+    markov_set_shard(shard);
+    stride_set_shard(shard);
+    algo->avg_dist = 1;
+    algo->bot_dist = 1;
+}
 
-double avg_dist = 1;
-double bot_dist = 1;
+double algo_bot_dist() {
+    double sum = 0;
+    for (uint32_t i = 0; i < tmem_cfg.scan_threads; i++) sum += algo_states[i].bot_dist;
+    return sum / tmem_cfg.scan_threads;
+}
+
+double algo_avg_dist() {
+    double sum = 0;
+    for (uint32_t i = 0; i < tmem_cfg.scan_threads; i++) sum += algo_states[i].avg_dist;
+    return sum / tmem_cfg.scan_threads;
+}
 
 
 // static double top_va = 2, bot_va = 1;
@@ -57,13 +72,13 @@ static inline double update_bot(double bot, double val) {
         val = bot / 10;
     }
     if (val < bot) {
-        return DEC_UP * val + (1.0 - DEC_UP) * bot;
+        return tmem_cfg.dec_up * val + (1.0 - tmem_cfg.dec_up) * bot;
     }
     if (val > bot * 10) {
         val = bot * 10;
     }
     // val = sqrt(val - bot) + bot;
-    return DEC_DOWN * val + (1.0 - DEC_DOWN) * bot;
+    return tmem_cfg.dec_down * val + (1.0 - tmem_cfg.dec_down) * bot;
 }
 
 static double calc_distance(struct tmem_page *a, struct tmem_page *b) {
@@ -98,13 +113,13 @@ static double calc_distance(struct tmem_page *a, struct tmem_page *b) {
 
     double percent_dram = pebs_stats.dram_accesses / (pebs_stats.dram_accesses + pebs_stats.rem_accesses + 1);
 
-    bot_dist = update_bot(bot_dist, distance * (1 - percent_dram * percent_dram));
+    algo->bot_dist = update_bot(algo->bot_dist, distance * (1 - percent_dram * percent_dram));
 
     // when the percent is good you want it to do less (lower threshold)
     // when the percent is bad you want it to do more (higher threshold)
 
 
-    avg_dist = DEC_DIST * distance + (1.0 - DEC_DIST) * avg_dist;
+    algo->avg_dist = DEC_DIST * distance + (1.0 - DEC_DIST) * algo->avg_dist;
     // dist_count++;
     // printf("avg_dist: %f\n", avg_dist);
 
@@ -113,12 +128,12 @@ static double calc_distance(struct tmem_page *a, struct tmem_page *b) {
 
 static void update_neighbors(struct tmem_page *old_page) {
     // cool neighbors
-    for (uint32_t i = 0; i < MAX_NEIGHBORS; i++) {
-        old_page->neighbors[i].distance *= 1.01;
+    for (uint32_t i = 0; i < tmem_cfg.max_neighbors; i++) {
+        old_page->meta->neighbors[i].distance *= 1.01;
     }
 
-    for (uint32_t i = 0; i < HISTORY_SIZE; i++) {
-        struct tmem_page *cur_page = page_history[i];
+    for (uint32_t i = 0; i < tmem_cfg.his_size; i++) {
+        struct tmem_page *cur_page = algo->page_history[i];
         if (cur_page == old_page) continue;
 
         double distance = calc_distance(old_page, cur_page);
@@ -126,25 +141,25 @@ static void update_neighbors(struct tmem_page *old_page) {
         
         // Find empty spot or furthest distance neighbor O(MAX_NEIGHBORS)
         struct neighbor_page *furthest_neighbor = NULL;
-        for (uint32_t j = 0; j < MAX_NEIGHBORS; j++) {
-            if (old_page->neighbors[j].page == cur_page) {
+        for (uint32_t j = 0; j < tmem_cfg.max_neighbors; j++) {
+            if (old_page->meta->neighbors[j].page == cur_page) {
                 // already a neighbor, update and continue
                 // LOG_DEBUG("Already a neighbor\n");
-                furthest_neighbor = &old_page->neighbors[j];
+                furthest_neighbor = &old_page->meta->neighbors[j];
                 furthest_neighbor->distance = 0;
                 break;
             }
-            if (old_page->neighbors[j].page == NULL) {  // empty spot
+            if (old_page->meta->neighbors[j].page == NULL) {  // empty spot
                 // LOG_DEBUG("Empty spot\n");
-                assert(old_page->neighbors[j].distance == 0);
-                assert(old_page->neighbors[j].time_diff == 0);
+                assert(old_page->meta->neighbors[j].distance == 0);
+                assert(old_page->meta->neighbors[j].time_diff == 0);
                 // printf("found empty spot\n");
-                furthest_neighbor = &old_page->neighbors[j];
+                furthest_neighbor = &old_page->meta->neighbors[j];
                 break;
             }
 
-            if (furthest_neighbor == NULL || old_page->neighbors[j].distance > furthest_neighbor->distance) {
-                furthest_neighbor = &old_page->neighbors[j];
+            if (furthest_neighbor == NULL || old_page->meta->neighbors[j].distance > furthest_neighbor->distance) {
+                furthest_neighbor = &old_page->meta->neighbors[j];
             }
         }
 
@@ -160,8 +175,8 @@ static void update_neighbors(struct tmem_page *old_page) {
     }
     // printf("Neighbors:\t");
     // for (uint32_t i = 0; i < MAX_NEIGHBORS; i++) {
-    //     if (old_page->neighbors[i].page != NULL)
-    //         printf("0x%lx, ", old_page->neighbors[i].page->va);
+    //     if (old_page->meta->neighbors[i].page != NULL)
+    //         printf("0x%lx, ", old_page->meta->neighbors[i].page->va);
     // }
     // printf("\n");
 }
@@ -171,20 +186,20 @@ void algo_add_page(struct tmem_page *page) {
     // then replace it with the new page
 
     // find oldest page O(HISTORY_SIZE)
-    struct tmem_page *old_page = page_history[page_his_idx];
-    uint32_t old_idx = page_his_idx;
+    struct tmem_page *old_page = algo->page_history[algo->page_his_idx];
+    uint32_t old_idx = algo->page_his_idx;
 
     if (old_page == NULL) {
         // LOG_DEBUG("ALGO: History not full yet\n");
         // History not full yet, add page and return
-        page_history[page_his_idx] = page;
-        page_his_idx = (page_his_idx + 1) % HISTORY_SIZE;
+        algo->page_history[algo->page_his_idx] = page;
+        algo->page_his_idx = (algo->page_his_idx + 1) % tmem_cfg.his_size;
         return;
     }
-    for (uint32_t i = 0; i < HISTORY_SIZE; i++) {
-        if (page_history[i]->cyc_accessed < old_page->cyc_accessed) {
+    for (uint32_t i = 0; i < tmem_cfg.his_size; i++) {
+        if (algo->page_history[i]->cyc_accessed < old_page->cyc_accessed) {
             old_idx = i;
-            old_page = page_history[i];
+            old_page = algo->page_history[i];
         }
     }
 
@@ -192,7 +207,7 @@ void algo_add_page(struct tmem_page *page) {
 
     update_neighbors(old_page);
 
-    page_history[old_idx] = page;
+    algo->page_history[old_idx] = page;
     
 }
 
@@ -229,41 +244,44 @@ void algo_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, u
     if (pebs_stats.throttles > pebs_stats.unthrottles) return;
     // record_sample(page); //29
 
-    if (hot_list.numentries == 0) {
+    uint64_t waiting = 0;
+    for (uint32_t t = TOP_TIER + 1; t < tmem_cfg.num_tiers; t++) {
+        waiting += hot_queue_len(&hot_queues[t]);
+    }
+    if (waiting == 0) {
         mig_queue_time = 0;
     }
 
     assert(*idx == 0);
     // double threshold = avg_dist / 4000;
     // LOG_DEBUG("Threshold: %.2e, avg_dist: %.2e\n", bot_dist, avg_dist);
-    double threshold = bot_dist;
-
-#if DFS_ALGO == 1
-    // DFS
-    uint64_t tot_time_diff = 0;
-    struct tmem_page *cur_page = page;
-    for (uint32_t d = 0; d < MAX_PRED_DEPTH; d++) {
-        struct neighbor_page *closest_neighbor = NULL;
-        // if (d > 1) {
-        //     LOG_DEBUG("PRED: Depth=%u\n", d);
-        // }
-        for (uint32_t i = 0; i < MAX_NEIGHBORS; i++) {
-            if (cur_page->neighbors[i].distance != 0 && cur_page->neighbors[i].distance < threshold) {
-                // found close neighbor
-                if (closest_neighbor == NULL || cur_page->neighbors[i].distance < closest_neighbor->distance) {
-                    closest_neighbor = &page->neighbors[i];
-                }
-                if (cur_page->neighbors[i].time_diff + tot_time_diff > mig_move_time + mig_queue_time) {
-                    // Far enough into future to migrate
-                    pred_pages[(*idx)++] = cur_page->neighbors[i].page;
+    double threshold = algo->bot_dist;
+
+    if (tmem_cfg.dfs_algo) {
+        // DFS
+        uint64_t tot_time_diff = 0;
+        struct tmem_page *cur_page = page;
+        for (uint32_t d = 0; d < tmem_cfg.pred_depth; d++) {
+            struct neighbor_page *closest_neighbor = NULL;
+            // if (d > 1) {
+            //     LOG_DEBUG("PRED: Depth=%u\n", d);
+            // }
+            for (uint32_t i = 0; i < tmem_cfg.max_neighbors; i++) {
+                if (cur_page->meta->neighbors[i].distance != 0 && cur_page->meta->neighbors[i].distance < threshold) {
+                    // found close neighbor
+                    if (closest_neighbor == NULL || cur_page->meta->neighbors[i].distance < closest_neighbor->distance) {
+                        closest_neighbor = &page->meta->neighbors[i];
+                    }
+                    if (cur_page->meta->neighbors[i].time_diff + tot_time_diff > mig_move_time + mig_queue_time) {
+                        // Far enough into future to migrate
+                        pred_pages[(*idx)++] = cur_page->meta->neighbors[i].page;
+                    }
                 }
             }
+            if (closest_neighbor == NULL || closest_neighbor->page == NULL) break;
+            cur_page = closest_neighbor->page;
+            tot_time_diff += closest_neighbor->time_diff;
         }
-        if (closest_neighbor == NULL || closest_neighbor->page == NULL) break;
-        cur_page = closest_neighbor->page;
-        tot_time_diff += closest_neighbor->time_diff;
     }
 
-#endif
-
 }
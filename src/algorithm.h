@@ -31,15 +31,42 @@
     #define MAX_PRED_DEPTH 16
 #endif
 
+// Predictor used with cluster_algo (tmem_cfg.pred_algo)
+#ifndef PRED_ALGO
+    #define PRED_ALGO 0
+#endif
+
+// Min probability in percent of a Markov prediction
+#ifndef PRED_CONF
+    #define PRED_CONF 30
+#endif
+
+enum {
+    PRED_NEIGHBOR,  // nearest neighbors by va, cycle and ip distance
+    PRED_MARKOV,    // page transition counts, see markov.h
+    PRED_STRIDE,    // per ip strides, see stride.h
+    NUM_PRED_ALGOS
+};
+
+
+// Prediction state, one per scan thread shard
+struct algo_state {
+    struct tmem_page *page_history[HISTORY_SIZE];
+    uint32_t page_his_idx;
+    double bot_dist;
+    double avg_dist;
+};
 
-extern struct tmem_page *page_history[HISTORY_SIZE];
-extern uint32_t page_his_idx;
+extern struct algo_state algo_states[MAX_SCAN_THREADS];
 extern double mig_time;
 extern double mig_queue_time;
 extern double mig_move_time;
-extern double bot_dist;
-extern double avg_dist;
+extern double mig_page_time;
+extern double mig_residency;
 
+void algo_set_shard(uint32_t shard);
+double algo_bot_dist();
+double algo_avg_dist();
 void algo_add_page(struct tmem_page *page);
 struct tmem_page* algo_predict_page(struct tmem_page *page);
 void algo_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, uint32_t *idx);
@@ -0,0 +1,79 @@
+#include "alloc-site.h"
+#include "tmem.h"
+#include "policy.h"
+
+struct alloc_site {
+    _Atomic uint64_t ip;
+    _Atomic long mapped;        // bytes tracked from mmaps made here
+    double heat;                // sampled accesses per byte, averaged over cooling periods
+    uint32_t updates;           // periods it had bytes mapped
+};
+
+// sites[0] is every allocation without a known site
+static struct alloc_site sites[ALLOC_MAX_SITES];
+static uint32_t num_sites = 0;
+static double tier_heat[MAX_TIERS];
+
+// Only site_update writes these, from migrate worker 0
+static double site_rate[ALLOC_MAX_SITES];
+static double tier_rate[MAX_TIERS];
+
+uint16_t site_lookup(uint64_t ip) {
+    if (ip == 0) return 0;
+    uint64_t h = (ip * 0x9E3779B97F4A7C15UL) >> 32;
+    for (uint32_t n = 0; n < 8; n++) {
+        uint16_t i = 1 + (h + n) % (ALLOC_MAX_SITES - 1);
+        uint64_t cur = atomic_load_explicit(&sites[i].ip, memory_order_acquire);
+        if (cur == 0 && atomic_compare_exchange_strong(&sites[i].ip, &cur, ip)) {
+            __atomic_fetch_add(&num_sites, 1, __ATOMIC_RELAXED);
+            return i;
+        }
+        if (cur == ip) return i;
+    }
+    return 0;
+}
+
+void site_mapped(uint16_t site, long bytes) {
+    atomic_fetch_add_explicit(&sites[site].mapped, bytes, memory_order_relaxed);
+}
+
+uint32_t site_first_tier(uint16_t site) {
+    struct alloc_site *s = &sites[site];
+    if (site == 0 || __atomic_load_n(&s->updates, __ATOMIC_RELAXED) < SITE_WARMUP) return TOP_TIER;
+    // a stale heat only misplaces one mmap, the policy fixes it up
+    uint32_t t = TOP_TIER;
+    while (!is_last_tier(t) && s->heat < tier_heat[t + 1]) t++;
+    return t;
+}
+
+static void site_sum_page(struct tmem_page *page, void *arg) {
+    if (page->free || page->discarded) return;
+    double rate = page_access_rate(page);
+    site_rate[page->meta->site] += rate;
+    tier_rate[page->tier] += rate;
+}
+
+// Recomputes the heat of every site and tier from the pages' access rates
+void site_update() {
+    memset(site_rate, 0, sizeof(site_rate));
+    memset(tier_rate, 0, sizeof(tier_rate));
+    pindex_for_each(site_sum_page, NULL);
+
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        long own = __atomic_load_n(&tier_own[t], __ATOMIC_RELAXED);
+        tier_heat[t] = own > 0 ? tier_rate[t] / own : 0;
+    }
+    for (uint32_t i = 1; i < ALLOC_MAX_SITES; i++) {
+        struct alloc_site *s = &sites[i];
+        long mapped = atomic_load_explicit(&s->mapped, memory_order_relaxed);
+        if (mapped <= 0) continue;
+        double heat = site_rate[i] / mapped;
+        if (s->updates > 0) heat = (s->heat + heat) / 2;
+        s->heat = heat;
+        __atomic_fetch_add(&s->updates, 1, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t site_count() {
+    return __atomic_load_n(&num_sites, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,54 @@
+#ifndef _ALLOC_SITE_HEADER
+#define _ALLOC_SITE_HEADER
+
+/*
+    Allocation-site placement (site_algo)
+
+    tmem_mmap fills the tiers first come first served, so a cold buffer
+    allocated early holds DRAM that a hot one allocated later has to be
+    migrated into. With site_algo every tracked mmap remembers where it was
+    allocated: the return address of the application's call into mmap, or
+    into malloc and friends for blocks libc maps (alloc_site_ip). Once per
+    cooling period migrate worker 0 sums the sampled access rate of every
+    page by site (site_update). A site's heat is that rate over the bytes
+    it has mapped, a tier's is the rate of its pages over the bytes in it.
+
+    A later mmap from a known site skips every tier whose next tier down is,
+    on average, hotter than the site, so a site colder than what's already
+    in the lower tiers doesn't take DRAM from it. Sites never seen before,
+    and sites not observed for SITE_WARMUP periods yet, are placed as usual.
+*/
+
+#include <stdint.h>
+
+#include "config.h"
+
+// Sites tracked, the rest are placed as usual
+#ifndef ALLOC_MAX_SITES
+    #define ALLOC_MAX_SITES 1024
+#endif
+
+// Smallest malloc whose call site is passed to the mmap libc may make for it,
+// glibc's smallest mmap threshold
+#ifndef ALLOC_SITE_MIN_SIZE
+    #define ALLOC_SITE_MIN_SIZE (128 * 1024UL)
+#endif
+
+// Cooling periods a site is observed before its heat decides its placement
+#ifndef SITE_WARMUP
+    #define SITE_WARMUP 2
+#endif
+
+// Return address of the application call that may mmap, 0 if none
+extern _Thread_local uint64_t alloc_site_ip;
+
+// Site id of ip, 0 if ip is 0 or the table is full. The arenas (arena.c) key
+// their bins by it too
+uint16_t site_lookup(uint64_t ip);
+// Tier a new mmap from site starts filling from
+uint32_t site_first_tier(uint16_t site);
+void site_mapped(uint16_t site, long bytes);
+void site_update();
+uint32_t site_count();
+
+#endif
@@ -0,0 +1,437 @@
+#include "interpose.h"
+#include "arena.h"
+#include "alloc-site.h"
+
+#include <sys/mman.h>
+
+_Static_assert((ARENA_MAX_SIZE & (ARENA_MAX_SIZE - 1)) == 0 && ARENA_MAX_SIZE >= 256, "ARENA_MAX_SIZE must be a power of 2");
+
+// 16 byte classes up to 128, then 4 per power of 2
+#define ARENA_CLASSES (8 + 4 * (__builtin_ctzl(ARENA_MAX_SIZE) - 7))
+
+struct arena_bin;
+
+// Kept out of the arenas, indexed by their offset in the reserved range
+struct arena {
+    struct arena_bin *bin;      // NULL while free
+    void *free;                 // freed objects, linked through their first word
+    uint32_t size;              // of the objects
+    uint32_t capacity;
+    uint32_t bump;              // objects never handed out start here
+    uint32_t used;
+    struct arena *next, *prev;  // bin's partial list or free_arenas
+    bool partial;
+};
+
+// One size class of one site
+struct arena_bin {
+    pthread_mutex_t lock;
+    struct arena *current;      // objects come from here
+    struct arena *partial;      // arenas with room, except current
+};
+
+struct arena_site {
+    struct arena_bin bins[ARENA_CLASSES];
+};
+
+static bool arena_on = false;
+static uint64_t arena_lo = 0, arena_hi = 0;
+static uint64_t arena_next;                 // first arena never mapped
+static struct arena *arenas;
+static struct arena *free_arenas = NULL;
+static uint64_t num_free_arenas = 0;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t arena_bytes = 0;
+
+// Bins of every site id (site_lookup), set on its first allocation. sites[0]
+// is shared by the sites that didn't get bins of their own and by site 0
+static struct arena_site sites[ARENA_MAX_SITES];
+static struct arena_site *site_bins[ALLOC_MAX_SITES];
+static uint32_t num_sites = 0;
+
+static void* (*libc_calloc)(size_t nmemb, size_t size) = NULL;
+static void* (*libc_realloc)(void *p, size_t size) = NULL;
+static void* (*libc_memalign)(size_t align, size_t size) = NULL;
+static size_t (*libc_usable_size)(void *p) = NULL;
+static bool libc_bound = false;
+
+// Allocations made by dlsym while libc's functions are being looked up
+static char bootstrap_buf[64 * 1024] __attribute__((aligned(64)));
+static uint64_t bootstrap_used = 0;
+static _Thread_local bool binding = false;
+
+static void* bootstrap_alloc(size_t size) {
+    uint64_t off = __atomic_fetch_add(&bootstrap_used, (size + 15) & ~15UL, __ATOMIC_RELAXED);
+    assert(off + size <= sizeof(bootstrap_buf));
+    return bootstrap_buf + off;
+}
+
+static inline bool in_bootstrap(void *p) {
+    return (char *)p >= bootstrap_buf && (char *)p < bootstrap_buf + sizeof(bootstrap_buf);
+}
+
+// malloc can be called before the constructor runs, so libc's are looked up on first use
+static bool bind_libc() {
+    if (__atomic_load_n(&libc_bound, __ATOMIC_ACQUIRE)) return true;
+    if (binding) return false;
+    binding = true;
+    libc_malloc = dlsym(RTLD_NEXT, "malloc");
+    libc_free = dlsym(RTLD_NEXT, "free");
+    libc_calloc = dlsym(RTLD_NEXT, "calloc");
+    libc_realloc = dlsym(RTLD_NEXT, "realloc");
+    libc_memalign = dlsym(RTLD_NEXT, "memalign");
+    libc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+    binding = false;
+    __atomic_store_n(&libc_bound, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline uint32_t size_class(size_t size) {
+    if (size <= 128) return size == 0 ? 0 : (size - 1) / 16;
+    uint32_t k = 63 - __builtin_clzl(size - 1);     // 2^k < size <= 2^(k + 1)
+    return 8 + (k - 7) * 4 + (size - 1 - (1UL << k)) / (1UL << (k - 2));
+}
+
+static inline size_t class_size(uint32_t c) {
+    if (c < 8) return (c + 1) * 16;
+    uint32_t k = 7 + (c - 8) / 4;
+    return (1UL << k) + ((c - 8) % 4 + 1) * (1UL << (k - 2));
+}
+
+static inline bool arena_owns(void *p) {
+    return (uint64_t)p >= arena_lo && (uint64_t)p < arena_hi;
+}
+
+static inline struct arena* arena_of(void *p) {
+    return &arenas[((uint64_t)p - arena_lo) / ARENA_SIZE];
+}
+
+static inline uint64_t arena_base(struct arena *a) {
+    return arena_lo + (uint64_t)(a - arenas) * ARENA_SIZE;
+}
+
+// Same site ids as site_algo's placement, so the two can't disagree on a site
+static struct arena_site* site_of(uint64_t ip) {
+    uint16_t id = site_lookup(ip);
+    struct arena_site *site = __atomic_load_n(&site_bins[id], __ATOMIC_ACQUIRE);
+    if (site != NULL) return site;
+    // first allocation from the site
+    pthread_mutex_lock(&arena_lock);
+    site = site_bins[id];
+    if (site == NULL) {
+        site = num_sites + 1 < ARENA_MAX_SITES ? &sites[++num_sites] : &sites[0];
+        __atomic_store_n(&site_bins[id], site, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&arena_lock);
+    return site;
+}
+
+static void partial_remove(struct arena_bin *bin, struct arena *a) {
+    if (a->prev != NULL) a->prev->next = a->next;
+    else bin->partial = a->next;
+    if (a->next != NULL) a->next->prev = a->prev;
+    a->partial = false;
+}
+
+static void partial_push(struct arena_bin *bin, struct arena *a) {
+    a->prev = NULL;
+    a->next = bin->partial;
+    if (bin->partial != NULL) bin->partial->prev = a;
+    bin->partial = a;
+    a->partial = true;
+}
+
+// A free arena or a newly mapped one, NULL once the reserved range is used up
+static struct arena* arena_take() {
+    pthread_mutex_lock(&arena_lock);
+    struct arena *a = free_arenas;
+    if (a != NULL) {
+        free_arenas = a->next;
+        num_free_arenas--;
+    } else if (arena_next < arena_hi) {
+        void *p = tmem_mmap((void *)arena_next, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        a = arena_of(p);
+        arena_next += ARENA_SIZE;
+    }
+    pthread_mutex_unlock(&arena_lock);
+    return a;
+}
+
+// The memory goes back to the kernel and stops counting in its tier (tmem_madvise)
+static void arena_release(struct arena *a) {
+    tmem_madvise((void *)arena_base(a), ARENA_SIZE, MADV_DONTNEED);
+    pthread_mutex_lock(&arena_lock);
+    a->bin = NULL;
+    a->next = free_arenas;
+    free_arenas = a;
+    num_free_arenas++;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+// Hottest of the first ARENA_REFILL_SCAN arenas with room: the fastest tier,
+// then the most sampled. Arenas without metadata yet (lazy_meta) come last
+static struct arena* bin_pick(struct arena_bin *bin) {
+    struct arena *best = NULL;
+    uint32_t best_tier = UINT32_MAX;
+    uint64_t best_accesses = 0;
+    uint32_t n = 0;
+    for (struct arena *a = bin->partial; a != NULL && n < ARENA_REFILL_SCAN; a = a->next, n++) {
+        struct tmem_page *page = find_page_no_lock(arena_base(a));
+        uint32_t tier = page != NULL ? page->tier : tmem_cfg.num_tiers;
+        uint64_t accesses = page != NULL ? page->accesses : 0;
+        if (best == NULL || tier < best_tier || (tier == best_tier && accesses > best_accesses)) {
+            best = a;
+            best_tier = tier;
+            best_accesses = accesses;
+        }
+    }
+    return best;
+}
+
+// Makes an arena with room current, bin is locked. false if there's none left
+static bool bin_refill(struct arena_bin *bin, uint32_t c) {
+    struct arena *a = bin_pick(bin);
+    if (a != NULL) {
+        partial_remove(bin, a);
+        bin->current = a;
+        return true;
+    }
+    a = arena_take();
+    if (a == NULL) return false;
+    a->bin = bin;
+    a->free = NULL;
+    a->size = class_size(c);
+    a->capacity = ARENA_SIZE / a->size;
+    a->bump = 0;
+    a->used = 0;
+    a->partial = false;
+    bin->current = a;
+    return true;
+}
+
+// NULL if it has to come from libc
+static void* arena_alloc(size_t size, uint64_t ip) {
+    if (!arena_on || internal_call || size > ARENA_MAX_SIZE) return NULL;
+    uint32_t c = size_class(size);
+    struct arena_bin *bin = &site_of(ip)->bins[c];
+
+    pthread_mutex_lock(&bin->lock);
+    struct arena *a = bin->current;
+    if (a == NULL || (a->free == NULL && a->bump == a->capacity)) {
+        // a full arena is on no list until one of its objects is freed
+        if (!bin_refill(bin, c)) {
+            pthread_mutex_unlock(&bin->lock);
+            return NULL;
+        }
+        a = bin->current;
+    }
+    void *p;
+    if (a->free != NULL) {
+        p = a->free;
+        a->free = *(void **)p;
+    } else {
+        p = (void *)(arena_base(a) + (uint64_t)a->bump++ * a->size);
+    }
+    a->used++;
+    pthread_mutex_unlock(&bin->lock);
+    __atomic_fetch_add(&arena_bytes, a->size, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void arena_free(void *p) {
+    struct arena *a = arena_of(p);
+    struct arena_bin *bin = a->bin;
+    __atomic_fetch_sub(&arena_bytes, a->size, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&bin->lock);
+    *(void **)p = a->free;
+    a->free = p;
+    a->used--;
+    if (a != bin->current) {
+        if (a->used == 0) {
+            if (a->partial) partial_remove(bin, a);
+            pthread_mutex_unlock(&bin->lock);
+            arena_release(a);
+            return;
+        }
+        if (!a->partial) partial_push(bin, a);
+    }
+    pthread_mutex_unlock(&bin->lock);
+}
+
+void arena_init() {
+    if (!tmem_cfg.arena_algo) return;
+    // one extra arena to align the range
+    void *p = libc_mmap(NULL, ARENA_RESERVE + ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(p != MAP_FAILED);
+    uint64_t num_arenas = ARENA_RESERVE / ARENA_SIZE;
+    arenas = libc_mmap(NULL, num_arenas * sizeof(struct arena), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(arenas != MAP_FAILED);
+    arena_lo = arena_next = ((uint64_t)p + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1);
+    arena_hi = arena_lo + ARENA_RESERVE;
+    site_bins[0] = &sites[0];
+    bind_libc();
+    __atomic_store_n(&arena_on, true, __ATOMIC_RELEASE);
+    LOG_DEBUG("arena: reserved 0x%lx - 0x%lx\n", arena_lo, arena_hi);
+}
+
+void arena_get_stats(struct arena_stats *st) {
+    memset(st, 0, sizeof(*st));
+    st->arenas = (arena_next - arena_lo) / ARENA_SIZE;
+    st->free_arenas = num_free_arenas;
+    st->bytes = __atomic_load_n(&arena_bytes, __ATOMIC_RELAXED);
+    st->sites = __atomic_load_n(&num_sites, __ATOMIC_RELAXED);
+    for (uint64_t i = 0; i < st->arenas; i++) {
+        if (__atomic_load_n(&arenas[i].bin, __ATOMIC_RELAXED) == NULL) continue;
+        struct tmem_page *page = find_page_no_lock(arena_lo + i * ARENA_SIZE);
+        if (page != NULL) st->tier_arenas[page->tier]++;
+    }
+}
+
+// A block big enough that libc may mmap (or mremap) it for the call at ip
+// passes ip on as the site of the mmap, true if it did
+static inline bool site_enter(size_t size, uint64_t ip) {
+    if (size < ALLOC_SITE_MIN_SIZE || alloc_site_ip != 0) return false;
+    alloc_site_ip = ip;
+    return true;
+}
+
+static inline void site_leave(bool entered) {
+    if (entered) alloc_site_ip = 0;
+}
+
+static void* alloc_ip(size_t size, uint64_t ip) {
+    void *p = arena_alloc(size, ip);
+    if (p != NULL) return p;
+    if (!bind_libc()) return bootstrap_alloc(size);
+    bool site = site_enter(size, ip);
+    p = libc_malloc(size);
+    site_leave(site);
+    return p;
+}
+
+/*
+    The malloc family. Only pointers in the arena range are ours, the rest
+    (including blocks libc handed out before arena_init) go back to libc
+*/
+
+void* malloc(size_t size) {
+    return alloc_ip(size, (uint64_t)__builtin_return_address(0));
+}
+
+void free(void *p) {
+    if (p == NULL || in_bootstrap(p)) return;
+    if (arena_owns(p)) {
+        arena_free(p);
+        return;
+    }
+    bind_libc();
+    libc_free(p);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t ip = (uint64_t)__builtin_return_address(0);
+    void *p = arena_alloc(total, ip);
+    if (p != NULL) return memset(p, 0, total);
+    // bootstrap_buf is still zero
+    if (!bind_libc()) return bootstrap_alloc(total);
+    bool site = site_enter(total, ip);
+    p = libc_calloc(nmemb, size);
+    site_leave(site);
+    return p;
+}
+
+static void* realloc_ip(void *p, size_t size, uint64_t ip) {
+    if (p == NULL) return alloc_ip(size, ip);
+    if (!arena_owns(p) && !in_bootstrap(p)) {
+        bind_libc();
+        bool site = site_enter(size, ip);
+        void *q = libc_realloc(p, size);
+        site_leave(site);
+        return q;
+    }
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+    size_t old = in_bootstrap(p) ? (size_t)(bootstrap_buf + sizeof(bootstrap_buf) - (char *)p) : arena_of(p)->size;
+    if (size <= old && arena_owns(p)) return p;
+    void *q = alloc_ip(size, ip);
+    if (q == NULL) return NULL;
+    memcpy(q, p, size < old ? size : old);
+    free(p);
+    return q;
+}
+
+void* realloc(void *p, size_t size) {
+    return realloc_ip(p, size, (uint64_t)__builtin_return_address(0));
+}
+
+void* reallocarray(void *p, size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc_ip(p, total, (uint64_t)__builtin_return_address(0));
+}
+
+// Power of 2 classes are aligned to their size, arenas are ARENA_SIZE aligned
+static void* memalign_ip(size_t align, size_t size, uint64_t ip) {
+    if (align <= ARENA_MAX_SIZE) {
+        size_t want = size;
+        if (align > 16) {
+            if (want < align) want = align;
+            want = 1UL << (64 - __builtin_clzl(want - 1));
+        }
+        void *p = arena_alloc(want, ip);
+        if (p != NULL) return p;
+    }
+    bind_libc();
+    bool site = site_enter(size, ip);
+    void *p = libc_memalign(align, size);
+    site_leave(site);
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0) return EINVAL;
+    void *p = memalign_ip(align, size, (uint64_t)__builtin_return_address(0));
+    if (p == NULL) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign_ip(align, size, (uint64_t)__builtin_return_address(0));
+}
+
+void* memalign(size_t align, size_t size) {
+    return memalign_ip(align, size, (uint64_t)__builtin_return_address(0));
+}
+
+void* valloc(size_t size) {
+    return memalign_ip(BASE_PAGE_SIZE, size, (uint64_t)__builtin_return_address(0));
+}
+
+void* pvalloc(size_t size) {
+    return memalign_ip(BASE_PAGE_SIZE, (size + BASE_PAGE_SIZE - 1) & ~(BASE_PAGE_SIZE - 1), (uint64_t)__builtin_return_address(0));
+}
+
+size_t malloc_usable_size(void *p) {
+    if (p == NULL) return 0;
+    if (arena_owns(p)) return arena_of(p)->size;
+    if (in_bootstrap(p)) return 0;
+    bind_libc();
+    return libc_usable_size(p);
+}
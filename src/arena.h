@@ -0,0 +1,64 @@
+#ifndef _ARENA_HEADER
+#define _ARENA_HEADER
+
+/*
+    Tiered malloc arenas (arena_algo)
+
+    Allocations below glibc's mmap threshold come from its brk heap, which
+    tmem never sees. With arena_algo the library's malloc family serves
+    allocations up to ARENA_MAX_SIZE from arenas instead: ARENA_SIZE aligned
+    blocks carved out of one reserved range, each mapped through tmem_mmap so
+    it's tracked and migrated like any other page. Everything else, and every
+    allocation made by the library itself, goes to libc.
+
+    An arena holds objects of one size class from one allocation site (the
+    return address of the malloc call), so objects used together share pages
+    and a hot site's objects don't get diluted by a cold site's. When an
+    arena fills up the next one is picked by hotness as the policy sees it:
+    of the site's arenas with room, the one in the fastest tier, then the most
+    sampled. Arenas whose last object is freed are given back with
+    MADV_DONTNEED and reused by any site.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#ifndef ARENA_SIZE
+    #define ARENA_SIZE (2 * 1024UL * 1024UL)
+#endif
+
+// Address space reserved for arenas, nothing is mapped until it's used
+#ifndef ARENA_RESERVE
+    #define ARENA_RESERVE (64UL << 30)
+#endif
+
+// Largest allocation served from an arena, must be a power of 2
+#ifndef ARENA_MAX_SIZE
+    #define ARENA_MAX_SIZE (128 * 1024UL)
+#endif
+
+// Allocation sites with arenas of their own, the rest share one set
+#ifndef ARENA_MAX_SITES
+    #define ARENA_MAX_SITES 64
+#endif
+
+// Arenas with room looked at when a site's arena fills up
+#ifndef ARENA_REFILL_SCAN
+    #define ARENA_REFILL_SCAN 8
+#endif
+
+struct arena_stats {
+    uint64_t arenas;            // mapped so far
+    uint64_t free_arenas;       // given back, waiting to be reused
+    uint64_t bytes;             // handed out to the application
+    uint32_t sites;
+    uint64_t tier_arenas[MAX_TIERS];    // in use, by the tier of their first page
+};
+
+// Reserves the arena range, allocations go to libc until it's called
+void arena_init();
+void arena_get_stats(struct arena_stats *st);
+
+#endif
@@ -0,0 +1,399 @@
+#include "config.h"
+#include "tmem.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifndef CLUSTER_ALGO
+    #define CLUSTER_ALGO 0
+#endif
+
+#ifndef HEM_ALGO
+    #define HEM_ALGO 0
+#endif
+
+#ifndef DFS_ALGO
+    #define DFS_ALGO 0
+#endif
+
+#ifndef DEC_UP
+    #define DEC_UP 0.01
+#endif
+
+#ifndef DEC_DOWN
+    #define DEC_DOWN 0.0001
+#endif
+
+struct tmem_config tmem_cfg = {
+    .cluster_algo = CLUSTER_ALGO,
+    .hem_algo = HEM_ALGO,
+    .lru_algo = LRU_ALGO,
+    .dfs_algo = DFS_ALGO,
+    .pred_algo = PRED_ALGO,
+    .pred_conf = PRED_CONF,
+    .his_size = HISTORY_SIZE,
+    .pred_depth = MAX_PRED_DEPTH,
+    .max_neighbors = MAX_NEIGHBORS,
+    .dec_up = DEC_UP,
+    .dec_down = DEC_DOWN,
+    .hot_threshold = HOT_THRESHOLD,
+    .admit_algo = ADMIT_ALGO,
+    .admit_lat_delta = ADMIT_LAT_DELTA,
+    .admit_budget = ADMIT_BUDGET,
+    .subpage_algo = SUBPAGE_ALGO,
+    .subpage_dense = SUBPAGE_DENSE,
+    .lazy_meta = LAZY_META,
+    .arena_algo = ARENA_ALGO,
+    .site_algo = SITE_ALGO,
+
+    .sample_backend = SAMPLE_BACKEND,
+    .idle_scan_ms = PAGE_IDLE_SCAN_MS,
+    .sample_period = SAMPLE_PERIOD,
+    .adaptive_period = ADAPTIVE_PERIOD,
+    .sample_period_max = SAMPLE_PERIOD_MAX,
+    .target_sample_rate = TARGET_SAMPLE_RATE,
+    .scan_budget = SCAN_BUDGET,
+    .epoll_scan = EPOLL_SCAN,
+    .scan_threads = PEBS_SCAN_THREADS,
+    .pebs_nprocs = PEBS_NPROCS,
+
+    .page_size = PAGE_SIZE,
+    .dram_size = DRAM_SIZE,
+    .dram_buffer = DRAM_BUFFER,
+    .mig_batch = MIG_BATCH_SIZE,
+    .mig_threads = MIG_THREADS,
+    .demote_wm_low = DEMOTE_WM_LOW,
+    .demote_wm_high = DEMOTE_WM_HIGH,
+    .mig_promote_rate = MIG_PROMOTE_RATE,
+    .mig_demote_rate = MIG_DEMOTE_RATE,
+
+    .num_tiers = sizeof((long[]){TIER_NODES}) / sizeof(long),
+    .tier_nodes = {TIER_NODES},
+    .num_tier_sizes = 0,
+
+    .scan_cpu = PEBS_SCAN_CPU,
+    .scan_cpu_stride = PEBS_SCAN_CPU_STRIDE,
+    .stats_cpu = PEBS_STATS_CPU,
+    .migrate_cpu = MIGRATE_CPU,
+    .migrate_cpu_stride = MIGRATE_CPU_STRIDE,
+};
+
+enum cfg_type {
+    CFG_INT,
+    CFG_U32,
+    CFG_U64,
+    CFG_LONG,
+    CFG_DOUBLE,
+    CFG_LIST    // comma separated longs, len holds the count
+};
+
+struct cfg_knob {
+    const char *name;
+    enum cfg_type type;
+    void *val;
+    uint64_t max;   // 0 for no max, max entries for lists
+    uint32_t *len;
+    bool runtime;   // picked up again when the TMEM_CONFIG file changes
+};
+
+static const struct cfg_knob knobs[] = {
+    {"cluster_algo",    CFG_INT,    &tmem_cfg.cluster_algo,     1},
+    {"hem_algo",        CFG_INT,    &tmem_cfg.hem_algo,         1},
+    {"lru_algo",        CFG_INT,    &tmem_cfg.lru_algo,         NUM_LRU_ALGOS - 1},
+    {"dfs_algo",        CFG_INT,    &tmem_cfg.dfs_algo,         1},
+    {"pred_algo",       CFG_INT,    &tmem_cfg.pred_algo,        NUM_PRED_ALGOS - 1},
+    {"pred_conf",       CFG_U32,    &tmem_cfg.pred_conf,        100},
+    {"his_size",        CFG_U32,    &tmem_cfg.his_size,         HISTORY_SIZE},
+    {"pred_depth",      CFG_U32,    &tmem_cfg.pred_depth,       MAX_PRED_DEPTH},
+    {"max_neighbors",   CFG_U32,    &tmem_cfg.max_neighbors,    MAX_NEIGHBORS},
+    {"dec_up",          CFG_DOUBLE, &tmem_cfg.dec_up,           0},
+    {"dec_down",        CFG_DOUBLE, &tmem_cfg.dec_down,         0},
+    {"hot_threshold",   CFG_U64,    &tmem_cfg.hot_threshold,    0},
+    {"admit_algo",      CFG_INT,    &tmem_cfg.admit_algo,       1},
+    {"admit_lat_delta", CFG_U64,    &tmem_cfg.admit_lat_delta,  0},
+    {"admit_budget",    CFG_U32,    &tmem_cfg.admit_budget,     100},
+    {"subpage_algo",    CFG_INT,    &tmem_cfg.subpage_algo,     1},
+    {"subpage_dense",   CFG_U32,    &tmem_cfg.subpage_dense,    100},
+    {"lazy_meta",       CFG_INT,    &tmem_cfg.lazy_meta,        1},
+    {"arena_algo",      CFG_INT,    &tmem_cfg.arena_algo,       1},
+    {"site_algo",       CFG_INT,    &tmem_cfg.site_algo,        1},
+
+    {"sample_backend",  CFG_INT,    &tmem_cfg.sample_backend,   NUM_SAMPLE_BACKENDS - 1},
+    {"idle_scan_ms",    CFG_U32,    &tmem_cfg.idle_scan_ms,     0},
+    {"sample_period",   CFG_U64,    &tmem_cfg.sample_period,    0},
+    {"adaptive_period", CFG_INT,    &tmem_cfg.adaptive_period,  1},
+    {"sample_period_max", CFG_U64,  &tmem_cfg.sample_period_max, 0},
+    {"target_sample_rate", CFG_U64, &tmem_cfg.target_sample_rate, 0},
+    {"scan_budget",     CFG_U32,    &tmem_cfg.scan_budget,      100},
+    {"epoll_scan",      CFG_INT,    &tmem_cfg.epoll_scan,       1},
+    {"scan_threads",    CFG_U32,    &tmem_cfg.scan_threads,     MAX_SCAN_THREADS},
+    {"pebs_nprocs",     CFG_U32,    &tmem_cfg.pebs_nprocs,      PEBS_NPROCS},
+
+    {"page_size",       CFG_U64,    &tmem_cfg.page_size,        0},
+    {"dram_size",       CFG_LONG,   &tmem_cfg.dram_size,        0},
+    {"dram_buffer",     CFG_LONG,   &tmem_cfg.dram_buffer,      0},
+    {"mig_batch",       CFG_U32,    &tmem_cfg.mig_batch,        MIG_BATCH_SIZE},
+    {"mig_threads",     CFG_U32,    &tmem_cfg.mig_threads,      MAX_MIG_THREADS},
+    {"demote_wm_low",   CFG_LONG,   &tmem_cfg.demote_wm_low,    0},
+    {"demote_wm_high",  CFG_LONG,   &tmem_cfg.demote_wm_high,   0},
+    {"mig_promote_rate", CFG_U64,   &tmem_cfg.mig_promote_rate, 0, NULL, true},
+    {"mig_demote_rate", CFG_U64,    &tmem_cfg.mig_demote_rate,  0, NULL, true},
+    {"tier_nodes",      CFG_LIST,   tmem_cfg.tier_nodes,        MAX_TIERS, &tmem_cfg.num_tiers},
+    {"tier_sizes",      CFG_LIST,   tmem_cfg.tier_sizes,        MAX_TIERS, &tmem_cfg.num_tier_sizes},
+
+    {"scan_cpu",        CFG_INT,    &tmem_cfg.scan_cpu,         0},
+    {"scan_cpu_stride", CFG_INT,    &tmem_cfg.scan_cpu_stride,  0},
+    {"stats_cpu",       CFG_INT,    &tmem_cfg.stats_cpu,        0},
+    {"migrate_cpu",     CFG_INT,    &tmem_cfg.migrate_cpu,      0},
+    {"migrate_cpu_stride", CFG_INT, &tmem_cfg.migrate_cpu_stride, 0},
+};
+
+#define NUM_KNOBS (sizeof(knobs) / sizeof(knobs[0]))
+
+static const struct cfg_knob* find_knob(const char *name) {
+    for (size_t i = 0; i < NUM_KNOBS; i++) {
+        if (strcasecmp(knobs[i].name, name) == 0) return &knobs[i];
+    }
+    return NULL;
+}
+
+// Parses one integer like 4096, 2M or 16G, end points after it
+static int parse_int(const char *str, long long *v, char **end) {
+    errno = 0;
+    *v = strtoll(str, end, 0);
+    if (errno != 0 || *end == str) return -1;
+    switch (toupper(**end)) {
+        case 'K': *v <<= 10; (*end)++; break;
+        case 'M': *v <<= 20; (*end)++; break;
+        case 'G': *v <<= 30; (*end)++; break;
+        default: break;
+    }
+    while (isspace(**end)) (*end)++;
+    return 0;
+}
+
+static int parse_list(const struct cfg_knob *knob, const char *str) {
+    uint32_t n = 0;
+    char *end;
+    long long v;
+    while (true) {
+        if (n == knob->max || parse_int(str, &v, &end) != 0) return -1;
+        ((long *)knob->val)[n++] = v;
+        if (*end == '\0') break;
+        if (*end != ',') return -1;
+        str = end + 1;
+    }
+    *knob->len = n;
+    return 0;
+}
+
+// Parses numbers like 4096, 2M, 16G, 0.01 or lists like 0,2,1
+static int parse_value(const struct cfg_knob *knob, const char *str) {
+    char *end;
+    errno = 0;
+    if (knob->type == CFG_DOUBLE) {
+        double d = strtod(str, &end);
+        if (errno != 0 || end == str) return -1;
+        *(double *)knob->val = d;
+        return 0;
+    }
+    if (knob->type == CFG_LIST) return parse_list(knob, str);
+
+    long long v;
+    if (parse_int(str, &v, &end) != 0 || *end != '\0') return -1;
+    if (v < 0 && knob->type != CFG_LONG && knob->type != CFG_INT) return -1;
+    if (knob->max != 0 && (uint64_t)v > knob->max) {
+        fprintf(stderr, "tmem config: %s=%lld above max %lu, using %lu\n", knob->name, v, knob->max, knob->max);
+        v = knob->max;
+    }
+
+    switch (knob->type) {
+        case CFG_INT:  *(int *)knob->val = v; break;
+        case CFG_U32:  *(uint32_t *)knob->val = v; break;
+        case CFG_U64:  *(uint64_t *)knob->val = v; break;
+        case CFG_LONG: *(long *)knob->val = v; break;
+        default: break;
+    }
+    return 0;
+}
+
+void tmem_config_set(const char *name, const char *value, const char *source) {
+    const struct cfg_knob *knob = find_knob(name);
+    if (knob == NULL) {
+        fprintf(stderr, "tmem config: unknown knob %s (%s)\n", name, source);
+        exit(1);
+    }
+    if (parse_value(knob, value) != 0) {
+        fprintf(stderr, "tmem config: bad value for %s (%s): %s\n", name, source, value);
+        exit(1);
+    }
+}
+
+static char* trim(char *s) {
+    while (isspace(*s)) s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace(end[-1])) end--;
+    *end = '\0';
+    return s;
+}
+
+static void print_knob(FILE *fp, const struct cfg_knob *knob) {
+    switch (knob->type) {
+        case CFG_INT:    fprintf(fp, "%s: [%d]\n", knob->name, *(int *)knob->val); break;
+        case CFG_U32:    fprintf(fp, "%s: [%u]\n", knob->name, *(uint32_t *)knob->val); break;
+        case CFG_U64:    fprintf(fp, "%s: [%lu]\n", knob->name, *(uint64_t *)knob->val); break;
+        case CFG_LONG:   fprintf(fp, "%s: [%ld]\n", knob->name, *(long *)knob->val); break;
+        case CFG_DOUBLE: fprintf(fp, "%s: [%g]\n", knob->name, *(double *)knob->val); break;
+        case CFG_LIST:
+            fprintf(fp, "%s: [", knob->name);
+            for (uint32_t j = 0; j < *knob->len; j++) {
+                fprintf(fp, j == 0 ? "%ld" : ",%ld", ((long *)knob->val)[j]);
+            }
+            fprintf(fp, "]\n");
+            break;
+    }
+}
+
+static struct timespec config_mtime;
+
+// On reload only runtime knobs are set, the rest of the file was read at startup.
+// A bad value there is reported and skipped instead of exiting the application.
+// Returns false if the file can't be read
+static bool read_config_file(const char *path, FILE *reload_fp) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        if (reload_fp != NULL) return false;
+        perror("tmem config fopen");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0) config_mtime = st.st_mtim;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        char *eq = strchr(line, '=');
+        if (eq == NULL) {
+            if (*trim(line) != '\0') {
+                // a file being edited while the application runs
+                fprintf(stderr, "tmem config: bad line in %s: %s%s\n", path, line, reload_fp != NULL ? ", ignored" : "");
+                if (reload_fp == NULL) exit(1);
+            }
+            continue;
+        }
+        *eq = '\0';
+        if (reload_fp == NULL) {
+            tmem_config_set(trim(line), trim(eq + 1), path);
+            continue;
+        }
+        const struct cfg_knob *knob = find_knob(trim(line));
+        if (knob == NULL || !knob->runtime) continue;
+        if (parse_value(knob, trim(eq + 1)) != 0) {
+            fprintf(stderr, "tmem config: bad value for %s (%s), ignored\n", knob->name, path);
+            continue;
+        }
+        print_knob(reload_fp, knob);
+    }
+    fclose(fp);
+    return true;
+}
+
+// Fixes up combinations of knobs that have a sensible fallback, after the
+// startup parse and after every reload
+static void clamp_config() {
+    if (tmem_cfg.sample_period_max < tmem_cfg.sample_period) {
+        fprintf(stderr, "tmem config: sample_period_max below sample_period, using sample_period\n");
+        tmem_cfg.sample_period_max = tmem_cfg.sample_period;
+    }
+    if (tmem_cfg.demote_wm_high < tmem_cfg.demote_wm_low) {
+        fprintf(stderr, "tmem config: demote_wm_high below demote_wm_low, using demote_wm_low\n");
+        tmem_cfg.demote_wm_high = tmem_cfg.demote_wm_low;
+    }
+}
+
+// Checks combinations that can't be expressed per knob
+static void check_config() {
+    if ((tmem_cfg.dram_buffer != 0 && tmem_cfg.dram_size != 0) || (tmem_cfg.dram_buffer == 0 && tmem_cfg.dram_size == 0)) {
+        fprintf(stderr, "Can't have both DRAM_BUFFER and DRAM_SIZE\n");
+        exit(1);
+    }
+    if (tmem_cfg.page_size < BASE_PAGE_SIZE || (tmem_cfg.page_size & (tmem_cfg.page_size - 1)) != 0) {
+        fprintf(stderr, "tmem config: page_size must be a power of 2 >= %lu\n", BASE_PAGE_SIZE);
+        exit(1);
+    }
+    if (tmem_cfg.scan_threads == 0 || tmem_cfg.scan_threads > tmem_cfg.pebs_nprocs) {
+        fprintf(stderr, "tmem config: scan_threads must be between 1 and pebs_nprocs\n");
+        exit(1);
+    }
+    if (tmem_cfg.sample_backend != BACKEND_PEBS && tmem_cfg.scan_threads != 1) {
+        fprintf(stderr, "tmem config: page_idle and daemon backends use a single scan thread\n");
+        tmem_cfg.scan_threads = 1;
+    }
+    if (tmem_cfg.sample_backend == BACKEND_PAGE_IDLE && tmem_cfg.lazy_meta) {
+        fprintf(stderr, "tmem config: page_idle backend only scans pages with metadata, turning lazy_meta off\n");
+        tmem_cfg.lazy_meta = 0;
+    }
+    clamp_config();
+    if (tmem_cfg.num_tiers < 2) {
+        fprintf(stderr, "tmem config: need at least 2 tier_nodes\n");
+        exit(1);
+    }
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        if (tmem_cfg.tier_nodes[t] < 0 || tmem_cfg.tier_nodes[t] >= 64) {
+            fprintf(stderr, "tmem config: tier node %ld out of range\n", tmem_cfg.tier_nodes[t]);
+            exit(1);
+        }
+        for (uint32_t u = 0; u < t; u++) {
+            if (tmem_cfg.tier_nodes[u] == tmem_cfg.tier_nodes[t]) {
+                fprintf(stderr, "tmem config: node %ld used by two tiers\n", tmem_cfg.tier_nodes[t]);
+                exit(1);
+            }
+        }
+        // middle tiers need a size unless it comes from the node size
+        bool middle = t > 0 && t < tmem_cfg.num_tiers - 1;
+        if (middle && tmem_cfg.dram_buffer == 0 && (t > tmem_cfg.num_tier_sizes || tmem_cfg.tier_sizes[t - 1] <= 0)) {
+            fprintf(stderr, "tmem config: tier %u needs a size in tier_sizes\n", t);
+            exit(1);
+        }
+    }
+    if (tmem_cfg.his_size == 0 || tmem_cfg.max_neighbors == 0 || tmem_cfg.mig_batch == 0 || tmem_cfg.mig_threads == 0 || tmem_cfg.sample_period == 0 || tmem_cfg.idle_scan_ms == 0) {
+        fprintf(stderr, "tmem config: his_size, max_neighbors, mig_batch, mig_threads, sample_period and idle_scan_ms can't be 0\n");
+        exit(1);
+    }
+}
+
+void tmem_config_init() {
+    const char *path = getenv("TMEM_CONFIG");
+    if (path != NULL) {
+        read_config_file(path, NULL);
+    }
+
+    char env_name[64];
+    for (size_t i = 0; i < NUM_KNOBS; i++) {
+        snprintf(env_name, sizeof(env_name), "TMEM_%s", knobs[i].name);
+        for (char *c = env_name; *c != '\0'; c++) *c = toupper(*c);
+        const char *value = getenv(env_name);
+        if (value != NULL) {
+            tmem_config_set(knobs[i].name, value, env_name);
+        }
+    }
+    check_config();
+}
+
+void tmem_config_print(FILE *fp) {
+    for (size_t i = 0; i < NUM_KNOBS; i++) {
+        print_knob(fp, &knobs[i]);
+    }
+    fflush(fp);
+}
+
+bool tmem_config_reload(FILE *fp) {
+    const char *path = getenv("TMEM_CONFIG");
+    struct stat st;
+    if (path == NULL || stat(path, &st) != 0) return false;
+    if (st.st_mtim.tv_sec == config_mtime.tv_sec && st.st_mtim.tv_nsec == config_mtime.tv_nsec) return false;
+    if (!read_config_file(path, fp)) return false;
+    clamp_config();
+    return true;
+}
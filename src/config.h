@@ -0,0 +1,113 @@
+#ifndef _CONFIG_HEADER
+#define _CONFIG_HEADER
+
+/*
+    Runtime configuration
+
+    Every knob starts at its compile-time default (the -D macros set by the
+    Makefile) and can be overridden at startup by
+        1. a config file named by TMEM_CONFIG with "knob = value" lines
+        2. environment variables TMEM_<KNOB>, e.g. TMEM_CLUSTER_ALGO=1
+    Environment variables win over the config file. Knob names are the same
+    as the Makefile knobs. Sizes accept K/M/G suffixes.
+
+    Knobs that size arrays (his_size, max_neighbors, pred_depth, mig_batch,
+    scan_threads, mig_threads) can't go above their compile-time maximums.
+    List knobs (tier_nodes, tier_sizes) take comma separated values, e.g.
+    TMEM_TIER_NODES=0,2,1 for local DRAM, then a CXL node, then the remote socket.
+
+    Runtime knobs (mig_promote_rate, mig_demote_rate) can also be changed
+    while the application runs by editing the TMEM_CONFIG file, the stats
+    thread checks it once a second.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef MAX_SCAN_THREADS
+    #define MAX_SCAN_THREADS 16
+#endif
+
+#ifndef MAX_MIG_THREADS
+    #define MAX_MIG_THREADS 8
+#endif
+
+#ifndef MAX_TIERS
+    #define MAX_TIERS 4
+#endif
+
+struct tmem_config {
+    // policy
+    int cluster_algo;
+    int hem_algo;
+    int lru_algo;
+    int dfs_algo;
+    int pred_algo;
+    uint32_t pred_conf;
+    uint32_t his_size;
+    uint32_t pred_depth;
+    uint32_t max_neighbors;
+    double dec_up;
+    double dec_down;
+    uint64_t hot_threshold;
+    int admit_algo;
+    uint64_t admit_lat_delta;
+    uint32_t admit_budget;
+    int subpage_algo;
+    uint32_t subpage_dense;
+    int lazy_meta;
+    int arena_algo;
+    int site_algo;
+
+    // sampling
+    int sample_backend;
+    uint32_t idle_scan_ms;
+    uint64_t sample_period;
+    int adaptive_period;
+    uint64_t sample_period_max;
+    uint64_t target_sample_rate;
+    uint32_t scan_budget;
+    int epoll_scan;
+    uint32_t scan_threads;
+    uint32_t pebs_nprocs;
+
+    // sizes
+    uint64_t page_size;
+    long dram_size;
+    long dram_buffer;
+    uint32_t mig_batch;
+    uint32_t mig_threads;
+    long demote_wm_low;
+    long demote_wm_high;
+    uint64_t mig_promote_rate;  // bytes per second, 0 = unlimited
+    uint64_t mig_demote_rate;
+
+    // memory tiers, fastest first
+    // tier 0 is sized by dram_size/dram_buffer and the last tier is unlimited.
+    // With dram_size, tier_sizes has the sizes of the tiers in between,
+    // with dram_buffer every tier but the last leaves dram_buffer free on its node
+    uint32_t num_tiers;
+    long tier_nodes[MAX_TIERS];
+    uint32_t num_tier_sizes;
+    long tier_sizes[MAX_TIERS];
+
+    // cpu pinning
+    int scan_cpu;
+    int scan_cpu_stride;
+    int stats_cpu;
+    int migrate_cpu;
+    int migrate_cpu_stride;
+};
+
+extern struct tmem_config tmem_cfg;
+
+void tmem_config_init();
+// Sets one knob from a string, exits on unknown knobs or bad values
+void tmem_config_set(const char *name, const char *value, const char *source);
+void tmem_config_print(FILE *fp);
+// Re-reads the TMEM_CONFIG file if it changed since it was last read and sets
+// the knobs that can change at runtime, printing them to fp. Returns true if re-read
+bool tmem_config_reload(FILE *fp);
+
+#endif
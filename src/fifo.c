@@ -20,11 +20,11 @@ void enqueue_fifo(struct fifo_list *queue, struct tmem_page *entry)
 
   pthread_mutex_lock(&(queue->list_lock));
   assert(entry->list == NULL);
-  assert(entry->prev == NULL);
-  entry->next = queue->first;
+  assert(entry->meta->prev == NULL);
+  entry->meta->next = queue->first;
   if(queue->first != NULL) {
-    assert(queue->first->prev == NULL);
-    queue->first->prev = entry;
+    assert(queue->first->meta->prev == NULL);
+    queue->first->meta->prev = entry;
   } else {
     assert(queue->last == NULL);
     assert(queue->numentries == 0);
@@ -59,27 +59,27 @@ struct tmem_page *dequeue_fifo(struct fifo_list *queue)
   pthread_mutex_lock(&(queue->list_lock));
   struct tmem_page *ret = queue->last;
 
-  // pthread_mutex_lock(&ret->page_lock);
+  // pthread_mutex_lock(&ret->meta->page_lock);
   if (ret == NULL || ret->list != queue) {
-    // pthread_mutex_unlock(&ret->page_lock);
+    // pthread_mutex_unlock(&ret->meta->page_lock);
     pthread_mutex_unlock(&queue->list_lock);
     return NULL;
   }
 
-  queue->last = ret->prev;
+  queue->last = ret->meta->prev;
   if(queue->last != NULL) {
-    queue->last->next = NULL;
+    queue->last->meta->next = NULL;
   } else {
     queue->first = NULL;
   }
 
-  ret->prev = ret->next = NULL;
+  ret->meta->prev = ret->meta->next = NULL;
   ret->list = NULL;
   assert(queue->numentries > 0);
   // queue->numentries--;
   __atomic_fetch_sub(&queue->numentries, 1, __ATOMIC_RELEASE);
 
-  // pthread_mutex_unlock(&ret->page_lock); // caller must unlock page
+  // pthread_mutex_unlock(&ret->meta->page_lock); // caller must unlock page
   pthread_mutex_unlock(&(queue->list_lock));
   // LOG_DEBUG("%p) %lu\n", ret, queue->numentries);
 
@@ -114,27 +114,27 @@ void page_list_remove_page(struct fifo_list *list, struct tmem_page *page)
   }
 
   if (list->first == page) {
-    list->first = page->next;
+    list->first = page->meta->next;
   }
 
   if (list->last == page) {
-    list->last = page->prev;
+    list->last = page->meta->prev;
   }
 
-  if (page->next != NULL) {
-    page->next->prev = page->prev;
+  if (page->meta->next != NULL) {
+    page->meta->next->meta->prev = page->meta->prev;
   }
 
-  if (page->prev != NULL) {
-    page->prev->next = page->next;
+  if (page->meta->prev != NULL) {
+    page->meta->prev->meta->next = page->meta->next;
   }
 
   assert(list->numentries > 0);
   // list->numentries--;
   __atomic_fetch_sub(&list->numentries, 1, __ATOMIC_RELEASE);
 
-  page->next = NULL;
-  page->prev = NULL;
+  page->meta->next = NULL;
+  page->meta->prev = NULL;
   page->list = NULL;
   pthread_mutex_unlock(&(list->list_lock));
 }
@@ -150,7 +150,7 @@ void next_page(struct fifo_list *list, struct tmem_page *page, struct tmem_page
         *next_page = list->last;
     }
     else {
-        *next_page = page->prev;
+        *next_page = page->meta->prev;
         assert(page->list == list);
     }
     pthread_mutex_unlock(&(list->list_lock));
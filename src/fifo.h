@@ -15,6 +15,9 @@ struct fifo_list {
   size_t numentries;
 };
 
+// Per tier lists, defined in tmem.c (hot pages are in hot_queues, see hot-queue.h)
+// cold_lists[t]: pages in tier t that can be demoted to tier t + 1
+extern struct fifo_list cold_lists[MAX_TIERS];
 
 void enqueue_fifo(struct fifo_list *list, struct tmem_page *page);
 struct tmem_page* dequeue_fifo(struct fifo_list *list);
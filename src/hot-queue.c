@@ -0,0 +1,90 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tmem.h"
+#include "hot-queue.h"
+
+// Called before the scan and migrate threads start, the mmap isn't tracked
+void hot_queue_init(struct hot_queue *queue, size_t size) {
+    assert((size & (size - 1)) == 0);
+    size_t slots_size = size * sizeof(struct hot_queue_slot);
+    queue->slots = libc_mmap(NULL, slots_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(queue->slots != MAP_FAILED);
+    pebs_stats.internal_mem_overhead += slots_size;
+
+    for (size_t i = 0; i < size; i++) {
+        queue->slots[i].seq = i;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+bool hot_queue_push(struct hot_queue *queue, struct tmem_page *page) {
+    if (atomic_exchange(&page->queued, true)) return true;
+
+    struct hot_queue_slot *slot;
+    uint64_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (true) {
+        slot = &queue->slots[pos & queue->mask];
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0) {
+            // slot is free, claim it
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            // full, the slot still holds an entry from the last lap
+            atomic_store(&page->queued, false);
+            return false;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->page = page;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // Wake a migrate worker sleeping in hot_queue_wait
+    if (__atomic_load_n(&queue->waiters, __ATOMIC_SEQ_CST) != 0) {
+        __atomic_fetch_add(&queue->wake_seq, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &queue->wake_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    return true;
+}
+
+struct tmem_page* hot_queue_pop(struct hot_queue *queue) {
+    struct hot_queue_slot *slot;
+    uint64_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (true) {
+        slot = &queue->slots[pos & queue->mask];
+        int64_t diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+            // slot is filled, claim it
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return NULL;    // empty
+        } else {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    struct tmem_page *page = slot->page;
+    // free the slot for the push one lap later
+    atomic_store_explicit(&slot->seq, pos + queue->mask + 1, memory_order_release);
+    atomic_store(&page->queued, false);
+    return page;
+}
+
+// Sleeps until something is pushed or timeout_ns passes. push claims its slot
+// (tail) before checking waiters, so either we see the entry here or it sees
+// us and changes wake_seq, which makes the futex wait return right away
+void hot_queue_wait(struct hot_queue *queue, long timeout_ns) {
+    struct timespec timeout = {
+        .tv_sec = timeout_ns / 1000000000L,
+        .tv_nsec = timeout_ns % 1000000000L
+    };
+    uint32_t seq = __atomic_load_n(&queue->wake_seq, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&queue->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &queue->wake_seq, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+    }
+    __atomic_fetch_sub(&queue->waiters, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,57 @@
+#ifndef _HOT_QUEUE_H
+#define _HOT_QUEUE_H
+
+/*
+    Lock-free bounded MPMC queue of pages waiting for promotion
+
+    Scan threads push, migrate workers pop, neither takes a lock
+    (Vyukov's bounded queue, one sequence number per slot).
+    page->queued de-duplicates: a page is pushed at most once until it's popped.
+    Entries are never removed, pages that went cold or moved since they were
+    pushed are skipped by the consumer.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "config.h"
+
+// Slots per queue, must be a power of 2
+#ifndef HOT_QUEUE_SIZE
+    #define HOT_QUEUE_SIZE (1 << 16)
+#endif
+
+struct tmem_page;
+
+struct hot_queue_slot {
+    _Atomic uint64_t seq;
+    struct tmem_page *page;
+};
+
+struct hot_queue {
+    uint64_t head __attribute__((aligned(64)));     // next slot to pop
+    uint64_t tail __attribute__((aligned(64)));     // next slot to push
+    struct hot_queue_slot *slots __attribute__((aligned(64)));
+    uint64_t mask;
+    _Atomic uint32_t wake_seq;   // futex word, bumped when a waiter needs waking
+    _Atomic uint32_t waiters;
+};
+
+// hot_queues[t]: pages in tier t waiting to be promoted to tier t - 1
+extern struct hot_queue hot_queues[MAX_TIERS];
+
+void hot_queue_init(struct hot_queue *queue, size_t size);
+// Returns false if the queue was full, true if pushed or already queued
+bool hot_queue_push(struct hot_queue *queue, struct tmem_page *page);
+struct tmem_page* hot_queue_pop(struct hot_queue *queue);
+void hot_queue_wait(struct hot_queue *queue, long timeout_ns);
+
+// Approximate, entries being pushed or popped may or may not be counted
+static inline uint64_t hot_queue_len(struct hot_queue *queue) {
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    return tail > head ? tail - head : 0;
+}
+
+#endif
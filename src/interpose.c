@@ -1,11 +1,15 @@
 #include "interpose.h"
+#include "arena.h"
+#include "alloc-site.h"
 
 void* (*libc_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset) = NULL;
 int (*libc_munmap)(void *addr, size_t length) = NULL;
+void* (*libc_mremap)(void *old_addr, size_t old_size, size_t new_size, int flags, ...) = NULL;
 void* (*libc_malloc)(size_t size) = NULL;
 void (*libc_free)(void* ptr) = NULL;
 
 _Thread_local bool internal_call = false;
+_Thread_local uint64_t alloc_site_ip = 0;
 pid_t main_pid = 0;
 
 static int mmap_filter(void *addr, size_t length, int prot, int flags, int fd, off_t offset, uint64_t *result)
@@ -79,6 +83,32 @@ static int munmap_filter(void *addr, size_t length, uint64_t* result)
 }
 
 
+static int mremap_filter(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr, uint64_t *result)
+{
+    if (internal_call) {
+      LOG_DEBUG("MREMAP: internal call: mremap(%p, %lu, %lu, %d, %p)\n", old_addr, old_size, new_size, flags, new_addr);
+      return 1;
+    }
+
+    // done here to know where it went, non tracked ranges pass straight through
+    void *p = tmem_mremap(old_addr, old_size, new_size, flags, new_addr);
+    *result = (p == MAP_FAILED) ? (uint64_t)-errno : (uint64_t)p;
+    return 0;
+}
+
+
+static int madvise_filter(void *addr, size_t length, int advice, uint64_t *result)
+{
+    if (internal_call || (advice != MADV_DONTNEED && advice != MADV_FREE)) {
+      return 1;
+    }
+
+    LOG_DEBUG("MADVISE: tmem_madvise(%p, %lu, %d)\n", addr, length, advice);
+    *result = (tmem_madvise(addr, length, advice) == 0) ? 0 : (uint64_t)-errno;
+    return 0;
+}
+
+
 static void* bind_symbol(const char *sym)
 {
     void *ptr;
@@ -89,12 +119,30 @@ static void* bind_symbol(const char *sym)
     return ptr;
 }
 
+// The application's mmap calls, so mmap_filter knows where they come from.
+// A call made for a malloc already carries the malloc's site
+void* mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    if (libc_mmap == NULL) libc_mmap = bind_symbol("mmap");
+    bool outer = alloc_site_ip == 0;
+    if (outer) alloc_site_ip = (uint64_t)__builtin_return_address(0);
+    void *p = libc_mmap(addr, length, prot, flags, fd, offset);
+    if (outer) alloc_site_ip = 0;
+    return p;
+}
+
+void* mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset) __attribute__((alias("mmap")));
+
 static int hook(long syscall_number, long arg0, long arg1, long arg2, long arg3, long arg4, long arg5, long *result)
 {
     if (syscall_number == SYS_mmap) {
       return mmap_filter((void*)arg0, (size_t)arg1, (int)arg2, (int)arg3, (int)arg4, (off_t)arg5, (uint64_t*)result);
     } else if (syscall_number == SYS_munmap){
       return munmap_filter((void*)arg0, (size_t)arg1, (uint64_t*)result);
+    } else if (syscall_number == SYS_mremap) {
+      return mremap_filter((void*)arg0, (size_t)arg1, (size_t)arg2, (int)arg3, (void*)arg4, (uint64_t*)result);
+    } else if (syscall_number == SYS_madvise) {
+      return madvise_filter((void*)arg0, (size_t)arg1, (int)arg2, (uint64_t*)result);
       } else {
           // ignore non-mmap system calls
       return 1;
@@ -106,12 +154,16 @@ static __attribute__((constructor)) void init(void)
     internal_call = true;
     libc_mmap = bind_symbol("mmap");
     libc_munmap = bind_symbol("munmap");
+    libc_mremap = bind_symbol("mremap");
     libc_malloc = bind_symbol("malloc");
     libc_free = bind_symbol("free");
     intercept_hook_point = hook;
     
-    
+    tmem_config_init();
     init_log_files();
+#if PEBS_STATS == 1
+    tmem_config_print(stats_fp);
+#endif
     LOG_DEBUG("CONSTRUCTOR\n");
     LOG_DEBUG("MAP_ANONYMOUS: %d, MAP_STACK: %d, PROT_EXEC: %d, MAP_SHARED: %d\n \
               MAP_FIXED: %d, MAP_FIXED_NOREPLACE: %d\n \
@@ -125,6 +177,7 @@ static __attribute__((constructor)) void init(void)
 
     LOG_DEBUG("tmem_init\n");
     tmem_init();
+    arena_init();
     internal_call = false;
 
 //   int ret = mallopt(M_MMAP_THRESHOLD, 0);
@@ -5,13 +5,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#ifndef TMEM_SIM   // the simulator isn't preloaded
 #include <libsyscall_intercept_hook_point.h>
+#endif
 #include <syscall.h>
 #include <errno.h>
 #include <dlfcn.h>
 #include <assert.h>
 #include <malloc.h>
-#include <numa.h>
 
 #include "tmem.h"
 #include "pebs.h"
@@ -21,6 +22,7 @@ extern _Thread_local bool internal_call;
 // function pointers to libc functions
 extern void* (*libc_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 extern int (*libc_munmap)(void *addr, size_t length);
+extern void* (*libc_mremap)(void *old_addr, size_t old_size, size_t new_size, int flags, ...);
 extern void* (*libc_malloc)(size_t size);
 extern void (*libc_free)(void* p);
 
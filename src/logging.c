@@ -1,11 +1,7 @@
 #include "logging.h"
 
-FILE* debug_fp = NULL;
 FILE* stats_fp = NULL;
 FILE* time_fp = NULL;
-FILE* pred_fp = NULL;
-FILE* mig_fp = NULL;
-FILE* cold_fp = NULL;
 struct timespec log_start_time;
 
 void init_log_files() {
@@ -16,24 +12,15 @@ void init_log_files() {
     assert(stats_fp != NULL);
 #endif
 
-#if RECORD == 1
-    debug_fp = fopen("debuglog.txt", "w");
-    assert(debug_fp != NULL);
+    // reference start time
+    log_start_time = get_time();
 
+#if RECORD == 1
     time_fp = fopen("time.txt", "w");
     assert(time_fp != NULL);
 
-    pred_fp = fopen("preds.bin", "wb");
-    assert(pred_fp != NULL);
-
-    mig_fp = fopen("mig.bin", "wb");
-    assert(mig_fp != NULL);
-
-    cold_fp = fopen("cold.bin", "wb");
-    assert(cold_fp != NULL);
+    // tmem_trace.bin, preds.bin, mig.bin, cold.bin and debuglog.txt
+    trace_init();
 #endif
     internal_call = false;
-
-    // reference start time
-    log_start_time = get_time();
 }
\ No newline at end of file
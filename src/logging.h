@@ -5,22 +5,16 @@
 #include <assert.h>
 
 #include "tmem.h"
+#include "trace.h"
 
 extern FILE* stats_fp;
-extern FILE* debug_fp;
 extern FILE* time_fp;
-extern FILE* pred_fp;
-extern FILE* mig_fp;
-extern FILE* cold_fp;
 extern struct timespec log_start_time;
 
 // #define LOG_DEBUG(...) { fprintf(debug_fp, __VA_ARGS__); fflush(debug_fp); }
 #if RECORD == 1
-#define LOG_DEBUG(...) {                                                     \
-    fprintf(debug_fp, "[%.9f]\t", elapsed_time(log_start_time, get_time())); \
-    fprintf(debug_fp, __VA_ARGS__);                                          \
-    fflush(debug_fp);                                                        \
-}
+// Buffered by the trace writer (trace.h), not flushed right away
+#define LOG_DEBUG(...) trace_log(__VA_ARGS__)
 #else
 #define LOG_DEBUG(...)
 #endif
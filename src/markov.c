@@ -0,0 +1,95 @@
+#include "tmem.h"
+#include "markov.h"
+
+#define MARKOV_ENTRIES (1UL << MARKOV_BITS)
+
+struct markov_state {
+    struct markov_entry *table;
+    uint64_t prev_va;       // page of the last sample
+};
+
+static struct markov_state markov_states[MAX_SCAN_THREADS];
+static _Thread_local struct markov_state *markov = &markov_states[0];
+
+static inline struct markov_entry* markov_entry(uint64_t va) {
+    uint64_t hash = (va / BASE_PAGE_SIZE) * 0x9E3779B97F4A7C15ULL;
+    return &markov->table[hash >> (64 - MARKOV_BITS)];
+}
+
+// Called before the scan threads start, the mmap isn't tracked
+void markov_init() {
+    size_t table_size = MARKOV_ENTRIES * sizeof(struct markov_entry);
+    for (uint32_t i = 0; i < tmem_cfg.scan_threads; i++) {
+        markov_states[i].table = libc_mmap(NULL, table_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        assert(markov_states[i].table != MAP_FAILED);
+        pebs_stats.internal_mem_overhead += table_size;
+    }
+}
+
+void markov_set_shard(uint32_t shard) {
+    markov = &markov_states[shard];
+}
+
+void markov_add_page(struct tmem_page *page) {
+    uint64_t prev = markov->prev_va;
+    if (prev == page->va) return;
+    markov->prev_va = page->va;
+    if (prev == 0) return;
+
+    struct markov_entry *entry = markov_entry(prev);
+    if (entry->va != prev) {
+        if (entry->va != 0) STAT_INC(markov_evictions);
+        memset(entry, 0, sizeof(struct markov_entry));
+        entry->va = prev;
+    }
+
+    // count the successor, or replace the least frequent one
+    uint32_t way = 0;
+    for (uint32_t w = 0; w < MARKOV_WAYS; w++) {
+        if (entry->next[w] == page->va) {
+            way = w;
+            break;
+        }
+        if (entry->count[w] < entry->count[way]) way = w;
+    }
+    if (entry->next[way] != page->va) {
+        entry->total -= entry->count[way];
+        entry->next[way] = page->va;
+        entry->count[way] = 0;
+    }
+    entry->count[way]++;
+    entry->total++;
+
+    if (entry->total >= MARKOV_MAX_TOTAL) {
+        entry->total = 0;
+        for (uint32_t w = 0; w < MARKOV_WAYS; w++) {
+            entry->count[w] /= 2;
+            entry->total += entry->count[w];
+        }
+    }
+}
+
+void markov_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, uint8_t *confs, uint32_t *idx, uint32_t max) {
+    double prob = 1.0;
+    uint64_t va = page->va;
+    for (uint32_t d = 0; d < tmem_cfg.pred_depth; d++) {
+        struct markov_entry *entry = markov_entry(va);
+        if (entry->va != va || entry->total == 0) break;
+
+        int best = -1;
+        for (uint32_t w = 0; w < MARKOV_WAYS; w++) {
+            if (entry->count[w] == 0) continue;
+            double p = prob * entry->count[w] / entry->total;
+            if (p * 100 < tmem_cfg.pred_conf) continue;
+            if (best < 0 || entry->count[w] > entry->count[best]) best = w;
+
+            struct tmem_page *pred = find_page_no_lock(entry->next[w]);
+            if (pred == NULL || pred == page || *idx == max) continue;
+            pred_pages[*idx] = pred;
+            confs[(*idx)++] = p * 100;
+        }
+        if (best < 0) break;
+        prob = prob * entry->count[best] / entry->total;
+        va = entry->next[best];
+    }
+}
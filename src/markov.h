@@ -0,0 +1,54 @@
+#ifndef _MARKOV_H
+#define _MARKOV_H
+
+/*
+    Markov chain page predictor (pred_algo=1, with cluster_algo)
+
+    Learns first-order transition counts between pages from the sample
+    stream: every time a scan thread sees a sample for a different page than
+    the last one, the previous page's entry counts the new page as a successor.
+    A page hashes to one cache line sized entry of a direct mapped table
+    holding its MARKOV_WAYS most frequent successors. A page that hashes to
+    an entry owned by another page takes it over, counts are halved once
+    an entry has seen MARKOV_MAX_TOTAL transitions so old patterns fade.
+
+    Predictions follow the most likely successor up to pred_depth steps and
+    return every successor whose probability along the chain is at least
+    pred_conf percent, with that probability as its confidence.
+    One table per scan thread shard, only its scan thread touches it.
+*/
+
+#include <stdint.h>
+
+#include "config.h"
+
+// log2 of the entries per table
+#ifndef MARKOV_BITS
+    #define MARKOV_BITS 14
+#endif
+
+// Successors kept per page, 4 fill a cache line
+#ifndef MARKOV_WAYS
+    #define MARKOV_WAYS 4
+#endif
+
+#ifndef MARKOV_MAX_TOTAL
+    #define MARKOV_MAX_TOTAL 1024
+#endif
+
+struct tmem_page;
+
+struct markov_entry {
+    uint64_t va;                        // page the entry belongs to, 0 if unused
+    uint64_t next[MARKOV_WAYS];         // successor page vas
+    uint32_t count[MARKOV_WAYS];
+    uint32_t total;                     // transitions out of va, aged with count
+} __attribute__((aligned(64)));
+
+void markov_init();
+void markov_set_shard(uint32_t shard);
+void markov_add_page(struct tmem_page *page);
+// Fills pred_pages/confs (percent) with up to max predictions, idx counts them
+void markov_predict_pages(struct tmem_page *page, struct tmem_page **pred_pages, uint8_t *confs, uint32_t *idx, uint32_t max);
+
+#endif
@@ -0,0 +1,112 @@
+#include "pebs.h"
+#include "policy.h"
+
+#include <fcntl.h>
+
+/*
+    page_idle sampling backend (sample_backend=1)
+
+    For machines without the PEBS events (AMD, VMs, restricted perf).
+    Every idle_scan_ms the scan thread walks all tracked pages, translates
+    their 4KB pages to PFNs with /proc/self/pagemap and checks
+    /sys/kernel/mm/page_idle/bitmap. Each 4KB page touched since the last
+    scan is fed to process_sample like a PEBS sample, then marked idle again.
+    With THP every 4KB of a huge page reports the bit of the whole huge page.
+
+    Needs CAP_SYS_ADMIN (pagemap hides PFNs otherwise) and CONFIG_IDLE_PAGE_TRACKING.
+*/
+
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_PFN_MASK ((1ULL << 55) - 1)
+
+static int pagemap_fd = -1;
+static int idle_fd = -1;
+static uint64_t *pagemap_buf = NULL;
+static bool idle_primed = false;    // first scan only marks pages idle
+
+static uint64_t pagemap_entry(uint64_t va) {
+    uint64_t ent = 0;
+    if (pread(pagemap_fd, &ent, sizeof(ent), (va / BASE_PAGE_SIZE) * sizeof(ent)) != sizeof(ent)) return 0;
+    return ent;
+}
+
+void page_idle_init() {
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+    idle_fd = open("/sys/kernel/mm/page_idle/bitmap", O_RDWR);
+    if (pagemap_fd < 0 || idle_fd < 0) {
+        perror("page_idle backend open");
+        exit(1);
+    }
+
+    // Unprivileged processes get PFN 0 for every present page
+    volatile uint64_t probe = 1;
+    uint64_t ent = pagemap_entry((uint64_t)&probe);
+    if ((ent & PAGEMAP_PRESENT) && (ent & PAGEMAP_PFN_MASK) == 0) {
+        fprintf(stderr, "page_idle backend: no PFNs in /proc/self/pagemap, needs CAP_SYS_ADMIN\n");
+        exit(1);
+    }
+
+    size_t buf_size = (tmem_cfg.page_size / BASE_PAGE_SIZE) * sizeof(uint64_t);
+    pagemap_buf = libc_mmap(NULL, buf_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(pagemap_buf != MAP_FAILED);
+    pebs_stats.internal_mem_overhead += buf_size;
+}
+
+// Writing a 1 bit marks that PFN idle, 0 bits are left alone
+static void idle_mark_word(uint64_t word_idx, uint64_t mask) {
+    if (mask == 0) return;
+    if (pwrite(idle_fd, &mask, sizeof(mask), word_idx * sizeof(uint64_t)) != sizeof(mask)) {
+        perror("page_idle bitmap write");
+    }
+}
+
+static void idle_scan_page(struct tmem_page *page, void *arg) {
+    if (page->free) return;
+    uint64_t start = (uint64_t)page->meta->va_start;
+    ssize_t n = pread(pagemap_fd, pagemap_buf, (page->meta->size / BASE_PAGE_SIZE) * sizeof(uint64_t),
+                        (start / BASE_PAGE_SIZE) * sizeof(uint64_t));
+    if (n <= 0) return;
+
+    uint64_t now = rdtscp();
+    // PFNs of a page are mostly contiguous so most share a bitmap word
+    uint64_t word_idx = UINT64_MAX, word = 0, mask = 0;
+    for (uint64_t i = 0; i < n / sizeof(uint64_t); i++) {
+        uint64_t ent = pagemap_buf[i];
+        if (!(ent & PAGEMAP_PRESENT)) continue;
+        uint64_t pfn = ent & PAGEMAP_PFN_MASK;
+
+        if (pfn / 64 != word_idx) {
+            idle_mark_word(word_idx, mask);
+            word_idx = pfn / 64;
+            mask = 0;
+            // can't tell, count the whole word as idle
+            if (pread(idle_fd, &word, sizeof(word), word_idx * sizeof(uint64_t)) != sizeof(word)) word = ~0ULL;
+        }
+        uint64_t bit = 1ULL << (pfn % 64);
+        mask |= bit;
+        if (idle_primed && !(word & bit)) {
+            uint64_t addr = start + i * BASE_PAGE_SIZE;
+            uint8_t evt = (page_addr_tier(page, addr) == TOP_TIER) ? DRAMREAD : REMREAD;
+            process_sample(page, addr, 0, now, 0, evt);
+        }
+    }
+    idle_mark_word(word_idx, mask);
+}
+
+void* page_idle_scan_thread(void *arg) {
+    internal_call = true;
+    algo_set_shard(0);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(tmem_cfg.scan_cpu, &cpuset);
+    int s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    assert(s == 0);
+
+    while (true) {
+        pindex_for_each(idle_scan_page, NULL);
+        idle_primed = true;
+        usleep(tmem_cfg.idle_scan_ms * 1000);
+    }
+    return NULL;
+}
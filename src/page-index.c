@@ -0,0 +1,86 @@
+#include "page-index.h"
+#include "tmem.h"
+
+struct pindex_l1 *pindex_root[PINDEX_FANOUT];
+static pthread_mutex_t pindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Caller must be an internal call so the mmap isn't tracked
+static void* pindex_alloc_node(size_t size) {
+    void *node = libc_mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(node != MAP_FAILED);
+    pebs_stats.internal_mem_overhead += size;
+    return node;
+}
+
+// Walks down to the 2MB slot of va, creating interior nodes on the way
+// pindex_lock must be held
+static struct pindex_slot* pindex_get_slot(uint64_t va) {
+    struct pindex_l1 **l1p = &pindex_root[PINDEX_IDX(va, PINDEX_L0_SHIFT)];
+    if (*l1p == NULL) {
+        // mmap memory is zeroed so the node is fully initialized before publishing
+        __atomic_store_n(l1p, pindex_alloc_node(sizeof(struct pindex_l1)), __ATOMIC_RELEASE);
+    }
+    struct pindex_l2 **l2p = &(*l1p)->nodes[PINDEX_IDX(va, PINDEX_L1_SHIFT)];
+    if (*l2p == NULL) {
+        __atomic_store_n(l2p, pindex_alloc_node(sizeof(struct pindex_l2)), __ATOMIC_RELEASE);
+    }
+    return &(*l2p)->slots[PINDEX_IDX(va, PINDEX_L2_SHIFT)];
+}
+
+static struct tmem_page** pindex_get_entry(uint64_t va) {
+    struct pindex_slot *slot = pindex_get_slot(va);
+    if ((va & ((1UL << PINDEX_L2_SHIFT) - 1)) == 0) {
+        return &slot->page;
+    }
+    if (slot->leaf == NULL) {
+        __atomic_store_n(&slot->leaf, pindex_alloc_node(sizeof(struct pindex_leaf)), __ATOMIC_RELEASE);
+    }
+    return &slot->leaf->pages[PINDEX_IDX(va, PINDEX_L3_SHIFT)];
+}
+
+// Returns false if va is already taken by another page
+bool pindex_insert(uint64_t va, struct tmem_page *page) {
+    assert((va & (BASE_PAGE_SIZE - 1)) == 0);
+    pthread_mutex_lock(&pindex_lock);
+    struct tmem_page **entry = pindex_get_entry(va);
+    if (*entry != NULL) {
+        pthread_mutex_unlock(&pindex_lock);
+        return false;
+    }
+    // page fields must be visible before readers can find it
+    __atomic_store_n(entry, page, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pindex_lock);
+    return true;
+}
+
+void pindex_remove(uint64_t va, struct tmem_page *page) {
+    pthread_mutex_lock(&pindex_lock);
+    struct tmem_page **entry = pindex_get_entry(va);
+    if (*entry == page) {
+        __atomic_store_n(entry, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pindex_lock);
+}
+
+void pindex_for_each(void (*fn)(struct tmem_page *page, void *arg), void *arg) {
+    for (uint64_t i = 0; i < PINDEX_FANOUT; i++) {
+        struct pindex_l1 *l1 = __atomic_load_n(&pindex_root[i], __ATOMIC_ACQUIRE);
+        if (l1 == NULL) continue;
+        for (uint64_t j = 0; j < PINDEX_FANOUT; j++) {
+            struct pindex_l2 *l2 = __atomic_load_n(&l1->nodes[j], __ATOMIC_ACQUIRE);
+            if (l2 == NULL) continue;
+            for (uint64_t k = 0; k < PINDEX_FANOUT; k++) {
+                struct pindex_slot *slot = &l2->slots[k];
+                struct tmem_page *page = __atomic_load_n(&slot->page, __ATOMIC_ACQUIRE);
+                if (page != NULL) fn(page, arg);
+
+                struct pindex_leaf *leaf = __atomic_load_n(&slot->leaf, __ATOMIC_ACQUIRE);
+                if (leaf == NULL) continue;
+                for (uint64_t l = 0; l < PINDEX_FANOUT; l++) {
+                    page = __atomic_load_n(&leaf->pages[l], __ATOMIC_ACQUIRE);
+                    if (page != NULL) fn(page, arg);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef _PAGE_INDEX_HEADER
+#define _PAGE_INDEX_HEADER
+
+/*
+    Lock-free VA -> tmem_page index
+
+    Radix tree over the 48 bit user address space:
+        va[47:39] -> va[38:30] -> va[29:21] (one slot per 2MB region)
+    Every 2MB slot holds the page keyed on the 2MB aligned address directly
+    and a lazily created 4KB level (va[20:12]) for keys that aren't 2MB aligned.
+
+    Readers never lock. Writers are serialized by pindex_lock and publish
+    with release stores. Interior nodes are never freed (just like tmem_pages)
+    so a reader can't follow a dangling pointer, it can only see a page
+    that is being freed which callers already check with page->free.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct tmem_page;
+
+#define PINDEX_BITS 9
+#define PINDEX_FANOUT (1UL << PINDEX_BITS)
+#define PINDEX_IDX(va, shift) (((va) >> (shift)) & (PINDEX_FANOUT - 1))
+
+#define PINDEX_L0_SHIFT 39
+#define PINDEX_L1_SHIFT 30
+#define PINDEX_L2_SHIFT 21
+#define PINDEX_L3_SHIFT 12
+
+// 4KB keys inside one 2MB region
+struct pindex_leaf {
+    struct tmem_page *pages[PINDEX_FANOUT];
+};
+
+// One 2MB region
+struct pindex_slot {
+    struct tmem_page *page;
+    struct pindex_leaf *leaf;
+};
+
+struct pindex_l2 {
+    struct pindex_slot slots[PINDEX_FANOUT];
+};
+
+struct pindex_l1 {
+    struct pindex_l2 *nodes[PINDEX_FANOUT];
+};
+
+extern struct pindex_l1 *pindex_root[PINDEX_FANOUT];
+
+bool pindex_insert(uint64_t va, struct tmem_page *page);
+void pindex_remove(uint64_t va, struct tmem_page *page);
+// Lock-free walk over every indexed page, fn can see pages being freed
+void pindex_for_each(void (*fn)(struct tmem_page *page, void *arg), void *arg);
+
+// Hot path, inlined into the sample loop
+static inline struct tmem_page* pindex_lookup(uint64_t va) {
+    struct pindex_l1 *l1 = __atomic_load_n(&pindex_root[PINDEX_IDX(va, PINDEX_L0_SHIFT)], __ATOMIC_ACQUIRE);
+    if (l1 == NULL) return NULL;
+    struct pindex_l2 *l2 = __atomic_load_n(&l1->nodes[PINDEX_IDX(va, PINDEX_L1_SHIFT)], __ATOMIC_ACQUIRE);
+    if (l2 == NULL) return NULL;
+    struct pindex_slot *slot = &l2->slots[PINDEX_IDX(va, PINDEX_L2_SHIFT)];
+
+    if ((va & ((1UL << PINDEX_L2_SHIFT) - 1)) == 0) {
+        return __atomic_load_n(&slot->page, __ATOMIC_ACQUIRE);
+    }
+    struct pindex_leaf *leaf = __atomic_load_n(&slot->leaf, __ATOMIC_ACQUIRE);
+    if (leaf == NULL) return NULL;
+    return __atomic_load_n(&leaf->pages[PINDEX_IDX(va, PINDEX_L3_SHIFT)], __ATOMIC_ACQUIRE);
+}
+
+#endif
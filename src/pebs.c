@@ -1,4 +1,8 @@
 #include "pebs.h"
+#include "policy.h"
+#include "region.h"
+#include "arena.h"
+#include "alloc-site.h"
 
 // #define CHECK_KILLED(thread) if (!(num_loops++ & 0xFFFF) && killed(thread)) return NULL;
 #define CHECK_KILLED(thread) 
@@ -11,13 +15,20 @@
 static int pfd[PEBS_NPROCS][NPBUFTYPES];
 static struct perf_event_mmap_page *perf_page[PEBS_NPROCS][NPBUFTYPES];
 static uint64_t no_samples[PEBS_NPROCS][NPBUFTYPES];
-static FILE* tmem_trace_fp = NULL;
 static _Atomic bool kill_internal_threads[NUM_INTERNAL_THREADS];
 static pthread_t internal_threads[NUM_INTERNAL_THREADS];
+static pthread_t scan_threads[MAX_SCAN_THREADS];
+static pthread_t mig_threads[MAX_MIG_THREADS];
 
-static _Thread_local uint64_t last_cyc_cool;
+// Samples found by one scan thread for a page owned by another [from][to]
+static struct spsc_ring *shard_rings[MAX_SCAN_THREADS][MAX_SCAN_THREADS];
+static _Thread_local uint32_t scan_shard = 0;
 
-static uint64_t global_clock = 0;
+// Feedback for the sample period controller, drained every stats interval
+static uint64_t buf_samples[PEBS_NPROCS][NPBUFTYPES];
+static uint64_t buf_throttles[PEBS_NPROCS][NPBUFTYPES];
+static uint64_t buf_period[PEBS_NPROCS][NPBUFTYPES];
+static uint64_t scan_busy_cyc[MAX_SCAN_THREADS];
 
 
 struct perf_sample {
@@ -29,14 +40,32 @@ struct perf_sample {
 // __u64 data_src;         /* if PERF_SAMPLE_DATA_SRC */
 };
 
+struct shard_sample {
+    struct tmem_page *page;
+    uint64_t addr;
+    uint64_t ip;
+    uint64_t time;
+    uint32_t cpu;
+    uint8_t evt;
+};
+
 
 
 struct pebs_stats pebs_stats = {0};
 
 
 void wait_for_threads() {
+    for (uint32_t i = 0; i < tmem_cfg.scan_threads; i++) {
+        void *ret;
+        pthread_join(scan_threads[i], &ret);
+    }
+    for (uint32_t i = 0; i < tmem_cfg.mig_threads; i++) {
+        void *ret;
+        pthread_join(mig_threads[i], &ret);
+    }
     for (int i = 0; i < NUM_INTERNAL_THREADS; i++) {
         void *ret;
+        if (i == PEBS_THREAD || i == MIGRATE_THREAD) continue;     // scan and migrate threads joined above
         pthread_join(internal_threads[i], &ret);
     }
     LOG_DEBUG("Internal threads killed\n");
@@ -75,7 +104,7 @@ static struct perf_event_mmap_page* perf_setup(__u64 config, __u64 config1, uint
 
     attr.config = config;
     attr.config1 = config1;
-    attr.sample_period = SAMPLE_PERIOD;
+    attr.sample_period = tmem_cfg.sample_period;
 
     attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR; // PERF_SAMPLE_TID, PERF_SAMPLE_WEIGHT
     attr.disabled = 0;
@@ -85,7 +114,12 @@ static struct perf_event_mmap_page* perf_setup(__u64 config, __u64 config1, uint
     attr.exclude_callchain_kernel = 1;
     attr.exclude_callchain_user = 1;
     attr.precise_ip = 1;
+    if (tmem_cfg.epoll_scan) {
+        attr.watermark = 1;
+        attr.wakeup_watermark = WAKEUP_WATERMARK;
+    }
     
+    buf_period[cpu_idx][type] = attr.sample_period;
     pfd[cpu_idx][type] = perf_event_open(&attr, -1, cpu, -1, 0);
     assert(pfd[cpu_idx][type] != -1);
 
@@ -103,16 +137,87 @@ static struct perf_event_mmap_page* perf_setup(__u64 config, __u64 config1, uint
     return p;
 }
 
+static inline uint32_t scan_owner_of_cpu(uint32_t cpu_idx) {
+    for (uint32_t t = 0; t < tmem_cfg.scan_threads; t++) {
+        if (cpu_idx < (t + 1) * tmem_cfg.pebs_nprocs / tmem_cfg.scan_threads) return t;
+    }
+    return 0;
+}
+
+// Sample period controller, run once per stats interval
+// Doubles the period of a buffer that got throttled, whose scan thread is over
+// scan_budget percent busy or that samples above 2x target_sample_rate.
+// Halves it when well below target and the scan thread has headroom
+static void adapt_sample_periods(double secs, uint64_t cycles) {
+    double busy[MAX_SCAN_THREADS];
+    double max_busy = 0;
+    for (uint32_t t = 0; t < tmem_cfg.scan_threads; t++) {
+        busy[t] = 100.0 * __atomic_exchange_n(&scan_busy_cyc[t], 0, __ATOMIC_RELAXED) / cycles;
+        if (busy[t] > max_busy) max_busy = busy[t];
+    }
+
+    uint32_t throttled = 0, over_budget = 0, too_fast = 0, lowered = 0;
+    uint64_t min_period = UINT64_MAX, max_period = 0;
+    for (uint32_t cpu_idx = 0; cpu_idx < tmem_cfg.pebs_nprocs; cpu_idx++) {
+        uint32_t owner = scan_owner_of_cpu(cpu_idx);
+        for (int evt = 0; evt < NPBUFTYPES; evt++) {
+            double rate = __atomic_exchange_n(&buf_samples[cpu_idx][evt], 0, __ATOMIC_RELAXED) / secs;
+            uint64_t throttles = __atomic_exchange_n(&buf_throttles[cpu_idx][evt], 0, __ATOMIC_RELAXED);
+            uint64_t period = buf_period[cpu_idx][evt];
+            uint64_t new_period = period;
+
+            if (throttles != 0) {
+                new_period = period * 2;
+                throttled++;
+            } else if (busy[owner] > tmem_cfg.scan_budget) {
+                new_period = period * 2;
+                over_budget++;
+            } else if (rate > 2.0 * tmem_cfg.target_sample_rate) {
+                new_period = period * 2;
+                too_fast++;
+            } else if (rate < 0.5 * tmem_cfg.target_sample_rate && busy[owner] < tmem_cfg.scan_budget / 2.0) {
+                new_period = period / 2;
+            }
+            if (new_period > tmem_cfg.sample_period_max) new_period = tmem_cfg.sample_period_max;
+            if (new_period < tmem_cfg.sample_period) new_period = tmem_cfg.sample_period;
+
+            if (new_period != period && ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_PERIOD, &new_period) == 0) {
+                if (new_period < period) lowered++;
+                buf_period[cpu_idx][evt] = new_period;
+            }
+            if (buf_period[cpu_idx][evt] < min_period) min_period = buf_period[cpu_idx][evt];
+            if (buf_period[cpu_idx][evt] > max_period) max_period = buf_period[cpu_idx][evt];
+        }
+    }
+
+    LOG_STATS("	period_min: [%lu]	period_max: [%lu]	scan_busy: [%.1f]	raised_throttled: [%u]	raised_budget: [%u]	raised_rate: [%u]	lowered: [%u]\n",
+            min_period, max_period, max_busy, throttled, over_budget, too_fast, lowered);
+    // a space and up to 20 digits per period, " |" between the events
+    char line[PEBS_NPROCS * NPBUFTYPES * 21 + 3];
+    size_t len = 0;
+    for (int evt = 0; evt < NPBUFTYPES; evt++) {
+        for (uint32_t cpu_idx = 0; cpu_idx < tmem_cfg.pebs_nprocs; cpu_idx++) {
+            len += snprintf(line + len, sizeof(line) - len, " %lu", buf_period[cpu_idx][evt]);
+            if (len >= sizeof(line)) len = sizeof(line) - 1;
+        }
+        if (evt == DRAMREAD) len += snprintf(line + len, sizeof(line) - len, " |");
+        if (len >= sizeof(line)) len = sizeof(line) - 1;
+    }
+    LOG_STATS("	periods (dram | rem):%s\n", line);
+}
+
 void* pebs_stats_thread() {
     internal_call = true;
 
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(PEBS_STATS_CPU, &cpuset);
+    CPU_SET(tmem_cfg.stats_cpu, &cpuset);
     int s = pthread_setaffinity_np(internal_threads[PEBS_STATS_THREAD], sizeof(cpu_set_t), &cpuset);
     assert(s == 0);
 
 
+    struct timespec last_time = get_time();
+    uint64_t last_cyc = rdtscp();
     while (!killed(PEBS_STATS_THREAD)) {
         sleep(1);
         LOG_STATS("internal_mem_overhead: [%lu]\tmem_allocated: [%lu]\tthrottles: [%lu]\tunthrottles: [%lu]\tunknown_samples: [%lu]\n", 
@@ -120,12 +225,16 @@ void* pebs_stats_thread() {
         LOG_STATS("\twrapped_records: [%lu]\twrapped_headers: [%lu]\n", 
                 pebs_stats.wrapped_records, pebs_stats.wrapped_headers);
 
-#if DRAM_BUFFER != 0
-        LOG_STATS("\tdram_free: [%ld]\tdram_used: [%ld]\t dram_size: [%ld]\trem_used: [%ld]\n", dram_free, dram_used, dram_size, rem_used);
-#endif
-#if DRAM_SIZE != 0
-        LOG_STATS("\tdram_used: [%ld]\t dram_size: [%ld]\tnon_tracked_mem: [%lu]\n", dram_used, dram_size, pebs_stats.non_tracked_mem);
-#endif
+        uint64_t cold_pages = 0, hot_pages = 0;
+        for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+            LOG_STATS("\ttier: [%u]\tnode: [%d]\tused: [%ld]\tsize: [%ld]\tfree: [%ld]\thot_pages: [%lu]\tcold_pages: [%lu]\n",
+                    t, tiers[t].node, tiers[t].used, tiers[t].size, tiers[t].free, hot_queue_len(&hot_queues[t]), cold_lists[t].numentries);
+            cold_pages += cold_lists[t].numentries;
+            hot_pages += hot_queue_len(&hot_queues[t]);
+        }
+        if (tmem_cfg.dram_buffer == 0) {
+            LOG_STATS("\tnon_tracked_mem: [%lu]\n", pebs_stats.non_tracked_mem);
+        }
         double percent_dram = 100.0 * pebs_stats.dram_accesses / (pebs_stats.dram_accesses + pebs_stats.rem_accesses);
         LOG_STATS("\tdram_accesses: [%ld]\trem_accesses: [%ld]\t percent_dram: [%.2f]\n", 
             pebs_stats.dram_accesses, pebs_stats.rem_accesses, percent_dram);
@@ -134,9 +243,77 @@ void* pebs_stats_thread() {
         LOG_STATS("\tpromotions: [%lu]\tdemotions: [%lu]\tmigrations: [%lu]\tpebs_resets: [%lu]\tmig_move_time: [%.2f]\tmig_queue_time: [%.2f]\n", 
                 pebs_stats.promotions, pebs_stats.demotions, migrations, pebs_stats.pebs_resets, mig_move_time, mig_queue_time);
 
+        LOG_STATS("\tmig_batches: [%lu]\tmig_syscalls: [%lu]\tmig_failures: [%lu]\n",
+                pebs_stats.mig_batches, pebs_stats.mig_syscalls, pebs_stats.mig_failures);
+        LOG_STATS("\tremaps: [%lu]\tpartial_unmaps: [%lu]\tdiscards: [%lu]\trefaults: [%lu]\n",
+                pebs_stats.remaps, pebs_stats.partial_unmaps, pebs_stats.discards, pebs_stats.refaults);
+        if (tmem_cfg.demote_wm_low != 0) {
+            LOG_STATS("\tdemote_wm_low: [%ld]\tdemote_wm_high: [%ld]\twm_demotions: [%lu]\twm_misses: [%lu]\n",
+                    tmem_cfg.demote_wm_low, tmem_cfg.demote_wm_high, pebs_stats.wm_demotions, pebs_stats.wm_misses);
+        }
+
+        if (tmem_cfg.mig_promote_rate != 0 || tmem_cfg.mig_demote_rate != 0) {
+            LOG_STATS("\tmig_promote_rate: [%lu]\tmig_demote_rate: [%lu]\tpromote_throttles: [%lu]\tdemote_throttles: [%lu]\n",
+                    tmem_cfg.mig_promote_rate, tmem_cfg.mig_demote_rate, pebs_stats.promote_throttles, pebs_stats.demote_throttles);
+        }
+        if (tmem_cfg.subpage_algo) {
+            LOG_STATS("\tsubpage_promotions: [%lu]\tsubpage_bytes: [%lu]\n", pebs_stats.subpage_promotions, pebs_stats.subpage_bytes);
+        }
+        if (tmem_cfg.admit_algo) {
+            LOG_STATS("\tadmit_rejects: [%lu]\tadmit_defers: [%lu]\tmig_page_time: [%.2f]\tmig_residency: [%.2f]\n",
+                    pebs_stats.admit_rejects, pebs_stats.admit_defers, mig_page_time, mig_residency);
+        }
+
+        double bot_dist = algo_bot_dist(), avg_dist = algo_avg_dist();
         LOG_STATS("\tthreshold: [%.2f]\tavg_dist: [%.2f]\tdiff: [%.2f]\n", bot_dist, avg_dist, avg_dist - bot_dist);
+        if (tmem_cfg.cluster_algo && tmem_cfg.pred_algo == PRED_MARKOV) {
+            LOG_STATS("\tmarkov_evictions: [%lu]\n", pebs_stats.markov_evictions);
+            pebs_stats.markov_evictions = 0;
+        }
+        if (tmem_cfg.arena_algo) {
+            struct arena_stats st;
+            arena_get_stats(&st);
+            LOG_STATS("\tarenas: [%lu]\tfree_arenas: [%lu]\tarena_bytes: [%lu]\tarena_sites: [%u]\tarena_tiers:", st.arenas, st.free_arenas, st.bytes, st.sites);
+            for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) LOG_STATS(" [%lu]", st.tier_arenas[t]);
+            LOG_STATS("\n");
+        }
+        if (tmem_cfg.site_algo) {
+            LOG_STATS("\talloc_sites: [%u]\tsite_lowered_bytes: [%lu]\n", site_count(), pebs_stats.site_lowered_bytes);
+            pebs_stats.site_lowered_bytes = 0;
+        }
+        if (tmem_cfg.lazy_meta) {
+            region_refill();
+            LOG_STATS("\tregions: [%lu]\tlazy_pages: [%lu]\tlazy_victims: [%lu]\tlazy_misses: [%lu]\n",
+                    region_count(), pebs_stats.lazy_pages, pebs_stats.lazy_victims, pebs_stats.lazy_misses);
+        }
+        if (tmem_cfg.sample_backend == BACKEND_DAEMON) {
+            LOG_STATS("\ttmemd_drops: [%lu]\ttmemd_demote_bytes: [%lu]\ttier_own:", tmemd_client_drops(), pebs_stats.tmemd_demote_bytes);
+            for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) LOG_STATS(" [%ld]", tier_own[t]);
+            LOG_STATS("\n");
+            pebs_stats.tmemd_demote_bytes = 0;
+        }
+        if (tmem_cfg.scan_threads > 1) {
+            LOG_STATS("\tscan_threads: [%u]\tshard_forwards: [%lu]\tshard_drops: [%lu]\n", 
+                    tmem_cfg.scan_threads, pebs_stats.shard_forwards, pebs_stats.shard_drops);
+            pebs_stats.shard_forwards = 0;
+            pebs_stats.shard_drops = 0;
+        }
 
-        LOG_STATS("\tcold_pages: [%lu]\thot_pages: [%lu]\n", cold_list.numentries, hot_list.numentries);
+        LOG_STATS("\tcold_pages: [%lu]\thot_pages: [%lu]\thot_queue_drops: [%lu]\tclock_skips: [%lu]\n", 
+                cold_pages, hot_pages, pebs_stats.hot_queue_drops, pebs_stats.clock_skips);
+
+        struct timespec cur_time = get_time();
+        uint64_t cur_cyc = rdtscp();
+        if (tmem_cfg.adaptive_period && tmem_cfg.sample_backend == BACKEND_PEBS) {
+            adapt_sample_periods(elapsed_time(last_time, cur_time), cur_cyc - last_cyc);
+        }
+        tsc_hz = (cur_cyc - last_cyc) / elapsed_time(last_time, cur_time);
+        last_time = cur_time;
+        last_cyc = cur_cyc;
+        tmem_config_reload(stats_fp);
+#if RECORD == 1
+        LOG_STATS("\ttrace_drops: [%lu]\tlog_drops: [%lu]\n", pebs_stats.trace_drops, pebs_stats.log_drops);
+#endif
 
 
 
@@ -147,18 +324,24 @@ void* pebs_stats_thread() {
         pebs_stats.throttles = 0;
         pebs_stats.unthrottles = 0;
         pebs_stats.pebs_resets = 0;
+        pebs_stats.mig_batches = 0;
+        pebs_stats.mig_syscalls = 0;
+        pebs_stats.mig_failures = 0;
+        pebs_stats.wm_demotions = 0;
+        pebs_stats.wm_misses = 0;
+        pebs_stats.clock_skips = 0;
+        pebs_stats.admit_rejects = 0;
+        pebs_stats.admit_defers = 0;
+        pebs_stats.promote_throttles = 0;
+        pebs_stats.subpage_promotions = 0;
+        pebs_stats.subpage_bytes = 0;
+        pebs_stats.demote_throttles = 0;
         
 
-#if DRAM_BUFFER != 0
-        // hacky way to update dram_used every second in case there's drift over time
-        dram_size = numa_node_size(DRAM_NODE, &dram_free);
-        dram_used = dram_size - dram_free;
-        dram_size -= DRAM_BUFFER;
-
-        long rem_free;
-        long rem_size = numa_node_size(REM_NODE, &rem_free);
-        rem_used = rem_size - rem_free;
-#endif
+        if (tmem_cfg.dram_buffer != 0) {
+            // hacky way to update tier usage every second in case there's drift over time
+            tier_refresh();
+        }
     }
     return NULL;
 }
@@ -168,105 +351,15 @@ static void start_pebs_stats_thread() {
     assert(s == 0);
 }
 
-// Could be munmapped at any time
-void make_hot_request(struct tmem_page* page) {
-    if (page == NULL) return;
-    // page could be munmapped here (but pages are never actually
-    // unmapped so just check if it's in free state once locked)
-    if (pthread_mutex_trylock(&page->page_lock) != 0) { // Abort if lock taken to speed up pebs thread
-        return;
-    }
-    // pthread_mutex_lock(&page->page_lock);
-    // check if unmapped
-    if (page->free) {
-        // printf("Page was free\n");
-        pthread_mutex_unlock(&page->page_lock);
-        return;
-    }
-    page->hot = true;
-    
-    // add to hot list if:
-    // page is not already in hot list and in remote mem
-    if (page->list != &hot_list && page->in_dram == IN_REM) {
-        // page should not be hot
-        // not be cold since all cold pages are in dram
-        // not be free 
-        // either was in remote mem or just got dequeued
-        // from cold list in migrate thread
-        // page->list == &cold_list and in Remote
-#if LRU_ALGO == 0
-        if (page->list != NULL) {
-            assert(page->list == &cold_list);
-            page_list_remove_page(&cold_list, page);
-        }
-#endif
-        assert(page->list == NULL);
-        enqueue_fifo(&hot_list, page);
-        page->mig_start = rdtscp();
-
-    }
-#if LRU_ALGO == 1
-    // If already in dram update LRU cold list
-    else if (page->in_dram == IN_DRAM) {
-        assert(page->list == &cold_list);
-        page_list_remove_page(&cold_list, page);
-        enqueue_fifo(&cold_list, page);
-    }
-#endif
-    // printf("page is either already in hot list or is in remote memory\n");
-    
-    pthread_mutex_unlock(&page->page_lock);
-
+static inline uint32_t shard_of(struct tmem_page *page) {
+    return (page->va >> SHARD_SHIFT) % tmem_cfg.scan_threads;
 }
 
-void make_cold_request(struct tmem_page* page) {
-    if (page == NULL) return;
-    // page could be munmapped here (but pages are never actually
-    // unmapped so just check if it's in free state once locked)
-    if (pthread_mutex_trylock(&page->page_lock) != 0) { // Abort if lock taken to speed up pebs thread
-        LOG_DEBUG("Failed lock: 0x%lx\n", page->va);
-        return;
-    }
-    // check if unmapped
-    if (page->free) {
-        pthread_mutex_unlock(&page->page_lock);
-        return;
-    }
-    page->hot = false;
-#if LRU_ALGO == 0
-    // move to cold list if:
-    // page is not already in cold list and
-    // page is in dram
-    if (page->list != &cold_list && page->in_dram == IN_DRAM) {
-        // remove from hot list
-        if (page->list != NULL) {
-            assert(page->list == &hot_list);
-            page_list_remove_page(&hot_list, page);
-        }
-        assert(page->list == NULL);
-        enqueue_fifo(&cold_list, page);
-    }
-#else
-    // Even if page is already in cold list
-    // move to back of cold list for LRU
-    if (page->in_dram == IN_DRAM) {
-        // assert(page->list != NULL);
-        assert(page->list != &free_list);
-        if (page->list != NULL) {   // page could be dequeued from migrate thread
-            page_list_remove_page(page->list, page);
-        }
-
-        assert(page->list == NULL);
-        enqueue_fifo(&cold_list, page);
-    }
-#endif
-    pthread_mutex_unlock(&page->page_lock);
-}
-static uint64_t samples_since_cool = 0;
-
 void process_perf_buffer(int cpu_idx, int evt) {
     struct perf_event_mmap_page *p = perf_page[cpu_idx][evt];
     uint64_t num_loops = 0;
+    uint64_t num_samples = 0, num_throttles = 0;
+    uint64_t start_cyc = tmem_cfg.adaptive_period ? rdtscp() : 0;
 
     while (p->data_head != p->data_tail && num_loops++ != 128) {
         
@@ -291,22 +384,24 @@ void process_perf_buffer(int cpu_idx, int evt) {
                 case PERF_RECORD_SAMPLE:
                     if (hdr->size - sizeof(struct perf_event_header) == sizeof(struct perf_sample)) {
                         memcpy(&rec, data + wrapped_tail + sizeof(struct perf_event_header), sizeof(struct perf_sample));
+                        num_samples++;
                         // rec = (struct perf_sample *)(data + wrapped_tail + sizeof(struct perf_event_header));
                         // printf("addr: 0x%llx, ip: 0x%llx, time: %llu\n", rec->addr, rec->ip, rec->time);
                     }
                     break;
                 case PERF_RECORD_THROTTLE:
-                    pebs_stats.throttles++;
+                    STAT_INC(throttles);
+                    num_throttles++;
                     break;
                 case PERF_RECORD_UNTHROTTLE:
-                    pebs_stats.unthrottles++;
+                    STAT_INC(unthrottles);
                     break;
                 default:
-                    pebs_stats.unknown_samples++;
+                    STAT_INC(unknown_samples);
                     break;
             }
         } else {
-            pebs_stats.wrapped_records++;
+            STAT_INC(wrapped_records);
         }
         p->data_tail += hdr->size;
  
@@ -320,121 +415,44 @@ void process_perf_buffer(int cpu_idx, int evt) {
         // Try 4KB aligned page if not 2MB aligned page
         if (page == NULL)
             page = find_page_no_lock(rec.addr & BASE_PAGE_MASK);
+        // First sample of a page without metadata yet
+        if (page == NULL && tmem_cfg.lazy_meta)
+            page = region_page(rec.addr);
         if (page == NULL) continue;
-#if RECORD == 1
-        struct pebs_rec p_rec = {
-            .va = addr_aligned,
+
+        no_samples[cpu_idx][evt] = rdtscp();
+
+        uint32_t owner = shard_of(page);
+        if (owner == scan_shard) {
+            process_sample(page, rec.addr, rec.ip, rec.time, cpu_idx, evt);
+            continue;
+        }
+        // Hand off to the scan thread that owns the page
+        struct shard_sample s_rec = {
+            .page = page,
+            .addr = rec.addr,
             .ip = rec.ip,
-            .cyc = rdtscp(),
+            .time = rec.time,
             .cpu = cpu_idx,
             .evt = evt
         };
-        fwrite(&p_rec, sizeof(struct pebs_rec), 1, tmem_trace_fp);
-#endif
-
-        // if (page->migrated) {
-        //     LOG_DEBUG("PEBS: accessed migrated page: 0x%lx\n", page->va);
-        // }
-
-        // cool off
-        page->accesses >>= (global_clock - page->local_clock);
-        page->local_clock = global_clock;
-
-        if (evt == DRAMREAD) pebs_stats.dram_accesses++;
-        else pebs_stats.rem_accesses++;
-        page->accesses++;
-
-        uint64_t cur_cyc = rdtscp();
-        if (rec.time > page->cyc_accessed) {
-            page->cyc_accessed = rec.time;
-            page->ip = rec.ip;
-        }
-
-        // LRU cold list
-        // if sample is cold move to end of cold queue
-        // Everything in DRAM is cold
-
-#if HEM_ALGO == 1
-        if (page->accesses >= HOT_THRESHOLD) {
-            // LOG_DEBUG("PEBS: Made hot: 0x%lx\n", page->va);
-#if RECORD == 1
-            struct pebs_rec p_rec = {
-                .va = page->va,
-                .ip = 0,
-                .cyc = rdtscp(),
-                .cpu = 0,
-                .evt = 0
-            };
-            fwrite(&p_rec, sizeof(struct pebs_rec), 1, pred_fp);
-#endif
-            make_hot_request(page);
+        if (spsc_ring_push(shard_rings[scan_shard][owner], &s_rec)) {
+            STAT_INC(shard_forwards);
         } else {
-            make_cold_request(page);
-        }
-
-        // Sample based cooling
-        // samples_since_cool++;
-        // if (samples_since_cool >= SAMPLE_COOLING_THRESHOLD) {
-        //     global_clock++;
-        //     samples_since_cool = 0;
-        //     // printf("cyc since last cool: %lu\n", cur_cyc - last_cyc_cool);
-        //     last_cyc_cool = rdtscp();
-        // }
-
-        // Time based cooling
-        if (cur_cyc - last_cyc_cool > CYC_COOL_THRESHOLD) {
-            // __atomic_fetch_add(&global_clock, 1, __ATOMIC_RELEASE);
-            global_clock++;
-            last_cyc_cool = cur_cyc;
-        }
-
-#endif 
-
-        
-
-        
-#if CLUSTER_ALGO == 1
-        algo_add_page(page);
-        
-        if (cold_list.numentries != 0) {
-            struct tmem_page *pred_pages[MAX_NEIGHBORS * MAX_PRED_DEPTH];
-            uint32_t idx = 0;
-            algo_predict_pages(page, pred_pages, &idx);
-
-            for (uint32_t i = 0; i < idx; i++) {
-                // LOG_DEBUG("PRED: 0x%lx from 0x%lx\n", pred_pages[i]->va, page->va);
-#if RECORD == 1
-                struct pebs_rec p_rec = {
-                    .va = pred_pages[i]->va,
-                    .ip = 0,
-                    .cyc = rdtscp(),
-                    .cpu = 0,
-                    .evt = 0
-                };
-                fwrite(&p_rec, sizeof(struct pebs_rec), 1, pred_fp);
-#endif
-                make_hot_request(pred_pages[i]);
-            }
-            
+            STAT_INC(shard_drops);
         }
-        
-#if LRU_ALGO == 1
-        // LRU based cold list
-        // everything in DRAM is in cold list
-        // with oldest page at front of queue
-        make_cold_request(page);
-#endif
-#endif
-
-        no_samples[cpu_idx][evt] = cur_cyc;
-
     }
     no_samples[cpu_idx][evt]++;
     p->data_tail = p->data_head;
 
     uint64_t cur_cyc = rdtscp();
+    if (tmem_cfg.adaptive_period && num_loops > 0) {
+        __atomic_fetch_add(&buf_samples[cpu_idx][evt], num_samples, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&buf_throttles[cpu_idx][evt], num_throttles, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&scan_busy_cyc[scan_shard], cur_cyc - start_cyc, __ATOMIC_RELAXED);
+    }
     if (cur_cyc > no_samples[cpu_idx][evt] + NO_SAMPLE_RESET_TIME) {
-        pebs_stats.pebs_resets++;
+        STAT_INC(pebs_resets);
         ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_DISABLE);
         ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_RESET);
         ioctl(pfd[cpu_idx][evt], PERF_EVENT_IOC_ENABLE);
@@ -443,207 +461,158 @@ void process_perf_buffer(int cpu_idx, int evt) {
     // Run clustering algorithm
 }
 
+// Process samples other scan threads found for pages this thread owns
+static void process_shard_rings() {
+    struct shard_sample s_rec;
+    for (uint32_t from = 0; from < tmem_cfg.scan_threads; from++) {
+        if (from == scan_shard) continue;
+        while (spsc_ring_pop(shard_rings[from][scan_shard], &s_rec)) {
+            process_sample(s_rec.page, s_rec.addr, s_rec.ip, s_rec.time, s_rec.cpu, s_rec.evt);
+        }
+    }
+}
 
-void* pebs_scan_thread() {
+
+void* pebs_scan_thread(void *arg) {
     internal_call = true;
+    scan_shard = (uint32_t)(uintptr_t)arg;
+    algo_set_shard(scan_shard);
     // set cpu
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(PEBS_SCAN_CPU, &cpuset);
-    // pthread_t thread_id = pthread_self();
-    int s = pthread_setaffinity_np(internal_threads[PEBS_THREAD], sizeof(cpu_set_t), &cpuset);
+    CPU_SET(tmem_cfg.scan_cpu + scan_shard * tmem_cfg.scan_cpu_stride, &cpuset);
+    int s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
     assert(s == 0);
     // pebs_init();
 
-    last_cyc_cool = rdtscp();
-
     // uint64_t num_loops = 0;
 
+    // This thread's share of the perf buffers
+    int pebs_start_cpu = scan_shard * tmem_cfg.pebs_nprocs / tmem_cfg.scan_threads;
+    int num_cores = (scan_shard + 1) * tmem_cfg.pebs_nprocs / tmem_cfg.scan_threads - pebs_start_cpu;
+
+    int epfd = -1;
+    struct epoll_event events[PEBS_NPROCS * NPBUFTYPES];
+    uint64_t last_sweep = rdtscp();
+    if (tmem_cfg.epoll_scan) {
+        epfd = epoll_create1(0);
+        assert(epfd != -1);
+        for (int cpu_idx = pebs_start_cpu; cpu_idx < pebs_start_cpu + num_cores; cpu_idx++) {
+            for (int evt = 0; evt < NPBUFTYPES; evt++) {
+                struct epoll_event ev = {
+                    .events = EPOLLIN,
+                    .data.u32 = cpu_idx * NPBUFTYPES + evt
+                };
+                s = epoll_ctl(epfd, EPOLL_CTL_ADD, pfd[cpu_idx][evt], &ev);
+                assert(s == 0);
+            }
+        }
+    }
     
     while (true) {
         CHECK_KILLED(PEBS_THREAD);
 
-        int pebs_start_cpu = 0;
-        int num_cores = PEBS_NPROCS;
+        if (tmem_cfg.epoll_scan) {
+            // Forwarded samples wait at most EPOLL_TIMEOUT_MS
+            int num_ready = epoll_wait(epfd, events, PEBS_NPROCS * NPBUFTYPES, EPOLL_TIMEOUT_MS);
+            if (num_ready > 0) {
+                for (int i = 0; i < num_ready; i++) {
+                    process_perf_buffer(events[i].data.u32 / NPBUFTYPES, events[i].data.u32 % NPBUFTYPES);
+                }
+                process_shard_rings();
+                // busy buffers can keep waking us up, still sweep the quiet ones
+                // every once in a while for their no sample resets
+                if (rdtscp() - last_sweep < NO_SAMPLE_RESET_TIME) continue;
+            }
+            // Timed out, drain buffers below the watermark
+            last_sweep = rdtscp();
+        }
 
         for (int cpu_idx = pebs_start_cpu; cpu_idx < pebs_start_cpu + num_cores; cpu_idx++) {
             for(int evt = 0; evt < NPBUFTYPES; evt++) {
                 process_perf_buffer(cpu_idx, evt);
             }
         }
+        process_shard_rings();
     }
     pebs_cleanup();
     return NULL;
 }
 
-void tmem_migrate_page(struct tmem_page *page, int node) {
-    unsigned long nodemask = 1UL << node;
-
-    if (mbind(page->va_start, page->size, MPOL_BIND, &nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT) == -1) {
-        perror("mbind");
-        printf("mbind failed %p\n", page->va_start);
-    } else {
-        if (node == DRAM_NODE) {
-            // was migrated to dram
-            page->in_dram = IN_DRAM;
-#if LRU_ALGO == 1
-            page->hot = false;
-            enqueue_fifo(&cold_list, page);
-#else
-            page->hot = true;
-            enqueue_fifo(&hot_list, page);
-#endif
-#if RECORD == 1
-            struct pebs_rec p_rec = {
-                .va = page->va,
-                .ip = 0,
-                .cyc = rdtscp(),
-                .cpu = 0,
-                .evt = 0
-            };
-            fwrite(&p_rec, sizeof(struct pebs_rec), 1, mig_fp);
-#endif
-        } else {
-#if RECORD == 1
-            struct pebs_rec p_rec = {
-                .va = page->va,
-                .ip = 0,
-                .cyc = rdtscp(),
-                .cpu = 0,
-                .evt = 0
-            };
-            fwrite(&p_rec, sizeof(struct pebs_rec), 1, cold_fp);
-#endif
-            page->in_dram = IN_REM;
-            page->hot = false;
+// Opens the perf buffers the scan threads drain
+static void pebs_backend_init() {
+    int pebs_start_cpu = 0;
+    int num_cores = tmem_cfg.pebs_nprocs;
+    
+    for (int i = pebs_start_cpu; i < pebs_start_cpu + num_cores; i++) {
+        perf_page[i][DRAMREAD] = perf_setup(0x1d3, 0, i, i * 2, DRAMREAD);      // MEM_LOAD_L3_MISS_RETIRED.LOCAL_DRAM, mem_load_uops_l3_miss_retired.local_dram
+        perf_page[i][REMREAD] = perf_setup(0x4d3, 0, i, i * 2, REMREAD);     //  mem_load_uops_l3_miss_retired.remote_dram
+        no_samples[i][DRAMREAD] = 0;
+        no_samples[i][REMREAD] = 0;
+    }
+
+    for (uint32_t from = 0; from < tmem_cfg.scan_threads; from++) {
+        for (uint32_t to = 0; to < tmem_cfg.scan_threads; to++) {
+            if (from == to) continue;
+            shard_rings[from][to] = spsc_ring_init(sizeof(struct shard_sample), SHARD_RING_SIZE);
         }
     }
 }
 
+const struct sample_backend sample_backends[NUM_SAMPLE_BACKENDS] = {
+    [BACKEND_PEBS] = {"pebs", pebs_backend_init, pebs_scan_thread},
+    [BACKEND_PAGE_IDLE] = {"page_idle", page_idle_init, page_idle_scan_thread},
+    [BACKEND_DAEMON] = {"daemon", tmemd_client_init, tmemd_scan_thread},
+};
 
-void *migrate_thread() {
+void *migrate_thread(void *arg) {
     internal_call = true;
+    uint32_t worker = (uintptr_t)arg;
 
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
-    CPU_SET(MIGRATE_CPU, &cpuset);
-    int s = pthread_setaffinity_np(internal_threads[MIGRATE_THREAD], sizeof(cpu_set_t), &cpuset);
+    CPU_SET(tmem_cfg.migrate_cpu + worker * tmem_cfg.migrate_cpu_stride, &cpuset);
+    int s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
     assert(s == 0);
     // uint64_t num_loops = 0;
 
-    struct tmem_page *hot_page, *cold_page;
-    uint64_t cold_bytes = 0;
-
     while (true) {
         // CHECK_KILLED(MIGRATE_THREAD);
 
-        // Don't do any migrations until hot page comes in
-        hot_page = dequeue_fifo(&hot_list);
-        if (hot_page == NULL) continue;
-        pthread_mutex_lock(&hot_page->page_lock);
-
-        assert(hot_page != NULL);
-        if (hot_page->list != NULL || hot_page->in_dram == IN_DRAM) {
-            pthread_mutex_unlock(&hot_page->page_lock);
+        uint64_t throttle_ns = mig_throttle_ns();
+        if (throttle_ns != 0) {
+            // over mig_promote_rate, sleep until the next batch can go
+            struct timespec ts = {.tv_sec = throttle_ns / 1000000000L, .tv_nsec = throttle_ns % 1000000000L};
+            nanosleep(&ts, NULL);
             continue;
         }
-        
-        LOG_DEBUG("MIG: got hot page: 0x%lx\n", hot_page->va);
-
-        uint64_t mig_queue_cyc = rdtscp();
-        uint64_t mig_queue_diff = mig_queue_cyc - hot_page->mig_start;
-        mig_queue_time = DEC_MIG_TIME * mig_queue_diff + (1.0 - DEC_MIG_TIME) * mig_queue_time;
-
-        // have a valid hot page. Now get cold pages
-        // disable dram mmap temporarily
-        atomic_store_explicit(&dram_lock, true, memory_order_release);
-        uint64_t bytes_free = dram_size - __atomic_load_n(&dram_used, __ATOMIC_ACQUIRE);
-
-        if (bytes_free >= hot_page->size) {
-            LOG_DEBUG("MIG: enough dram: 0x%lx\n", hot_page->va);
-            // Enough space in dram, just migrate hot page
-            // tmem_migrate_pages(&hot_page, 1, DRAM_NODE);
-            tmem_migrate_page(hot_page, DRAM_NODE);
-            hot_page->migrated = true;
-            pebs_stats.promotions++;
-            
-            __atomic_fetch_add(&dram_used, hot_page->size, __ATOMIC_RELEASE);
-            atomic_store_explicit(&dram_lock, false, memory_order_release);
-            LOG_DEBUG("MIG: Finished migration: 0x%lx\n", hot_page->va);
-            uint64_t mig_move_diff = rdtscp() - mig_queue_cyc;
-            mig_move_time = DEC_MIG_TIME * mig_move_diff + (1.0 - DEC_MIG_TIME) * mig_move_time;
-
-            pthread_mutex_unlock(&hot_page->page_lock);
-            continue;
+        if (migrate_batch(worker) == 0 && tmem_cfg.epoll_scan) {
+            // promotions out of the other tiers wait for the timeout
+            hot_queue_wait(&hot_queues[TOP_TIER + 1], MIG_WAIT_NS);
         }
-
-        cold_bytes = 0;
-        // Not enough space in dram, demote cold pages until enough space
-        while (bytes_free + cold_bytes < hot_page->size) {
-            cold_page = dequeue_fifo(&cold_list);
-            if (cold_page == NULL) {
-                // cold list is empty, abort
-                // enqueue_fifo(&hot_list, hot_page);
-                pthread_mutex_unlock(&hot_page->page_lock);
-
-                // enable dram mmap with updated dram_used
-                __atomic_fetch_sub(&dram_used, cold_bytes, __ATOMIC_RELEASE);
-                atomic_store_explicit(&dram_lock, true, memory_order_release);
-
-                LOG_DEBUG("MIG: no cold pages, aborting\n");
-                break;
-            }
-            assert(cold_page != NULL);
-            pthread_mutex_lock(&cold_page->page_lock);
-#if LRU_ALGO == 1
-            if (cold_page->list != NULL) {
-#else
-            if (cold_page->list != NULL || cold_page->in_dram == IN_REM || cold_page->hot) {
-#endif
-                // page got yoinked
-                pthread_mutex_unlock(&cold_page->page_lock);
-                continue;
-            }
-            assert(cold_page->in_dram == IN_DRAM);
-            // assert(!cold_page->hot);
-            assert(cold_page->list == NULL);
-
-            // tmem_migrate_pages(&cold_page, 1, REM_NODE);
-            tmem_migrate_page(cold_page, REM_NODE);
-            cold_page->migrated = true;
-            cold_bytes += cold_page->size;
-            LOG_DEBUG("MIG: demoted 0x%lx\n", cold_page->va);
-            pthread_mutex_unlock(&cold_page->page_lock);
-            pebs_stats.demotions++;
-        }
-        if (cold_page == NULL) continue;
-        // now enough space in dram
-        LOG_DEBUG("MIG: now enough space: 0x%lx\n", hot_page->va);
-        // tmem_migrate_pages(&hot_page, 1, DRAM_NODE);
-        tmem_migrate_page(hot_page, DRAM_NODE);
-        hot_page->migrated = true;
-        pebs_stats.promotions++;
-
-        // enable dram mmap
-        __atomic_fetch_add(&dram_used, hot_page->size - cold_bytes, __ATOMIC_RELEASE);
-        atomic_store_explicit(&dram_lock, false, memory_order_release);
-        LOG_DEBUG("MIG: Finished migration: 0x%lx\n", hot_page->va);
-
-        uint64_t mig_move_diff = rdtscp() - mig_queue_cyc;
-        mig_move_time = DEC_MIG_TIME * mig_move_diff + (1.0 - DEC_MIG_TIME) * mig_move_time;
-
-        pthread_mutex_unlock(&hot_page->page_lock);
     }
 }
 
 void start_pebs_thread() {
-    int s = pthread_create(&internal_threads[PEBS_THREAD], NULL, pebs_scan_thread, NULL);
-    assert(s == 0);
+    for (uintptr_t i = 0; i < tmem_cfg.scan_threads; i++) {
+        int s = pthread_create(&scan_threads[i], NULL, sample_backends[tmem_cfg.sample_backend].scan_thread, (void *)i);
+        assert(s == 0);
+    }
 }
 
 void start_migrate_thread() {
-    int s = pthread_create(&internal_threads[MIGRATE_THREAD], NULL, migrate_thread, NULL);
-    assert(s == 0);
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    for (uint32_t i = 0; i < tmem_cfg.mig_threads; i++) {
+        long cpu = tmem_cfg.migrate_cpu + (long)i * tmem_cfg.migrate_cpu_stride;
+        if (cpu < 0 || cpu >= num_cpus || cpu >= CPU_SETSIZE) {
+            fprintf(stderr, "tmem config: migrate worker %u would run on cpu %ld, there are %ld (migrate_cpu, migrate_cpu_stride)\n", i, cpu, num_cpus);
+            exit(1);
+        }
+    }
+    for (uintptr_t i = 0; i < tmem_cfg.mig_threads; i++) {
+        int s = pthread_create(&mig_threads[i], NULL, migrate_thread, (void *)i);
+        assert(s == 0);
+    }
 }
 
 void pebs_init(void) {
@@ -658,21 +627,8 @@ void pebs_init(void) {
     start_pebs_stats_thread();
 #endif
 
-    tmem_trace_fp = fopen("tmem_trace.bin", "wb");
-    if (tmem_trace_fp == NULL) {
-        perror("tmem_trace file fopen");
-    }
-    assert(tmem_trace_fp != NULL);
-
-    int pebs_start_cpu = 0;
-    int num_cores = PEBS_NPROCS;
-    
-    for (int i = pebs_start_cpu; i < pebs_start_cpu + num_cores; i++) {
-        perf_page[i][DRAMREAD] = perf_setup(0x1d3, 0, i, i * 2, DRAMREAD);      // MEM_LOAD_L3_MISS_RETIRED.LOCAL_DRAM, mem_load_uops_l3_miss_retired.local_dram
-        perf_page[i][REMREAD] = perf_setup(0x4d3, 0, i, i * 2, REMREAD);     //  mem_load_uops_l3_miss_retired.remote_dram
-        no_samples[i][DRAMREAD] = 0;
-        no_samples[i][REMREAD] = 0;
-    }
+    sample_backends[tmem_cfg.sample_backend].init();
+    policy_init();
 
     start_pebs_thread();
 
@@ -22,12 +22,14 @@
 #include <stdlib.h>
 #include <sched.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 
 #include "timer.h"
 #include "interpose.h"
 #include "logging.h"
 #include "spsc-ring.h"
 #include "fifo.h"
+#include "config.h"
 
 
 #ifndef NO_SAMPLE_RESET_TIME
@@ -38,6 +40,27 @@
     #define PEBS_SCAN_CPU 2
 #endif
 
+// Default number of scan threads (up to MAX_SCAN_THREADS)
+// each drains its own share of the perf buffers
+#ifndef PEBS_SCAN_THREADS
+    #define PEBS_SCAN_THREADS 1
+#endif
+
+// Scan thread i runs on PEBS_SCAN_CPU + i * PEBS_SCAN_CPU_STRIDE
+#ifndef PEBS_SCAN_CPU_STRIDE
+    #define PEBS_SCAN_CPU_STRIDE 8
+#endif
+
+// Page metadata is only updated by scan thread (va >> SHARD_SHIFT) % PEBS_SCAN_THREADS
+#ifndef SHARD_SHIFT
+    #define SHARD_SHIFT 21
+#endif
+
+// Samples in flight between two scan threads before new ones get dropped
+#ifndef SHARD_RING_SIZE
+    #define SHARD_RING_SIZE 4096
+#endif
+
 #ifndef PEBS_STATS_CPU
     #define PEBS_STATS_CPU 4
 #endif
@@ -46,14 +69,67 @@
     #define MIGRATE_CPU 6
 #endif
 
+// Migrate workers, promotions out of the same hot list run in parallel
+#ifndef MIG_THREADS
+    #define MIG_THREADS 1
+#endif
+
+// Migrate worker i runs on MIGRATE_CPU + i * MIGRATE_CPU_STRIDE
+#ifndef MIGRATE_CPU_STRIDE
+    #define MIGRATE_CPU_STRIDE 8
+#endif
+
 #ifndef SAMPLE_PERIOD
     #define SAMPLE_PERIOD 3200
 #endif
 
+// Let the stats thread adapt the sample period of each perf buffer
+// between SAMPLE_PERIOD and SAMPLE_PERIOD_MAX (PEBS backend only)
+#ifndef ADAPTIVE_PERIOD
+    #define ADAPTIVE_PERIOD 0
+#endif
+
+#ifndef SAMPLE_PERIOD_MAX
+    #define SAMPLE_PERIOD_MAX 20000
+#endif
+
+// Samples per second per perf buffer the controller aims for
+#ifndef TARGET_SAMPLE_RATE
+    #define TARGET_SAMPLE_RATE 20000
+#endif
+
+// Max percent of time a scan thread should spend draining samples
+#ifndef SCAN_BUDGET
+    #define SCAN_BUDGET 50
+#endif
+
 #ifndef PERF_PAGES
     #define PERF_PAGES (1 + (1 << 4))  // Uses 8GB total for 16 CPUs
 #endif
 
+// Default for sleeping on the perf fds (epoll) and on the hot list (futex)
+// instead of busy polling so the scan and migrate threads don't burn their cores
+#ifndef EPOLL_SCAN
+    #define EPOLL_SCAN 0
+#endif
+
+// Bytes of samples in a perf buffer before it wakes the scan thread
+// (~128 samples, what process_perf_buffer drains per call)
+#ifndef WAKEUP_WATERMARK
+    #define WAKEUP_WATERMARK 4096
+#endif
+
+// Max time the scan thread sleeps so idle buffers still get reset/drained
+#ifndef EPOLL_TIMEOUT_MS
+    #define EPOLL_TIMEOUT_MS 10
+#endif
+
+// Max time the migrate thread sleeps waiting for hot pages
+#ifndef MIG_WAIT_NS
+    #define MIG_WAIT_NS 10000000
+#endif
+
+// Max (and default) number of CPUs sampled, cpu i samples core i * 2
 #ifndef PEBS_NPROCS
     #define PEBS_NPROCS 16
 #endif
@@ -70,10 +146,113 @@
     #define CYC_COOL_THRESHOLD 10000000
 #endif
 
+// Max (and default) hot pages promoted together in one migration batch
+#ifndef MIG_BATCH_SIZE
+    #define MIG_BATCH_SIZE 32
+#endif
+
+// Max cold pages demoted per batch (victims can be smaller than hot pages)
+#ifndef MIG_COLD_BATCH_SIZE
+    #define MIG_COLD_BATCH_SIZE (4 * MIG_BATCH_SIZE)
+#endif
+
+// Background demotion: once a tier has less than DEMOTE_WM_LOW bytes free the
+// migrate thread demotes cold pages until DEMOTE_WM_HIGH are free again (0 = off)
+#ifndef DEMOTE_WM_LOW
+    #define DEMOTE_WM_LOW 0
+#endif
+
+#ifndef DEMOTE_WM_HIGH
+    #define DEMOTE_WM_HIGH 0
+#endif
+
+// Cost-benefit admission of promotions that need a demotion (0 = off)
+#ifndef ADMIT_ALGO
+    #define ADMIT_ALGO 0
+#endif
+
+// Cycles an access to the lower tier costs over the upper one
+#ifndef ADMIT_LAT_DELTA
+    #define ADMIT_LAT_DELTA 200
+#endif
+
+// Max percent of each cooling period spent on admitted swaps
+#ifndef ADMIT_BUDGET
+    #define ADMIT_BUDGET 100
+#endif
+
+// Migration rate limits in bytes per second, 0 = unlimited
+#ifndef MIG_PROMOTE_RATE
+    #define MIG_PROMOTE_RATE 0
+#endif
+
+#ifndef MIG_DEMOTE_RATE
+    #define MIG_DEMOTE_RATE 0
+#endif
+
+// A rate limited direction can save up this many ms of its rate for a burst
+#ifndef MIG_RATE_BURST_MS
+    #define MIG_RATE_BURST_MS 100
+#endif
+
+// Cycles per second until the stats thread has measured it
+#ifndef TSC_HZ
+    #define TSC_HZ 2000000000.0
+#endif
+
+// Sub-page hotness tracking, sparse pages promote only their sampled sub-pages (0 = off)
+#ifndef SUBPAGE_ALGO
+    #define SUBPAGE_ALGO 0
+#endif
+
+// A page is dense, and moves whole, if its samples hit at least this
+// percent of distinct sub-pages
+#ifndef SUBPAGE_DENSE
+    #define SUBPAGE_DENSE 50
+#endif
+
+// Samples needed before a page can be called sparse
+#ifndef SUBPAGE_MIN_SAMPLES
+    #define SUBPAGE_MIN_SAMPLES 4
+#endif
+
 #ifndef LRU_ALGO
     #define LRU_ALGO 0
 #endif
 
+// How demotion victims are picked (tmem_cfg.lru_algo)
+enum {
+    LRU_FIFO,   // cold list in the order pages went cold
+    LRU_LIST,   // every sample moves the page to the back of the cold list
+    LRU_CLOCK,  // samples only set page->referenced, demotion gives referenced pages a second chance
+    NUM_LRU_ALGOS
+};
+
+// Where samples come from (tmem_cfg.sample_backend)
+#ifndef SAMPLE_BACKEND
+    #define SAMPLE_BACKEND 0
+#endif
+
+// How often the page_idle backend rescans all tracked pages
+#ifndef PAGE_IDLE_SCAN_MS
+    #define PAGE_IDLE_SCAN_MS 100
+#endif
+
+enum {
+    BACKEND_PEBS,       // PEBS load samples through perf (Intel only)
+    BACKEND_PAGE_IDLE,  // page table accessed bits through /sys/kernel/mm/page_idle
+    BACKEND_DAEMON,     // PEBS samples forwarded by tmemd, which also owns the tiers (tmemd.h)
+    NUM_SAMPLE_BACKENDS
+};
+
+struct sample_backend {
+    const char *name;
+    void (*init)();                     // called once from pebs_init
+    void* (*scan_thread)(void *arg);    // started scan_threads times, arg is the shard
+};
+
+extern const struct sample_backend sample_backends[NUM_SAMPLE_BACKENDS];
+
 enum {
     PEBS_THREAD,
     PEBS_STATS_THREAD,
@@ -107,12 +286,40 @@ struct pebs_stats {
     uint64_t promotions, demotions;
     uint64_t pebs_resets;
     uint64_t non_tracked_mem;
+    uint64_t mig_batches, mig_syscalls, mig_failures;
+    uint64_t wm_demotions;  // pages demoted in the background
+    uint64_t wm_misses;     // promotion batches that still had to demote first
+    uint64_t hot_queue_drops;   // hot requests lost to a full hot queue
+    uint64_t clock_skips;       // referenced pages the clock passed over
+    uint64_t admit_rejects;     // swaps refused, the hot page wasn't hotter than the victims
+    uint64_t admit_defers;      // swaps not worth their cost yet or over admit_budget
+    uint64_t promote_throttles, demote_throttles;   // batches held back by mig_promote_rate/mig_demote_rate
+    uint64_t subpage_promotions, subpage_bytes;     // sparse pages promoted by their sampled sub-pages
+    uint64_t markov_evictions;  // Markov table entries taken over by another page
+    uint64_t lazy_pages;        // page metadata created after tmem_mmap (lazy_meta), cumulative
+    uint64_t lazy_victims;      // of those, never sampled pages picked for demotion
+    uint64_t lazy_misses;       // samples that found no page and couldn't create one without waiting, cumulative
+    uint64_t remaps, partial_unmaps;    // tracked mremaps, munmaps that cut into a page
+    uint64_t discards, refaults;    // pages madvise freed, and of those sampled again
+    uint64_t site_lowered_bytes;    // mmapped below the top tier for a cold allocation site (site_algo)
+    uint64_t tmemd_demote_bytes;    // tmemd asked to demote for other processes
+    uint64_t shard_forwards, shard_drops;
+    uint64_t trace_drops, log_drops;    // cumulative, see trace.h
 };
 
 extern struct pebs_stats pebs_stats;
 
+// Stats shared by the scan threads
+#define STAT_INC(stat) __atomic_fetch_add(&pebs_stats.stat, 1, __ATOMIC_RELAXED)
+
 
 void pebs_init();
+void page_idle_init();
+void* page_idle_scan_thread(void *arg);
+void tmemd_client_init();
+void* tmemd_scan_thread(void *arg);
+// Samples tmemd dropped for this process so far
+uint64_t tmemd_client_drops();
 void start_pebs_thread();
 void wait_for_threads();
 void kill_threads();
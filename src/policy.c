@@ -0,0 +1,971 @@
+#include "policy.h"
+#include "markov.h"
+#include "stride.h"
+#include "region.h"
+#include "alloc-site.h"
+
+static uint64_t last_cyc_cool;
+
+static uint32_t global_clock = 0;     // cooling periods, page->local_clock wraps with it
+
+double tsc_hz = TSC_HZ;
+
+// Could be munmapped at any time
+void make_hot_request(struct tmem_page* page) {
+    if (page == NULL) return;
+    // With the clock every page is already on its tier's cold list,
+    // a top tier page has nothing else to do
+    if (tmem_cfg.lru_algo == LRU_CLOCK && page->tier == TOP_TIER) {
+        page->hot = true;
+        return;
+    }
+    // page could be munmapped here (but pages are never actually
+    // unmapped so just check if it's in free state once locked)
+    if (!page_trylock(page)) { // Abort if lock taken to speed up pebs thread
+        return;
+    }
+    // page_lock(page);
+    // check if unmapped
+    if (page->free) {
+        // printf("Page was free\n");
+        page_unlock(page);
+        return;
+    }
+    page->hot = true;
+    uint8_t tier = page->tier;
+    
+    // add to hot queue if:
+    // page is below the top tier (push skips it if it's already queued)
+    if (tier != TOP_TIER) {
+        // page should not be free 
+        // either was in a lower tier or just got dequeued
+        // from a cold list in migrate thread
+        // pages in a middle tier can still be in its cold list
+        // (the clock leaves them there until they move)
+        if (page->list != NULL && tmem_cfg.lru_algo != LRU_CLOCK) {
+            assert(page->list == &cold_lists[tier]);
+            page_list_remove_page(&cold_lists[tier], page);
+        }
+        if (!page->queued) {
+            page->meta->mig_start = rdtscp();
+            if (!hot_queue_push(&hot_queues[tier], page)) STAT_INC(hot_queue_drops);
+        }
+    }
+    // If already in dram update LRU cold list
+    else if (tmem_cfg.lru_algo == 1 && tier == TOP_TIER) {
+        assert(page->list == &cold_lists[tier]);
+        page_list_remove_page(&cold_lists[tier], page);
+        enqueue_fifo(&cold_lists[tier], page);
+    }
+    // printf("page is either already in hot list or is in remote memory\n");
+    
+    page_unlock(page);
+
+}
+
+void make_cold_request(struct tmem_page* page) {
+    if (page == NULL) return;
+    // the clock finds cold pages by their reference bit
+    if (tmem_cfg.lru_algo == LRU_CLOCK) {
+        page->hot = false;
+        return;
+    }
+    // page could be munmapped here (but pages are never actually
+    // unmapped so just check if it's in free state once locked)
+    if (!page_trylock(page)) { // Abort if lock taken to speed up pebs thread
+        LOG_DEBUG("Failed lock: 0x%lx\n", page->va);
+        return;
+    }
+    // check if unmapped
+    if (page->free) {
+        page_unlock(page);
+        return;
+    }
+    page->hot = false;
+    uint8_t tier = page->tier;
+    if (tmem_cfg.lru_algo == 0) {
+        // move to cold list if:
+        // page is not already in cold list and
+        // page is not in the last tier
+        // if it's still in the hot queue the migrate worker skips it
+        // once it finds it on the cold list
+        if (page->list != &cold_lists[tier] && !is_last_tier(tier)) {
+            assert(page->list == NULL);
+            enqueue_fifo(&cold_lists[tier], page);
+        }
+    } else {
+        // Even if page is already in cold list
+        // move to back of cold list for LRU
+        if (!is_last_tier(tier)) {
+            // assert(page->list != NULL);
+            assert(page->list != &free_list);
+            if (page->list != NULL) {   // page could be dequeued from migrate thread
+                page_list_remove_page(page->list, page);
+            }
+
+            assert(page->list == NULL);
+            enqueue_fifo(&cold_lists[tier], page);
+        }
+    }
+    page_unlock(page);
+}
+static uint64_t samples_since_cool = 0;
+
+// A page madvise freed that's sampled again was faulted back in where its
+// policy binds it, so it counts in its tiers and can be demoted again.
+// If the page is locked (a migration's mbind) a later sample picks it up
+static void page_refault(struct tmem_page *page) {
+    if (!page_trylock(page)) return;
+    if (page->discarded && !page->free) {
+        page->discarded = false;
+        page_charge(page, 1);
+        if (page->list == NULL && !is_last_tier(page->tier)) {
+            enqueue_fifo(&cold_lists[page->tier], page);
+        }
+        STAT_INC(refaults);
+    }
+    page_unlock(page);
+}
+
+// Marks the sub-page of addr sampled, the sub-page map starts over when the page cools
+static inline void subpage_sample(struct tmem_page *page, uint64_t addr, bool cooled) {
+    struct tmem_page_meta *meta = page->meta;
+    struct subpage_map *sub = meta->sub;
+    // created before subpage_algo was turned on
+    if (sub == NULL) return;
+    if (cooled) {
+        memset(sub_sampled(sub), 0, subpage_words() * sizeof(uint64_t));
+        sub->samples = 0;
+    }
+    uint64_t off = addr - (uint64_t)meta->va_start;
+    if (off >= meta->size) return;
+    uint64_t idx = off / subpage_size();
+    sub_sampled(sub)[idx / 64] |= 1ULL << (idx % 64);
+    sub->samples++;
+}
+
+// Everything done with a sample once its page is known
+// Only called by the scan thread that owns the page so page fields aren't shared
+// The policy arguments are constants in every SAMPLE_HANDLER so the branches compile away
+static inline __attribute__((always_inline)) void process_sample_impl(struct tmem_page *page, uint64_t addr, uint64_t ip, uint64_t time, 
+        uint32_t cpu_idx, uint8_t evt, const int hem_algo, const int cluster_algo, const int lru_algo) {
+#if RECORD == 1
+    struct pebs_rec p_rec = {
+        .va = addr & PAGE_MASK,
+        .ip = ip,
+        .cyc = rdtscp(),
+        .cpu = cpu_idx,
+        .evt = evt
+    };
+    trace_rec(TRACE_SAMPLES, &p_rec);
+#endif
+
+    // if (page->migrated) {
+    //     LOG_DEBUG("PEBS: accessed migrated page: 0x%lx\n", page->va);
+    // }
+
+    if (page->discarded) page_refault(page);
+
+    // cool off
+    uint32_t clock = __atomic_load_n(&global_clock, __ATOMIC_RELAXED);
+    page->accesses >>= (clock - page->local_clock);
+    if (tmem_cfg.subpage_algo) subpage_sample(page, addr, clock != page->local_clock);
+    page->local_clock = clock;
+
+    if (evt == DRAMREAD) STAT_INC(dram_accesses);
+    else STAT_INC(rem_accesses);
+    page->accesses++;
+    if (lru_algo == LRU_CLOCK) {
+        atomic_store_explicit(&page->referenced, true, memory_order_relaxed);
+    }
+
+    if (time > page->cyc_accessed) {
+        page->cyc_accessed = time;
+        page->ip = ip;
+    }
+
+    // LRU cold list
+    // if sample is cold move to end of cold queue
+    // Everything in DRAM is cold
+
+    if (hem_algo) {
+        uint64_t cur_cyc = rdtscp();
+        if (page->accesses >= tmem_cfg.hot_threshold) {
+            // LOG_DEBUG("PEBS: Made hot: 0x%lx\n", page->va);
+#if RECORD == 1
+            struct pebs_rec p_rec = {
+                .va = page->va,
+                .ip = 0,
+                .cyc = rdtscp(),
+                .cpu = 0,
+                .evt = 0
+            };
+            trace_rec(TRACE_PREDS, &p_rec);
+#endif
+            make_hot_request(page);
+        } else {
+            make_cold_request(page);
+        }
+
+        // Sample based cooling
+        // samples_since_cool++;
+        // if (samples_since_cool >= SAMPLE_COOLING_THRESHOLD) {
+        //     global_clock++;
+        //     samples_since_cool = 0;
+        //     // printf("cyc since last cool: %lu\n", cur_cyc - last_cyc_cool);
+        //     last_cyc_cool = rdtscp();
+        // }
+
+        // Time based cooling
+        // shared by all scan threads, only the one that wins the cas ticks the clock
+        uint64_t last_cool = __atomic_load_n(&last_cyc_cool, __ATOMIC_RELAXED);
+        if (cur_cyc - last_cool > CYC_COOL_THRESHOLD
+            && __atomic_compare_exchange_n(&last_cyc_cool, &last_cool, cur_cyc, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(&global_clock, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (cluster_algo) {
+        int pred_algo = tmem_cfg.pred_algo;
+        if (pred_algo == PRED_MARKOV) markov_add_page(page);
+        else if (pred_algo == PRED_STRIDE) stride_add_page(page, ip, time);
+        else algo_add_page(page);
+    
+        if (cold_lists[TOP_TIER].numentries != 0) {
+            struct tmem_page *pred_pages[MAX_NEIGHBORS * MAX_PRED_DEPTH];
+            uint8_t pred_confs[MAX_NEIGHBORS * MAX_PRED_DEPTH];
+            uint32_t idx = 0;
+            if (pred_algo == PRED_MARKOV) {
+                markov_predict_pages(page, pred_pages, pred_confs, &idx, MAX_NEIGHBORS * MAX_PRED_DEPTH);
+            } else if (pred_algo == PRED_STRIDE) {
+                stride_predict_pages(page, ip, pred_pages, pred_confs, &idx, MAX_NEIGHBORS * MAX_PRED_DEPTH);
+            } else {
+                algo_predict_pages(page, pred_pages, &idx);
+                memset(pred_confs, 0, idx);
+            }
+
+            for (uint32_t i = 0; i < idx; i++) {
+                // LOG_DEBUG("PRED: 0x%lx from 0x%lx\n", pred_pages[i]->va, page->va);
+#if RECORD == 1
+                // evt has the confidence in percent, 0 if the predictor has none
+                struct pebs_rec p_rec = {
+                    .va = pred_pages[i]->va,
+                    .ip = 0,
+                    .cyc = rdtscp(),
+                    .cpu = 0,
+                    .evt = pred_confs[i]
+                };
+                trace_rec(TRACE_PREDS, &p_rec);
+#endif
+                make_hot_request(pred_pages[i]);
+            }
+        
+        }
+    
+        if (lru_algo == 1) {
+            // LRU based cold list
+            // everything in DRAM is in cold list
+            // with oldest page at front of queue
+            make_cold_request(page);
+        }
+    }
+}
+
+// One specialization per policy combination, picked once in pebs_init
+#define SAMPLE_HANDLER(hem, cluster, lru)                                                   \
+static void process_sample_##hem##cluster##lru(struct tmem_page *page, uint64_t addr,      \
+        uint64_t ip, uint64_t time, uint32_t cpu_idx, uint8_t evt) {                        \
+    process_sample_impl(page, addr, ip, time, cpu_idx, evt, hem, cluster, lru);             \
+}
+
+SAMPLE_HANDLER(0, 0, 0)
+SAMPLE_HANDLER(0, 0, 1)
+SAMPLE_HANDLER(0, 0, 2)
+SAMPLE_HANDLER(0, 1, 0)
+SAMPLE_HANDLER(0, 1, 1)
+SAMPLE_HANDLER(0, 1, 2)
+SAMPLE_HANDLER(1, 0, 0)
+SAMPLE_HANDLER(1, 0, 1)
+SAMPLE_HANDLER(1, 0, 2)
+SAMPLE_HANDLER(1, 1, 0)
+SAMPLE_HANDLER(1, 1, 1)
+SAMPLE_HANDLER(1, 1, 2)
+
+// [hem_algo][cluster_algo][lru_algo]
+static const sample_handler_t sample_handlers[2][2][NUM_LRU_ALGOS] = {
+    {{process_sample_000, process_sample_001, process_sample_002}, {process_sample_010, process_sample_011, process_sample_012}},
+    {{process_sample_100, process_sample_101, process_sample_102}, {process_sample_110, process_sample_111, process_sample_112}},
+};
+sample_handler_t process_sample = process_sample_000;
+
+static int cmp_page_va(const void *a, const void *b) {
+    const struct tmem_page *pa = *(struct tmem_page * const *)a;
+    const struct tmem_page *pb = *(struct tmem_page * const *)b;
+    if (pa->meta->va_start < pb->meta->va_start) return -1;
+    return pa->meta->va_start > pb->meta->va_start;
+}
+
+#ifdef TMEM_SIM
+#define tmem_bind_range sim_bind_range
+#else
+static bool tmem_bind_range(void *start, uint64_t len, int node) {
+    unsigned long nodemask = 1UL << node;
+    return mbind(start, len, MPOL_BIND, &nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT) == 0;
+}
+#endif
+
+// Update page state after it was moved to tier
+static void tmem_page_migrated(struct tmem_page *page, uint32_t tier) {
+    bool promoted = tier < page->tier;
+    page->tier = tier;
+    // with the clock a promoted page can still be on its old tier's cold list
+    if (page->list != NULL) {
+        page_list_remove_page(page->list, page);
+    }
+    if (promoted) {
+        page->meta->promoted_cyc = rdtscp();
+        if (tmem_cfg.lru_algo != 0) {
+            page->hot = false;
+            enqueue_fifo(&cold_lists[tier], page);
+        } else {
+            page->hot = true;
+            // keeps moving up while it's hot
+            if (tier != TOP_TIER && !hot_queue_push(&hot_queues[tier], page)) {
+                STAT_INC(hot_queue_drops);
+            }
+        }
+#if RECORD == 1
+        struct pebs_rec p_rec = {
+            .va = page->va,
+            .ip = 0,
+            .cyc = rdtscp(),
+            .cpu = 0,
+            .evt = 0
+        };
+        trace_rec(TRACE_MIGS, &p_rec);
+#endif
+    } else {
+#if RECORD == 1
+        struct pebs_rec p_rec = {
+            .va = page->va,
+            .ip = 0,
+            .cyc = rdtscp(),
+            .cpu = 0,
+            .evt = 0
+        };
+        trace_rec(TRACE_COLD, &p_rec);
+#endif
+        page->hot = false;
+        page_sub_clear(page);
+        if (page->meta->promoted_cyc != 0) {
+            double residency = rdtscp() - page->meta->promoted_cyc;
+            mig_residency = DEC_MIG_TIME * residency + (1.0 - DEC_MIG_TIME) * mig_residency;
+            page->meta->promoted_cyc = 0;
+        }
+        // can be demoted again from a middle tier
+        if (!is_last_tier(tier)) {
+            enqueue_fifo(&cold_lists[tier], page);
+        }
+    }
+}
+
+// Promotes only the sub_promoted sub-pages of page to tier, one mbind per run
+// of adjacent sub-pages. Returns the bytes moved
+static uint64_t tmem_migrate_subpages(struct tmem_page *page, uint32_t tier) {
+    struct tmem_page_meta *meta = page->meta;
+    uint64_t *promoted = sub_promoted(meta->sub);
+    uint64_t sub = subpage_size();
+    uint64_t num_subs = (meta->size + sub - 1) / sub;
+    bool ok = true;
+    for (uint64_t i = 0; i < num_subs && ok; i++) {
+        if (!(promoted[i / 64] >> (i % 64) & 1)) continue;
+        uint64_t end = i + 1;
+        while (end < num_subs && (promoted[end / 64] >> (end % 64) & 1)) end++;
+        uint64_t len = (end * sub < meta->size ? end * sub : meta->size) - i * sub;
+        ok = tmem_bind_range(meta->va_start + i * sub, len, tiers[tier].node);
+        STAT_INC(mig_syscalls);
+        i = end;
+    }
+    if (!ok) {
+        perror("mbind");
+        printf("mbind failed %p\n", meta->va_start);
+        STAT_INC(mig_failures);
+        // put back what already moved
+        tmem_bind_range(meta->va_start, meta->size, tiers[page->tier].node);
+        meta->sub->bytes = 0;
+        return 0;
+    }
+    uint64_t bytes = meta->sub->bytes;
+    tmem_page_migrated(page, tier);
+    page->migrated = true;
+    STAT_INC(subpage_promotions);
+    __atomic_fetch_add(&pebs_stats.subpage_bytes, bytes, __ATOMIC_RELAXED);
+    return bytes;
+}
+
+static inline bool subpage_promotion(struct tmem_page *page, uint32_t tier) {
+    return page_sub_bytes(page) != 0 && tier < page->tier;
+}
+
+// Migrates a batch of locked pages to tier
+// Pages are sorted by address and contiguous pages are coalesced into a
+// single mbind so the kernel handles the whole range (and TLB shootdown) at once.
+// If a range fails, falls back to per page mbind to find which pages moved.
+// Pages promoted by their sub-pages are bound on their own.
+// Sets page->migrated for each page that moved and returns the bytes moved
+uint64_t tmem_migrate_pages(struct tmem_page **pages, uint32_t num_pages, uint32_t tier) {
+    uint64_t bytes_moved = 0;
+    int node = tiers[tier].node;
+    if (num_pages == 0) return 0;
+
+    qsort(pages, num_pages, sizeof(struct tmem_page *), cmp_page_va);
+
+    uint32_t start = 0;
+    while (start < num_pages) {
+        if (subpage_promotion(pages[start], tier)) {
+            bytes_moved += tmem_migrate_subpages(pages[start], tier);
+            start++;
+            continue;
+        }
+        uint32_t end = start + 1;
+        uint64_t len = pages[start]->meta->size;
+        while (end < num_pages && pages[start]->meta->va_start + len == pages[end]->meta->va_start
+                && !subpage_promotion(pages[end], tier)) {
+            len += pages[end]->meta->size;
+            end++;
+        }
+
+        bool range_ok = tmem_bind_range(pages[start]->meta->va_start, len, node);
+        STAT_INC(mig_syscalls);
+        for (uint32_t i = start; i < end; i++) {
+            struct tmem_page *page = pages[i];
+            bool ok = range_ok;
+            if (!range_ok) {
+                ok = tmem_bind_range(page->meta->va_start, page->meta->size, node);
+                STAT_INC(mig_syscalls);
+            }
+            if (!ok) {
+                perror("mbind");
+                printf("mbind failed %p\n", page->meta->va_start);
+                STAT_INC(mig_failures);
+                continue;
+            }
+            // a partly promoted page only takes its promoted sub-pages back down
+            bytes_moved += page_bytes(page);
+            tmem_page_migrated(page, tier);
+            page->migrated = true;
+        }
+        start = end;
+    }
+    return bytes_moved;
+}
+
+// Per migrate worker
+static _Thread_local struct tmem_page *mig_hot_pages[MIG_BATCH_SIZE];
+static _Thread_local struct tmem_page *mig_cold_pages[MIG_COLD_BATCH_SIZE];
+
+enum {
+    MIG_PROMOTE,
+    MIG_DEMOTE,
+    NUM_MIG_DIRS
+};
+
+// Token bucket limiting the bytes migrated per second in one direction,
+// shared by all migrate workers. A batch goes through as long as there are
+// tokens left and is charged afterwards, so tokens go negative after a batch
+// larger than what was left and the next batch waits for them to be paid back
+struct mig_bucket {
+    pthread_mutex_t lock;
+    double tokens;      // bytes
+    uint64_t last_cyc;  // last refill, 0 starts with a full bucket
+};
+
+static struct mig_bucket mig_buckets[NUM_MIG_DIRS] = {
+    {PTHREAD_MUTEX_INITIALIZER, 0, 0},
+    {PTHREAD_MUTEX_INITIALIZER, 0, 0},
+};
+
+static uint64_t mig_rate(int dir) {
+    return dir == MIG_PROMOTE ? tmem_cfg.mig_promote_rate : tmem_cfg.mig_demote_rate;
+}
+
+// Adds the tokens earned since the last refill, the rate can change at runtime
+static void mig_bucket_refill(struct mig_bucket *bucket, uint64_t rate) {
+    uint64_t now = rdtscp();
+    double max = rate * MIG_RATE_BURST_MS / 1000.0;
+    bucket->tokens += (now - bucket->last_cyc) / tsc_hz * rate;
+    if (bucket->tokens > max) bucket->tokens = max;
+    bucket->last_cyc = now;
+}
+
+// Returns false (and counts a throttle) if direction dir has no tokens left
+static bool mig_bucket_open(int dir) {
+    uint64_t rate = mig_rate(dir);
+    if (rate == 0) return true;
+    struct mig_bucket *bucket = &mig_buckets[dir];
+    pthread_mutex_lock(&bucket->lock);
+    mig_bucket_refill(bucket, rate);
+    bool open = bucket->tokens > 0;
+    pthread_mutex_unlock(&bucket->lock);
+    if (!open) {
+        if (dir == MIG_PROMOTE) STAT_INC(promote_throttles);
+        else STAT_INC(demote_throttles);
+    }
+    return open;
+}
+
+static void mig_bucket_charge(int dir, uint64_t bytes) {
+    uint64_t rate = mig_rate(dir);
+    if (rate == 0 || bytes == 0) return;
+    struct mig_bucket *bucket = &mig_buckets[dir];
+    pthread_mutex_lock(&bucket->lock);
+    mig_bucket_refill(bucket, rate);
+    bucket->tokens -= bytes;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+uint64_t mig_throttle_ns() {
+    uint64_t rate = mig_rate(MIG_PROMOTE);
+    if (rate == 0) return 0;
+    struct mig_bucket *bucket = &mig_buckets[MIG_PROMOTE];
+    pthread_mutex_lock(&bucket->lock);
+    mig_bucket_refill(bucket, rate);
+    double debt = bucket->tokens;
+    pthread_mutex_unlock(&bucket->lock);
+    return debt > 0 ? 0 : (uint64_t)(-debt * 1e9 / rate) + 1;
+}
+
+// Reserves room for a new mmap of length bytes, filling the fastest tiers first
+// tier_len gets the bytes of each tier, in order from the start of the mmap
+// A tier takes all of the rest if it fits, otherwise as many whole pages as
+// fit. Tiers above first get nothing. Room reserved by migrate workers counts as used
+void tier_reserve(uint64_t length, uint32_t first, uint64_t *tier_len) {
+    uint64_t rest = length;
+    pthread_mutex_lock(&mmap_lock);
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        struct tmem_tier *tier = &tiers[t];
+        long used = __atomic_load_n(&tier->used, __ATOMIC_ACQUIRE);
+        if (t < first) {
+            tier_len[t] = 0;
+        } else if (is_last_tier(t) || used + rest <= tier->size) {
+            tier_len[t] = rest;
+        } else if (used + tmem_cfg.page_size > tier->size) {
+            tier_len[t] = 0;
+        } else {
+            tier_len[t] = PAGE_ROUND_DOWN(tier->size - used);
+        }
+        tier_used_add(t, tier_len[t]);
+        rest -= tier_len[t];
+    }
+    pthread_mutex_unlock(&mmap_lock);
+}
+
+// Reserves up to want bytes of the free room in tier t for a migration by
+// adding them to its used bytes, and to reserved until tier_give_room.
+// reserved goes first so tier_used_refresh never drops a reservation that's
+// already in used. Returns the bytes reserved
+static uint64_t tier_take_room(uint32_t t, uint64_t want) {
+    long used = __atomic_load_n(&tiers[t].used, __ATOMIC_ACQUIRE);
+    long take;
+    while (true) {
+        long avail = tiers[t].size - used;
+        take = avail <= 0 ? 0 : ((uint64_t)avail < want ? avail : (long)want);
+        if (take == 0) break;
+        tier_reserved_add(t, take);
+        if (__atomic_compare_exchange_n(&tiers[t].used, &used, used + take, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+        tier_reserved_add(t, -take);
+    }
+    if (take > 0) __atomic_fetch_add(&tier_own[t], take, __ATOMIC_RELAXED);
+    return take;
+}
+
+// Ends a reservation of held bytes in tier t, of which kept became pages
+// that are now there. used is lowered before reserved: a refresh in between
+// counts the kept bytes twice until the next one, never the room as free
+static void tier_give_room(uint32_t t, uint64_t held, uint64_t kept) {
+    tier_used_add(t, -(long)(held - kept));
+    tier_reserved_add(t, -(long)held);
+}
+
+// Dequeues and locks cold pages of tier upper into mig_cold_pages until they
+// add up to want bytes or the batch is full. Returns the bytes taken
+static uint64_t take_cold_pages(uint32_t upper, uint64_t want, uint32_t *num_cold) {
+    struct tmem_page *cold_page;
+    uint64_t cold_bytes = 0;
+    // after one full turn every reference bit is clear, a page sampled again since
+    // can't get a second chance forever
+    uint64_t second_chances = 2 * __atomic_load_n(&cold_lists[upper].numentries, __ATOMIC_ACQUIRE);
+    while (cold_bytes < want && *num_cold < MIG_COLD_BATCH_SIZE) {
+        // pages that were never sampled have no metadata yet with lazy_meta,
+        // they're colder than anything on the cold list
+        if (tmem_cfg.lazy_meta && (cold_page = region_cold_page(upper)) != NULL) {
+            mig_cold_pages[(*num_cold)++] = cold_page;
+            cold_bytes += page_bytes(cold_page);
+            continue;
+        }
+        cold_page = dequeue_fifo(&cold_lists[upper]);
+        if (cold_page == NULL) {
+            LOG_DEBUG("MIG: no cold pages\n");
+            break;
+        }
+        page_lock(cold_page);
+        if (cold_page->list != NULL
+            || (tmem_cfg.lru_algo == 0 && (cold_page->tier != upper || cold_page->hot))) {
+            // page got yoinked
+            page_unlock(cold_page);
+            continue;
+        }
+        if (tmem_cfg.lru_algo == LRU_CLOCK && cold_page->referenced && second_chances > 0) {
+            // sampled since the clock last passed, clear and go around again
+            second_chances--;
+            cold_page->referenced = false;
+            enqueue_fifo(&cold_lists[upper], cold_page);
+            page_unlock(cold_page);
+            STAT_INC(clock_skips);
+            continue;
+        }
+        assert(cold_page->tier == upper);
+        assert(cold_page->list == NULL);
+        mig_cold_pages[(*num_cold)++] = cold_page;
+        cold_bytes += page_bytes(cold_page);
+    }
+    return cold_bytes;
+}
+
+// Demotes the locked pages in mig_cold_pages one tier down from upper and
+// unlocks them. Returns the bytes moved
+// Background demotions free the room in upper, otherwise it stays
+// reserved for the promotions the caller makes room for
+static uint64_t demote_cold_pages(uint32_t upper, uint32_t num_cold, bool background) {
+    struct tmem_page *cold_page;
+    uint32_t lower = upper + 1;
+    uint64_t demoted_bytes = tmem_migrate_pages(mig_cold_pages, num_cold, lower);
+    for (uint32_t i = 0; i < num_cold; i++) {
+        cold_page = mig_cold_pages[i];
+        if (cold_page->tier == lower) {
+            LOG_DEBUG("MIG: demoted 0x%lx\n", cold_page->va);
+            STAT_INC(demotions);
+            if (background) STAT_INC(wm_demotions);
+        } else {
+            // Failed to move, still in the upper tier so it can be picked again
+            enqueue_fifo(&cold_lists[upper], cold_page);
+        }
+        page_unlock(cold_page);
+    }
+    mig_bucket_charge(MIG_DEMOTE, demoted_bytes);
+    if (background) tier_used_add(upper, -(long)demoted_bytes);
+    tier_used_add(lower, demoted_bytes);
+    return demoted_bytes;
+}
+
+// Background demotion out of tier upper: starts once less than demote_wm_low
+// is free and keeps going, one batch per round, until demote_wm_high is free
+// so promotions find room without a demotion in front of them.
+// Returns the number of pages taken
+static uint32_t demote_to_watermark(uint32_t upper) {
+    static bool demoting[MAX_TIERS];
+    if (tmem_cfg.demote_wm_low == 0) return 0;
+
+    long avail = tiers[upper].size - __atomic_load_n(&tiers[upper].used, __ATOMIC_ACQUIRE);
+    if (avail < tmem_cfg.demote_wm_low) demoting[upper] = true;
+    if (avail >= tmem_cfg.demote_wm_high) demoting[upper] = false;
+    if (!demoting[upper] || !mig_bucket_open(MIG_DEMOTE)) return 0;
+
+    uint32_t num_cold = 0;
+    take_cold_pages(upper, tmem_cfg.demote_wm_high - avail, &num_cold);
+    if (num_cold == 0) return 0;
+
+    demote_cold_pages(upper, num_cold, true);
+    return num_cold;
+}
+
+// Bytes other processes need out of each tier, asked for by tmemd
+static long demote_wanted[MAX_TIERS];
+
+// Replaces what's left of an earlier request, tmemd repeats its decision
+// every interval the tier stays full
+void request_demotion(uint32_t upper, uint64_t bytes) {
+    __atomic_store_n(&demote_wanted[upper], bytes, __ATOMIC_RELEASE);
+}
+
+// Demotes one batch of cold pages out of tier upper while request_demotion
+// asked for more than was demoted since. The request is dropped once there's
+// nothing left to demote. Returns the number of pages taken
+static uint32_t demote_on_request(uint32_t upper) {
+    long want = __atomic_load_n(&demote_wanted[upper], __ATOMIC_ACQUIRE);
+    if (want <= 0 || !mig_bucket_open(MIG_DEMOTE)) return 0;
+
+    uint32_t num_cold = 0;
+    take_cold_pages(upper, want, &num_cold);
+    uint64_t demoted_bytes = num_cold ? demote_cold_pages(upper, num_cold, true) : 0;
+    if (demoted_bytes == 0 || __atomic_sub_fetch(&demote_wanted[upper], demoted_bytes, __ATOMIC_ACQ_REL) < 0) {
+        __atomic_store_n(&demote_wanted[upper], 0, __ATOMIC_RELEASE);
+    }
+    return num_cold;
+}
+
+// Decides how a hot page moves up: a sparse page, whose samples keep hitting
+// the same few sub-pages, gets only its sampled sub-pages selected
+// (the promoted map and bytes of its subpage_map), a dense page or one
+// without enough samples moves whole (bytes stays 0)
+static void subpage_select(struct tmem_page *page) {
+    struct tmem_page_meta *meta = page->meta;
+    struct subpage_map *map = meta->sub;
+    if (map == NULL) return;
+    map->bytes = 0;
+    if (map->samples < SUBPAGE_MIN_SAMPLES) return;
+
+    uint64_t sub = subpage_size();
+    uint64_t distinct = 0, bytes = 0;
+    for (uint32_t w = 0; w < subpage_words(); w++) {
+        uint64_t bits = sub_sampled(map)[w];
+        sub_promoted(map)[w] = bits;
+        while (bits != 0) {
+            uint64_t idx = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            distinct++;
+            bytes += (idx + 1) * sub <= meta->size ? sub : meta->size - idx * sub;
+        }
+    }
+    if (distinct * 100 >= (uint64_t)map->samples * tmem_cfg.subpage_dense || bytes >= meta->size) return;
+    map->bytes = bytes;
+}
+
+// Samples per cycle a page gets, from its access count aged to the current
+// clock without writing it back (only the scan thread owns the page fields).
+// The count is halved every cooling period so it holds about two periods of samples
+double page_access_rate(struct tmem_page *page) {
+    uint32_t age = __atomic_load_n(&global_clock, __ATOMIC_RELAXED) - page->local_clock;
+    uint64_t accesses = age >= 64 ? 0 : page->accesses >> age;
+    return accesses / (2.0 * CYC_COOL_THRESHOLD);
+}
+
+static uint64_t swap_window_start = 0;
+static uint64_t swap_window_cycles = 0;
+
+// Charges cost cycles to the swap budget of the current cooling period,
+// false if they don't fit in admit_budget percent of it
+static bool swap_budget_take(uint64_t cost) {
+    if (tmem_cfg.admit_budget >= 100) return true;
+    uint64_t now = rdtscp();
+    uint64_t start = __atomic_load_n(&swap_window_start, __ATOMIC_RELAXED);
+    if (now - start > CYC_COOL_THRESHOLD
+        && __atomic_compare_exchange_n(&swap_window_start, &start, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&swap_window_cycles, 0, __ATOMIC_RELAXED);
+    }
+    uint64_t budget = CYC_COOL_THRESHOLD / 100 * tmem_cfg.admit_budget;
+    if (__atomic_add_fetch(&swap_window_cycles, cost, __ATOMIC_RELAXED) > budget) {
+        __atomic_fetch_sub(&swap_window_cycles, cost, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+// Admission control (admit_algo) for the hot pages in mig_hot_pages that only
+// fit by demoting one of the mig_cold_pages victims. A swap is made if the
+// cycles saved while the page stays promoted (access rate over the hottest
+// victim * sample_period * admit_lat_delta * mig_residency) are more than
+// moving both pages costs. Pages that fit in the reserved room are always kept.
+// Refused pages are unlocked and stay hot, so their next sample requests them
+// again. Returns the hot bytes kept
+static uint64_t admit_hot_pages(uint32_t *num_hot, uint64_t reserved, uint32_t num_cold) {
+    double victim_rate = 0;
+    for (uint32_t i = 0; i < num_cold; i++) {
+        double rate = page_access_rate(mig_cold_pages[i]);
+        if (rate > victim_rate) victim_rate = rate;
+    }
+
+    uint64_t hot_bytes = 0;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < *num_hot; i++) {
+        struct tmem_page *hot_page = mig_hot_pages[i];
+        uint64_t size = page_bytes(hot_page);
+        if (hot_bytes + size > reserved) {
+            double benefit = (page_access_rate(hot_page) - victim_rate)
+                    * tmem_cfg.sample_period * tmem_cfg.admit_lat_delta * mig_residency;
+            double cost = 2.0 * mig_page_time * size / tmem_cfg.page_size;
+            if (benefit <= 0) {
+                STAT_INC(admit_rejects);
+                page_sub_clear(hot_page);
+                page_unlock(hot_page);
+                continue;
+            }
+            if (benefit < cost || !swap_budget_take(cost)) {
+                STAT_INC(admit_defers);
+                page_sub_clear(hot_page);
+                page_unlock(hot_page);
+                continue;
+            }
+        }
+        mig_hot_pages[kept++] = hot_page;
+        hot_bytes += size;
+    }
+    *num_hot = kept;
+    return hot_bytes;
+}
+
+// Unlocks the last hot pages of the batch until the rest fit in room bytes
+static void drop_hot_pages(uint32_t *num_hot, uint64_t *hot_bytes, uint64_t room) {
+    while (*num_hot > 0 && room < *hot_bytes) {
+        struct tmem_page *hot_page = mig_hot_pages[--(*num_hot)];
+        *hot_bytes -= page_bytes(hot_page);
+        page_sub_clear(hot_page);
+        LOG_DEBUG("MIG: not enough space, dropping 0x%lx\n", hot_page->va);
+        page_unlock(hot_page);
+    }
+}
+
+// Puts the last cold pages taken back on the cold list of upper as long as
+// the rest still add up to need bytes (UINT64_MAX gives back all of them)
+static void give_back_cold_pages(uint32_t upper, uint32_t *num_cold, uint64_t *cold_bytes, uint64_t need) {
+    while (*num_cold > 0 && (need == UINT64_MAX || *cold_bytes - page_bytes(mig_cold_pages[*num_cold - 1]) >= need)) {
+        struct tmem_page *cold_page = mig_cold_pages[--(*num_cold)];
+        *cold_bytes -= page_bytes(cold_page);
+        enqueue_fifo(&cold_lists[upper], cold_page);
+        page_unlock(cold_page);
+    }
+}
+
+// Moves hot pages from tier lower to tier lower - 1:
+// drains up to mig_batch hot pages, demotes enough cold pages to make room
+// and promotes the hot pages. Returns the number of hot pages taken (0 if idle)
+static uint32_t migrate_tier_batch(uint32_t lower) {
+    struct tmem_page *hot_page;
+    uint32_t upper = lower - 1;
+
+    // Don't do any migrations until hot page comes in
+    // then drain up to mig_batch hot pages into one batch
+    uint32_t num_hot = 0, num_cold = 0;
+    uint64_t hot_bytes = 0, cold_bytes = 0;
+    uint64_t mig_queue_cyc = rdtscp();
+    // hot pages wait in their queue while promotions are over their rate
+    if (!mig_bucket_open(MIG_PROMOTE)) return 0;
+
+    while (num_hot < tmem_cfg.mig_batch) {
+        hot_page = hot_queue_pop(&hot_queues[lower]);
+        if (hot_page == NULL) break;
+        page_lock(hot_page);
+
+        // pages that went cold since they were queued are on a cold list,
+        // with the clock they always are and only the hot flag tells. Freed
+        // ones are on no list once tmem_page_create takes them off free_list
+        bool cancelled = hot_page->free || ((tmem_cfg.lru_algo == LRU_CLOCK) ? !hot_page->hot : hot_page->list != NULL);
+        if (cancelled || hot_page->discarded || hot_page->tier != lower) {
+            page_unlock(hot_page);
+            continue;
+        }
+        LOG_DEBUG("MIG: got hot page: 0x%lx\n", hot_page->va);
+
+        uint64_t mig_queue_diff = mig_queue_cyc - hot_page->meta->mig_start;
+        mig_queue_time = DEC_MIG_TIME * mig_queue_diff + (1.0 - DEC_MIG_TIME) * mig_queue_time;
+
+        if (tmem_cfg.subpage_algo && upper == TOP_TIER) subpage_select(hot_page);
+        mig_hot_pages[num_hot++] = hot_page;
+        hot_bytes += page_bytes(hot_page);
+    }
+    if (num_hot == 0) return 0;
+
+    // have valid hot pages. Reserve the free room in the upper tier for them
+    // so neither mmaps nor other workers can take it
+    uint64_t reserved = tier_take_room(upper, hot_bytes);
+
+    // Not enough space in the upper tier, collect cold pages until enough space
+    // If demotions are over their rate only what fits in the free room moves
+    if (reserved < hot_bytes) {
+        if (mig_bucket_open(MIG_DEMOTE)) cold_bytes = take_cold_pages(upper, hot_bytes - reserved, &num_cold);
+        if (tmem_cfg.demote_wm_low != 0) STAT_INC(wm_misses);
+        if (tmem_cfg.admit_algo) hot_bytes = admit_hot_pages(&num_hot, reserved, num_cold);
+    }
+
+    // Not enough cold pages for the whole batch, drop the hot pages
+    // that don't fit. They will be requested again if still hot
+    drop_hot_pages(&num_hot, &hot_bytes, reserved + cold_bytes);
+    // Give back cold pages that aren't needed anymore
+    give_back_cold_pages(upper, &num_cold, &cold_bytes, hot_bytes > reserved ? hot_bytes - reserved : 0);
+
+    // The victims can add more to the lower tier than the hot pages free there
+    // (a whole page for a few sub-pages). Unless it's the last tier that
+    // needs room, without it only the free room in the upper tier is used
+    uint64_t lower_room = 0;
+    if (!is_last_tier(lower) && cold_bytes > hot_bytes) {
+        lower_room = tier_take_room(lower, cold_bytes - hot_bytes);
+        if (lower_room < cold_bytes - hot_bytes) {
+            tier_give_room(lower, lower_room, 0);
+            lower_room = 0;
+            give_back_cold_pages(upper, &num_cold, &cold_bytes, UINT64_MAX);
+            drop_hot_pages(&num_hot, &hot_bytes, reserved);
+        }
+    }
+
+    uint64_t move_start = rdtscp();
+    // the room the victims leave in the upper tier stays held for the promotions
+    tier_reserved_add(upper, cold_bytes);
+    uint64_t demoted_bytes = demote_cold_pages(upper, num_cold, false);
+    tier_reserved_add(upper, -(long)(cold_bytes - demoted_bytes));
+    reserved += demoted_bytes;
+
+    // now enough space in the upper tier
+    uint64_t promoted_bytes = 0;
+    if (reserved >= hot_bytes) {
+        promoted_bytes = tmem_migrate_pages(mig_hot_pages, num_hot, upper);
+    }
+    mig_bucket_charge(MIG_PROMOTE, promoted_bytes);
+    if (demoted_bytes + promoted_bytes != 0) {
+        double page_time = (double)(rdtscp() - move_start) * tmem_cfg.page_size / (demoted_bytes + promoted_bytes);
+        mig_page_time = (mig_page_time == 0) ? page_time : DEC_MIG_TIME * page_time + (1.0 - DEC_MIG_TIME) * mig_page_time;
+    }
+    for (uint32_t i = 0; i < num_hot; i++) {
+        hot_page = mig_hot_pages[i];
+        if (hot_page->tier == upper) {
+            LOG_DEBUG("MIG: Finished migration: 0x%lx\n", hot_page->va);
+            STAT_INC(promotions);
+        } else {
+            page_sub_clear(hot_page);
+        }
+        page_unlock(hot_page);
+    }
+
+    // give back the reserved room that wasn't used
+    tier_give_room(upper, reserved, promoted_bytes);
+    tier_used_add(lower, -(long)promoted_bytes);
+    tier_give_room(lower, lower_room, 0);
+    STAT_INC(mig_batches);
+
+    uint64_t mig_move_diff = rdtscp() - mig_queue_cyc;
+    mig_move_time = DEC_MIG_TIME * mig_move_diff + (1.0 - DEC_MIG_TIME) * mig_move_time;
+
+    return num_hot;
+}
+
+static uint32_t site_clock = 0;
+
+// One round of a migrate worker, one batch between each pair of adjacent
+// tiers starting at the top. Worker 0 also does the background and requested
+// demotions out of the upper tier first. Returns the number of pages taken (0 if idle)
+uint32_t migrate_batch(uint32_t worker) {
+    uint32_t num_pages = 0;
+    if (worker == 0 && tmem_cfg.site_algo) {
+        // once per cooling period, so every page's access rate has moved on
+        uint32_t clock = __atomic_load_n(&global_clock, __ATOMIC_RELAXED);
+        if (clock != site_clock) {
+            site_clock = clock;
+            site_update();
+        }
+    }
+    for (uint32_t t = TOP_TIER + 1; t < tmem_cfg.num_tiers; t++) {
+        if (worker == 0) num_pages += demote_to_watermark(t - 1) + demote_on_request(t - 1);
+        num_pages += migrate_tier_batch(t);
+    }
+    return num_pages;
+}
+
+void policy_init() {
+    for (uint32_t t = TOP_TIER + 1; t < tmem_cfg.num_tiers; t++) {
+        hot_queue_init(&hot_queues[t], HOT_QUEUE_SIZE);
+    }
+    if (tmem_cfg.cluster_algo && tmem_cfg.pred_algo == PRED_MARKOV) {
+        markov_init();
+    }
+    last_cyc_cool = rdtscp();
+    process_sample = sample_handlers[tmem_cfg.hem_algo][tmem_cfg.cluster_algo][tmem_cfg.lru_algo];
+}
@@ -0,0 +1,40 @@
+#ifndef _POLICY_HEADER
+#define _POLICY_HEADER
+
+/*
+    Placement policy
+
+    What happens to a page once a sample for it was found (hot/cold requests,
+    cooling, predictions), where new mmaps are placed and how the migrate
+    thread moves pages between adjacent memory tiers. Kept apart from the perf/thread plumbing in
+    pebs.c so the same code can be replayed offline by the simulator (sim.c).
+*/
+
+#include "tmem.h"
+
+typedef void (*sample_handler_t)(struct tmem_page *page, uint64_t addr, uint64_t ip, uint64_t time, uint32_t cpu_idx, uint8_t evt);
+
+// Specialized for the configured policy by policy_init
+extern sample_handler_t process_sample;
+
+void policy_init();
+void make_hot_request(struct tmem_page *page);
+void make_cold_request(struct tmem_page *page);
+void tier_reserve(uint64_t length, uint32_t first, uint64_t *tier_len);
+uint64_t tmem_migrate_pages(struct tmem_page **pages, uint32_t num_pages, uint32_t tier);
+uint32_t migrate_batch(uint32_t worker);
+// Has migrate worker 0 demote bytes of cold pages out of tier upper
+void request_demotion(uint32_t upper, uint64_t bytes);
+double page_access_rate(struct tmem_page *page);
+// ns until the promotion rate limit lets the next batch through, 0 if it does now
+uint64_t mig_throttle_ns();
+
+// Measured by the stats thread
+extern double tsc_hz;
+
+#ifdef TMEM_SIM
+// Simulated mbind, moves [start, start + len) to node
+bool sim_bind_range(void *start, uint64_t len, int node);
+#endif
+
+#endif
@@ -0,0 +1,259 @@
+#include "region.h"
+#include "tmem.h"
+
+#ifndef REGION_INIT_CAPACITY
+    #define REGION_INIT_CAPACITY 1024
+#endif
+
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tmem_region *regions = NULL;
+static uint64_t num_regions = 0, region_capacity = 0;
+// Bounds of every region, samples outside skip the lock
+static uint64_t region_lo = UINT64_MAX, region_hi = 0;
+// Where region_cold_page picks up, and whether its last pass found nothing
+static uint64_t cold_region[MAX_TIERS];
+static bool cold_done[MAX_TIERS];
+
+// Caller must be an internal call so the mmaps aren't tracked
+static void region_grow() {
+    uint64_t capacity = region_capacity ? 2 * region_capacity : REGION_INIT_CAPACITY;
+    struct tmem_region *grown = libc_mmap(NULL, capacity * sizeof(struct tmem_region), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(grown != MAP_FAILED);
+    pebs_stats.internal_mem_overhead += (capacity - region_capacity) * sizeof(struct tmem_region);
+    if (regions != NULL) {
+        memcpy(grown, regions, num_regions * sizeof(struct tmem_region));
+        libc_munmap(regions, region_capacity * sizeof(struct tmem_region));
+    }
+    regions = grown;
+    region_capacity = capacity;
+}
+
+// Index of the first region ending after addr, num_regions if none
+static uint64_t region_search(uint64_t addr) {
+    uint64_t lo = 0, hi = num_regions;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (regions[mid].end <= addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void region_remove_locked(uint64_t start, uint64_t end) {
+    uint64_t i = region_search(start);
+    while (i < num_regions && regions[i].start < end) {
+        struct tmem_region *r = &regions[i];
+        if (r->start < start && r->end > end) {
+            // cut out of the middle, the part after it becomes its own region
+            if (num_regions == region_capacity) {
+                region_grow();
+                r = &regions[i];
+            }
+            memmove(&regions[i + 1], r, (num_regions - i) * sizeof(struct tmem_region));
+            num_regions++;
+            r->end = start;
+            regions[i + 1].start = end;
+            break;
+        }
+        if (r->start < start) {
+            r->end = start;
+            i++;
+        } else if (r->end > end) {
+            r->start = end;
+            break;
+        } else {
+            memmove(r, r + 1, (num_regions - i - 1) * sizeof(struct tmem_region));
+            num_regions--;
+        }
+    }
+}
+
+// Puts r in its place in the sorted array, nothing may overlap it
+static void region_add_locked(struct tmem_region *r) {
+    if (num_regions == region_capacity) region_grow();
+    uint64_t i = region_search(r->start);
+    memmove(&regions[i + 1], &regions[i], (num_regions - i) * sizeof(struct tmem_region));
+    regions[i] = *r;
+    num_regions++;
+    if (r->start < region_lo) __atomic_store_n(&region_lo, r->start, __ATOMIC_RELEASE);
+    if (r->end > region_hi) __atomic_store_n(&region_hi, r->end, __ATOMIC_RELEASE);
+}
+
+void region_insert(uint64_t base, uint64_t len, const uint64_t *tier_len, uint16_t site) {
+    struct tmem_region r;
+    r.base = r.start = base;
+    r.base_end = r.end = base + len;
+    r.site = site;
+    uint64_t tier_start = base;
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        r.cold_next[t] = tier_start;
+        tier_start += tier_len[t];
+        r.tier_end[t] = is_last_tier(t) ? UINT64_MAX : tier_start;
+    }
+
+    pthread_mutex_lock(&region_lock);
+    region_remove_locked(base, base + len);
+    region_add_locked(&r);
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) cold_done[t] = false;
+    // its first samples find pages ready
+    if (tmem_cfg.lazy_meta) tmem_pages_refill();
+    pthread_mutex_unlock(&region_lock);
+}
+
+void region_remove(uint64_t start, uint64_t len) {
+    pthread_mutex_lock(&region_lock);
+    region_remove_locked(start, start + len);
+    pthread_mutex_unlock(&region_lock);
+}
+
+// Shifts every address of r by delta, the chunks move with it
+static void region_shift(struct tmem_region *r, int64_t delta) {
+    r->base += delta;
+    r->base_end += delta;
+    r->start += delta;
+    r->end += delta;
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        if (r->tier_end[t] != UINT64_MAX) r->tier_end[t] += delta;
+        r->cold_next[t] += delta;
+    }
+}
+
+void region_move(uint64_t start, uint64_t len, uint64_t new_start) {
+    int64_t delta = new_start - start;
+    pthread_mutex_lock(&region_lock);
+    region_remove_locked(new_start, new_start + len);
+    while (true) {
+        uint64_t i = region_search(start);
+        if (i == num_regions || regions[i].start >= start + len) break;
+        struct tmem_region r = regions[i];
+        // only the part in the range moves, the rest stays where it is
+        region_remove_locked(r.start > start ? r.start : start, r.end < start + len ? r.end : start + len);
+        if (r.start < start) r.start = start;
+        if (r.end > start + len) r.end = start + len;
+        region_shift(&r, delta);
+        region_add_locked(&r);
+    }
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) cold_done[t] = false;
+    pthread_mutex_unlock(&region_lock);
+}
+
+bool region_tracked(uint64_t addr) {
+    pthread_mutex_lock(&region_lock);
+    uint64_t i = region_search(addr);
+    bool tracked = i < num_regions && regions[i].start <= addr;
+    pthread_mutex_unlock(&region_lock);
+    return tracked;
+}
+
+static uint8_t region_tier(struct tmem_region *r, uint64_t va_start) {
+    uint8_t t = 0;
+    while (va_start >= r->tier_end[t]) t++;
+    return t;
+}
+
+// Chunk of r holding addr, cut from the start of the mmap like tmem_mmap does
+static void region_chunk(struct tmem_region *r, uint64_t addr, struct region_chunk *c) {
+    c->start = r->base + (addr - r->base) / tmem_cfg.page_size * tmem_cfg.page_size;
+    c->size = (c->start + tmem_cfg.page_size < r->base_end ? c->start + tmem_cfg.page_size : r->base_end) - c->start;
+    c->key = chunk_key(c->start, c->size);
+    c->map_lo = c->start < r->start ? r->start : c->start;
+    c->map_hi = c->start + c->size > r->end ? r->end : c->start + c->size;
+    c->lo = c->map_lo;
+    c->hi = c->map_hi;
+    c->tier = region_tier(r, c->start);
+    c->site = r->site;
+}
+
+void region_for_each_chunk(uint64_t start, uint64_t len, bool (*fn)(struct region_chunk *chunk, void *arg), void *arg) {
+    uint64_t end = start + len, va = start;
+    pthread_mutex_lock(&region_lock);
+    uint64_t i = region_search(va);
+    while (i < num_regions && regions[i].start < end) {
+        struct tmem_region *r = &regions[i];
+        if (va < r->start) va = r->start;
+        if (va >= end) break;
+        if (va >= r->end) {
+            i++;
+            continue;
+        }
+        struct region_chunk c;
+        region_chunk(r, va, &c);
+        if (c.lo < va) c.lo = va;
+        if (c.hi > end) c.hi = end;
+        if (!fn(&c, arg)) {
+            // its page is locked by a migrate worker, which may be waiting
+            // for region_lock in region_cold_page. Let it have it and go again
+            pthread_mutex_unlock(&region_lock);
+            sched_yield();
+            pthread_mutex_lock(&region_lock);
+            i = region_search(va);
+            continue;
+        }
+        va = c.map_hi;
+    }
+    pthread_mutex_unlock(&region_lock);
+}
+
+struct tmem_page* region_page(uint64_t addr) {
+    if (addr < __atomic_load_n(&region_lo, __ATOMIC_ACQUIRE) || addr >= __atomic_load_n(&region_hi, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    // the sampling path doesn't wait: the lock is held across whole munmap
+    // chunk walks. The page is created by a later sample
+    if (pthread_mutex_trylock(&region_lock) != 0) {
+        STAT_INC(lazy_misses);
+        return NULL;
+    }
+    struct tmem_page *page = NULL;
+    uint64_t i = region_search(addr);
+    if (i < num_regions && regions[i].start <= addr) {
+        struct region_chunk c;
+        region_chunk(&regions[i], addr, &c);
+        page = find_page_no_lock(c.key);
+        // nor mmap, region_refill keeps pages ready
+        if (page == NULL && (page = tmem_page_create(&c, false, false)) == NULL) STAT_INC(lazy_misses);
+    }
+    pthread_mutex_unlock(&region_lock);
+    return page;
+}
+
+void region_refill() {
+    pthread_mutex_lock(&region_lock);
+    tmem_pages_refill();
+    pthread_mutex_unlock(&region_lock);
+}
+
+struct tmem_page* region_cold_page(uint32_t tier) {
+    pthread_mutex_lock(&region_lock);
+    if (cold_done[tier]) {
+        pthread_mutex_unlock(&region_lock);
+        return NULL;
+    }
+    for (uint64_t n = 0; n < num_regions; n++) {
+        uint64_t i = (cold_region[tier] + n) % num_regions;
+        struct tmem_region *r = &regions[i];
+        uint64_t va = r->cold_next[tier] < r->start ? r->start : r->cold_next[tier];
+        uint64_t end = r->tier_end[tier] < r->end ? r->tier_end[tier] : r->end;
+        while (va < end) {
+            struct region_chunk c;
+            region_chunk(r, va, &c);
+            va = c.map_hi;
+            r->cold_next[tier] = va;
+            if (find_page_no_lock(c.key) != NULL) continue;
+
+            cold_region[tier] = i;
+            struct tmem_page *page = tmem_page_create(&c, true, true);
+            pthread_mutex_unlock(&region_lock);
+            STAT_INC(lazy_victims);
+            return page;
+        }
+    }
+    // every chunk of the tier has metadata, until the next mmap
+    cold_done[tier] = true;
+    pthread_mutex_unlock(&region_lock);
+    return NULL;
+}
+
+uint64_t region_count() {
+    return __atomic_load_n(&num_regions, __ATOMIC_RELAXED);
+}
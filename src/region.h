@@ -0,0 +1,78 @@
+#ifndef _REGION_HEADER
+#define _REGION_HEADER
+
+/*
+    Region descriptors, one per tracked mmap with the split tier_reserve made
+    of it. munmap, mremap and madvise walk the chunks of a range through them,
+    so they find every page a range touches however it lines up with the
+    page_size chunks the mmap was cut into.
+
+    With lazy_meta tmem_mmap only records the region and returns. A tmem_page
+    is created for a page_size chunk of a region the first time it's needed:
+        region_page         a sample hits the chunk
+        region_cold_page    the migrate thread needs a demotion victim, chunks
+                            that were never sampled are the coldest there are
+    so metadata grows with the touched working set instead of the mapped size.
+    Chunks are cut exactly like the eager path cuts them (from the start of the
+    mmap, keyed the same way in the page index).
+
+    Regions are kept in an array sorted by address under region_lock, which
+    only the slow paths take: samples that miss the page index (with a
+    trylock, the sample is dropped if it's busy) and victims that aren't on
+    a cold list.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config.h"
+
+struct tmem_page;
+
+struct tmem_region {
+    uint64_t base, base_end;            // the mmap, chunks are cut from base up to base_end
+    uint64_t start, end;                // what's still mapped
+    uint64_t tier_end[MAX_TIERS];       // the mmap is in tier t up to here
+    uint64_t cold_next[MAX_TIERS];      // next chunk region_cold_page looks at
+    uint16_t site;                      // allocation site of the mmap (site_algo)
+};
+
+// A page_size chunk of a region, as a walk over a range sees it
+struct region_chunk {
+    uint64_t key;                       // page index key of its tmem_page
+    uint64_t start, size;               // the chunk as the mmap cut it
+    uint64_t map_lo, map_hi;            // the part of it still mapped
+    uint64_t lo, hi;                    // the part of that in the range walked
+    uint8_t tier;                       // where the mmap put it
+    uint16_t site;
+};
+
+// Page index key of the chunk [start, start + size), same as tmem_mmap gives it
+static inline uint64_t chunk_key(uint64_t start, uint64_t size) {
+    return size < tmem_cfg.page_size ? start : (start + tmem_cfg.page_size - 1) & ~(tmem_cfg.page_size - 1);
+}
+
+// Records [base, base + len) split into tier_len bytes per tier, mapped from
+// site, replacing what it overlaps
+void region_insert(uint64_t base, uint64_t len, const uint64_t *tier_len, uint16_t site);
+// Forgets [start, start + len), regions it cuts through are trimmed or split
+void region_remove(uint64_t start, uint64_t len);
+// Moves what's recorded of [start, start + len) to new_start (mremap)
+void region_move(uint64_t start, uint64_t len, uint64_t new_start);
+// Calls fn, under the region lock, for every chunk overlapping [start, start + len).
+// fn may only trylock page locks: migrate workers take region_lock with pages
+// locked. If it returns false (and changed nothing) the lock is dropped for a
+// moment and fn is called again for the same chunk
+void region_for_each_chunk(uint64_t start, uint64_t len, bool (*fn)(struct region_chunk *chunk, void *arg), void *arg);
+bool region_tracked(uint64_t addr);
+// Page of the chunk holding addr, created if it has none yet. NULL outside the
+// regions, and when creating it would wait for region_lock or mmap
+struct tmem_page* region_page(uint64_t addr);
+// Carves the pages region_page hands out ahead of time, from the stats thread
+void region_refill();
+// Creates and returns the page, locked, of a chunk in tier that has no
+// metadata yet because it was never sampled. NULL if there's none left
+struct tmem_page* region_cold_page(uint32_t tier);
+uint64_t region_count();
+
+#endif
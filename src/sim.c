@@ -0,0 +1,259 @@
+/*
+    Trace replay simulator (make tmem-sim)
+
+    Replays a tmem_trace.bin recorded with RECORD=1 through the same policy
+    code the library runs (policy.c, algorithm.c) against simulated memory
+    tiers, so policies can be compared offline on any machine. Tiers are
+    sized like the library with dram_size and tier_sizes.
+
+    Time is the trace's cycle counter: rdtscp() returns the cycle of the
+    sample being replayed, and the migrate thread is modeled as busy for
+    the cost of its mbinds before it can take the next batch.
+
+    Policy knobs come from TMEM_<KNOB> / TMEM_CONFIG like the library,
+    page_size must match the run that recorded the trace.
+
+    Usage: tmem-sim [-d dram_size] [-c mbind_cycles] [-p page_move_cycles] [-w window_cycles] tmem_trace.bin
+*/
+
+#include "policy.h"
+
+#include <getopt.h>
+
+#ifndef SIM_MBIND_CYCLES
+    #define SIM_MBIND_CYCLES 10000          // fixed cost of one mbind call
+#endif
+
+#ifndef SIM_PAGE_MOVE_CYCLES
+    #define SIM_PAGE_MOVE_CYCLES 2000       // cost per 4KB moved
+#endif
+
+#ifndef SIM_PRED_WINDOW
+    #define SIM_PRED_WINDOW 20000000        // ~10ms, a prediction is right if sampled within it
+#endif
+
+#define SIM_READ_BATCH 4096
+
+// Normally provided by tmem.c, interpose.c and pebs.c
+struct hot_queue hot_queues[MAX_TIERS];
+struct fifo_list cold_lists[MAX_TIERS];
+struct fifo_list free_list;
+pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tmem_tier sim_tiers[MAX_TIERS];
+static long sim_tier_own[MAX_TIERS];
+static long sim_tier_held[MAX_TIERS];
+struct tmem_tier *tiers = sim_tiers;
+long *tier_own = sim_tier_own;
+long *tier_held = sim_tier_held;
+_Thread_local bool internal_call = false;
+void* (*libc_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset) = mmap;
+struct pebs_stats pebs_stats = {0};
+
+struct sim_page {
+    struct tmem_page page;  // first so a tmem_page * is a sim_page *
+    uint64_t pred_cyc;      // oldest prediction not confirmed by a sample yet
+    uint64_t promo_cyc;     // last promotion not confirmed by a sample yet
+    uint64_t moved_cyc;     // when the last move finishes, still in old_tier before
+    uint8_t old_tier;
+};
+
+struct sim_stats {
+    uint64_t samples;
+    uint64_t pages;
+    uint64_t predictions, pred_hits;
+    uint64_t promotions, promo_hits;
+    uint64_t mig_cycles;
+};
+
+static struct sim_stats sim_stats = {0};
+static uint64_t sim_now = 0;
+static uint64_t mbind_cycles = SIM_MBIND_CYCLES;
+static uint64_t page_move_cycles = SIM_PAGE_MOVE_CYCLES;
+static uint64_t pred_window = SIM_PRED_WINDOW;
+
+uint64_t rdtscp(void) {
+    return sim_now;
+}
+
+bool sim_bind_range(void *start, uint64_t len, int node) {
+    uint64_t cost = mbind_cycles + (len / BASE_PAGE_SIZE) * page_move_cycles;
+    sim_now += cost;
+    sim_stats.mig_cycles += cost;
+    return true;
+}
+
+// Prediction and migration records the policy would have written to disk
+void trace_rec(enum trace_file file, const struct pebs_rec *rec) {
+    struct sim_page *sp = (struct sim_page *)find_page_no_lock(rec->va);
+    if (sp == NULL) return;
+    if (file == TRACE_PREDS && sp->pred_cyc == 0) {
+        sp->pred_cyc = sim_now;
+        sim_stats.predictions++;
+    } else if (file == TRACE_MIGS) {
+        sp->promo_cyc = sim_now;
+        sp->moved_cyc = sim_now;
+        sp->old_tier = sp->page.tier + 1;
+        sim_stats.promotions++;
+    } else if (file == TRACE_COLD) {
+        sp->moved_cyc = sim_now;
+        sp->old_tier = sp->page.tier - 1;
+    }
+}
+
+void trace_log(const char *fmt, ...) {
+}
+
+// Pages are created by their first sample, there's never one without metadata
+struct tmem_page* region_cold_page(uint32_t tier) {
+    return NULL;
+}
+
+// First touch placement like tmem_mmap: fastest tier with room
+static struct tmem_page* sim_add_page(uint64_t va) {
+    struct sim_page *sp = aligned_alloc(_Alignof(struct sim_page), sizeof(struct sim_page));
+    assert(sp != NULL);
+    memset(sp, 0, sizeof(struct sim_page));
+    struct tmem_page *page = &sp->page;
+    page->meta = calloc(1, sizeof(struct tmem_page_meta));
+    assert(page->meta != NULL);
+    if (tmem_cfg.cluster_algo) {
+        page->meta->neighbors = calloc(tmem_cfg.max_neighbors, sizeof(struct neighbor_page));
+    }
+    if (subpage_maps()) page->meta->sub = calloc(1, subpage_map_size());
+    page->va = va;
+    page->meta->va_start = (void *)va;
+    page->meta->size = tmem_cfg.page_size;
+    uint64_t tier_len[MAX_TIERS];
+    tier_reserve(page->meta->size, TOP_TIER, tier_len);
+    while (tier_len[page->tier] == 0) page->tier++;
+    if (!is_last_tier(page->tier)) {
+        enqueue_fifo(&cold_lists[page->tier], page);
+    }
+    pindex_insert(va, page);
+    sim_stats.pages++;
+    return page;
+}
+
+static void sim_sample(const struct pebs_rec *rec) {
+    // the migrate thread runs until it catches up with the sample
+    static uint64_t mig_free_at = 0;
+    while (mig_free_at <= rec->cyc) {
+        sim_now = mig_free_at;
+        if (migrate_batch(0) == 0) {
+            mig_free_at = rec->cyc + 1;
+            break;
+        }
+        mig_free_at = sim_now;
+    }
+    sim_now = rec->cyc;
+
+    struct tmem_page *page = find_page_no_lock(rec->va & PAGE_MASK);
+    if (page == NULL) page = sim_add_page(rec->va & PAGE_MASK);
+    struct sim_page *sp = (struct sim_page *)page;
+
+    if (sp->pred_cyc != 0) {
+        if (sim_now - sp->pred_cyc <= pred_window) sim_stats.pred_hits++;
+        sp->pred_cyc = 0;
+    }
+    if (sp->promo_cyc != 0 && sim_now >= sp->promo_cyc) {
+        if (sim_now - sp->promo_cyc <= pred_window) sim_stats.promo_hits++;
+        sp->promo_cyc = 0;
+    }
+
+    // where the page is in the simulation, not where it was in the recorded run
+    uint8_t tier = (sim_now < sp->moved_cyc) ? sp->old_tier : page_addr_tier(page, rec->va);
+    uint8_t evt = (tier == TOP_TIER) ? DRAMREAD : REMREAD;
+    process_sample(page, rec->va, rec->ip, rec->cyc, rec->cpu, evt);
+    sim_stats.samples++;
+}
+
+static void sim_print(FILE *fp) {
+    uint64_t accesses = pebs_stats.dram_accesses + pebs_stats.rem_accesses;
+    fprintf(fp, "samples: [%lu]\tpages: [%lu]\tdram_size: [%ld]\n", sim_stats.samples, sim_stats.pages, tiers[TOP_TIER].size);
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        fprintf(fp, "tier: [%u]\tnode: [%d]\tused: [%ld]\tsize: [%ld]\n", t, tiers[t].node, tiers[t].used, tiers[t].size);
+    }
+    fprintf(fp, "dram_accesses: [%lu]\trem_accesses: [%lu]\tdram_hit_rate: [%.2f]\n",
+            pebs_stats.dram_accesses, pebs_stats.rem_accesses, accesses ? 100.0 * pebs_stats.dram_accesses / accesses : 0.0);
+    fprintf(fp, "promotions: [%lu]\tdemotions: [%lu]\tmig_batches: [%lu]\tmig_syscalls: [%lu]\tmig_cycles: [%lu]\n",
+            pebs_stats.promotions, pebs_stats.demotions, pebs_stats.mig_batches, pebs_stats.mig_syscalls, sim_stats.mig_cycles);
+    if (tmem_cfg.demote_wm_low != 0) {
+        fprintf(fp, "wm_demotions: [%lu]\twm_misses: [%lu]\n", pebs_stats.wm_demotions, pebs_stats.wm_misses);
+    }
+    if (tmem_cfg.mig_promote_rate != 0 || tmem_cfg.mig_demote_rate != 0) {
+        fprintf(fp, "promote_throttles: [%lu]\tdemote_throttles: [%lu]\n", pebs_stats.promote_throttles, pebs_stats.demote_throttles);
+    }
+    if (tmem_cfg.cluster_algo && tmem_cfg.pred_algo == PRED_MARKOV) {
+        fprintf(fp, "markov_evictions: [%lu]\n", pebs_stats.markov_evictions);
+    }
+    if (tmem_cfg.subpage_algo) {
+        fprintf(fp, "subpage_promotions: [%lu]\tsubpage_bytes: [%lu]\n", pebs_stats.subpage_promotions, pebs_stats.subpage_bytes);
+    }
+    if (tmem_cfg.admit_algo) {
+        fprintf(fp, "admit_rejects: [%lu]\tadmit_defers: [%lu]\tmig_page_time: [%.2f]\tmig_residency: [%.2f]\n",
+                pebs_stats.admit_rejects, pebs_stats.admit_defers, mig_page_time, mig_residency);
+    }
+    fprintf(fp, "predictions: [%lu]\tpred_accuracy: [%.2f]\tpromotion_accuracy: [%.2f]\n", sim_stats.predictions,
+            sim_stats.predictions ? 100.0 * sim_stats.pred_hits / sim_stats.predictions : 0.0,
+            sim_stats.promotions ? 100.0 * sim_stats.promo_hits / sim_stats.promotions : 0.0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d dram_size] [-c mbind_cycles] [-p page_move_cycles] [-w window_cycles] tmem_trace.bin\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:c:p:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                // env can still override it
+                tmem_config_set("dram_size", optarg, "-d");
+                tmem_config_set("dram_buffer", "0", "-d");
+                break;
+            case 'c': mbind_cycles = strtoull(optarg, NULL, 0); break;
+            case 'p': page_move_cycles = strtoull(optarg, NULL, 0); break;
+            case 'w': pred_window = strtoull(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    tmem_config_init();
+    if (tmem_cfg.dram_buffer != 0) {
+        fprintf(stderr, "tmem-sim: needs a fixed DRAM size (-d or TMEM_DRAM_SIZE with TMEM_DRAM_BUFFER=0)\n");
+        exit(1);
+    }
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        tiers[t].node = tmem_cfg.tier_nodes[t];
+        if (t == TOP_TIER) tiers[t].size = tmem_cfg.dram_size;
+        else if (!is_last_tier(t)) tiers[t].size = tmem_cfg.tier_sizes[t - 1];
+    }
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if (fp == NULL) {
+        perror("tmem-sim fopen");
+        exit(1);
+    }
+
+    static struct pebs_rec recs[SIM_READ_BATCH];
+    size_t n = fread(recs, sizeof(struct pebs_rec), SIM_READ_BATCH, fp);
+    if (n > 0) sim_now = recs[0].cyc;
+    algo_set_shard(0);
+    policy_init();
+
+    while (n > 0) {
+        for (size_t i = 0; i < n; i++) {
+            // records from different cpus can be slightly out of order
+            if (recs[i].cyc < sim_now) recs[i].cyc = sim_now;
+            sim_sample(&recs[i]);
+        }
+        n = fread(recs, sizeof(struct pebs_rec), SIM_READ_BATCH, fp);
+    }
+    fclose(fp);
+
+    tmem_config_print(stdout);
+    sim_print(stdout);
+    return 0;
+}
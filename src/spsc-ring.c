@@ -161,3 +161,31 @@ bool ring_buf_full(ring_buf_t* rbuf)
 
 	return head == rbuf->tail;
 }
+
+struct spsc_ring* spsc_ring_init(size_t elem_size, size_t capacity)
+{
+	assert(elem_size && capacity);
+	assert((capacity & (capacity - 1)) == 0);
+
+	// Called from internal threads so the mmaps aren't tracked
+	size_t ring_size = spsc_ring_bytes(elem_size, capacity);
+	void *mem = libc_mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(mem != MAP_FAILED);
+	pebs_stats.internal_mem_overhead += ring_size;
+
+	return spsc_ring_place(mem, elem_size, capacity);
+}
+
+struct spsc_ring* spsc_ring_place(void *mem, size_t elem_size, size_t capacity)
+{
+	assert(elem_size && capacity);
+	assert((capacity & (capacity - 1)) == 0);
+
+	struct spsc_ring *ring = mem;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->capacity = capacity;
+	ring->elem_size = elem_size;
+
+	return ring;
+}
@@ -2,6 +2,9 @@
 #define SPSC_RING_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
 typedef struct ring_buf_t ring_buf_t;
 
@@ -18,4 +21,57 @@ bool ring_buf_full(ring_handle_t rbuf);
 size_t ring_buf_capacity(ring_handle_t rbuf);
 size_t ring_buf_size(ring_handle_t rbuf);
 
+/*
+	Lock-free single producer single consumer ring of fixed size elements
+	Safe to use between two threads (unlike ring_buf_t above)
+	capacity must be a power of 2
+	The elements follow the header and nothing in it is a pointer, so a ring
+	can also live in memory shared between two processes (spsc_ring_place)
+*/
+struct spsc_ring {
+	size_t head __attribute__((aligned(64)));	// only written by producer
+	size_t tail __attribute__((aligned(64)));	// only written by consumer
+	size_t capacity __attribute__((aligned(64)));
+	size_t elem_size;
+	char buffer[] __attribute__((aligned(64)));
+};
+
+struct spsc_ring* spsc_ring_init(size_t elem_size, size_t capacity);
+// Sets up an empty ring in the spsc_ring_bytes at mem
+struct spsc_ring* spsc_ring_place(void *mem, size_t elem_size, size_t capacity);
+
+static inline size_t spsc_ring_bytes(size_t elem_size, size_t capacity)
+{
+	return sizeof(struct spsc_ring) + elem_size * capacity;
+}
+
+static inline bool spsc_ring_push(struct spsc_ring *ring, const void *elem)
+{
+	size_t head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->capacity)
+	{
+		return false;	// full
+	}
+	memcpy(ring->buffer + (head & (ring->capacity - 1)) * ring->elem_size, elem, ring->elem_size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool spsc_ring_pop(struct spsc_ring *ring, void *elem)
+{
+	size_t tail = ring->tail;
+	if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+	{
+		return false;	// empty
+	}
+	memcpy(elem, ring->buffer + (tail & (ring->capacity - 1)) * ring->elem_size, ring->elem_size);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline size_t spsc_ring_size(struct spsc_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
 #endif //SPSC_RING_H
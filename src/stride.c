@@ -0,0 +1,63 @@
+#include "tmem.h"
+#include "stride.h"
+
+static struct stride_entry stride_tables[MAX_SCAN_THREADS][STRIDE_ENTRIES];
+static _Thread_local struct stride_entry *stride_table = stride_tables[0];
+
+static inline struct stride_entry* stride_entry(uint64_t ip) {
+    return &stride_table[(ip * 0x9E3779B97F4A7C15ULL) >> 32 & (STRIDE_ENTRIES - 1)];
+}
+
+void stride_set_shard(uint32_t shard) {
+    stride_table = stride_tables[shard];
+}
+
+void stride_add_page(struct tmem_page *page, uint64_t ip, uint64_t time) {
+    if (ip == 0) return;    // backend without ips
+    struct stride_entry *entry = stride_entry(ip);
+    if (entry->ip != ip) {
+        memset(entry, 0, sizeof(struct stride_entry));
+        entry->ip = ip;
+        entry->last_va = page->va;
+        entry->last_cyc = time;
+        return;
+    }
+    if (page->va == entry->last_va) return;
+
+    int64_t delta = page->va - entry->last_va;
+    if (delta == entry->stride) {
+        if (entry->conf < STRIDE_MAX_CONF) entry->conf++;
+        uint64_t step = time > entry->last_cyc ? time - entry->last_cyc : 0;
+        entry->step_cyc = entry->step_cyc == 0 ? step : (entry->step_cyc + step) / 2;
+    } else {
+        entry->stride = delta;
+        entry->conf = 0;
+        entry->step_cyc = 0;
+        entry->pred_va = page->va;
+    }
+    entry->last_va = page->va;
+    entry->last_cyc = time;
+}
+
+void stride_predict_pages(struct tmem_page *page, uint64_t ip, struct tmem_page **pred_pages, uint8_t *confs, uint32_t *idx, uint32_t max) {
+    if (ip == 0) return;
+    struct stride_entry *entry = stride_entry(ip);
+    if (entry->ip != ip || entry->last_va != page->va || entry->conf < STRIDE_CONFIRM) return;
+
+    // strides until the page is needed, the move has to be done by then
+    double lead = mig_queue_time + mig_move_time;
+    uint64_t dist = entry->step_cyc == 0 ? 1 : (uint64_t)(lead / entry->step_cyc) + 1;
+    if (dist > tmem_cfg.pred_depth) dist = tmem_cfg.pred_depth;
+
+    uint8_t conf = 100 * entry->conf / STRIDE_MAX_CONF;
+    for (uint64_t k = 1; k <= dist && *idx < max; k++) {
+        uint64_t va = page->va + k * entry->stride;
+        // already requested
+        if (entry->stride > 0 ? va <= entry->pred_va : va >= entry->pred_va) continue;
+        entry->pred_va = va;
+        struct tmem_page *pred = find_page_no_lock(va);
+        if (pred == NULL) continue;
+        pred_pages[*idx] = pred;
+        confs[(*idx)++] = conf;
+    }
+}
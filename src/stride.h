@@ -0,0 +1,52 @@
+#ifndef _STRIDE_H
+#define _STRIDE_H
+
+/*
+    IP keyed stride predictor (pred_algo=2, with cluster_algo)
+
+    Like a hardware stride prefetcher: a small direct mapped table per scan
+    thread shard, keyed by the sample's ip, holds the last page that ip
+    touched, the stride between its last two pages and how many times in a
+    row that stride repeated. Once a stride has repeated STRIDE_CONFIRM
+    times, the pages along it are requested far enough ahead to cover
+    mig_queue_time + mig_move_time at the rate the ip walks its pages
+    (at most pred_depth strides). Pages requested before aren't requested again.
+*/
+
+#include <stdint.h>
+
+#include "config.h"
+
+// Entries per table, a power of 2
+#ifndef STRIDE_ENTRIES
+    #define STRIDE_ENTRIES 256
+#endif
+
+// Repeats of a stride before it's used
+#ifndef STRIDE_CONFIRM
+    #define STRIDE_CONFIRM 2
+#endif
+
+// Repeats counted, confidence is repeats / STRIDE_MAX_CONF
+#ifndef STRIDE_MAX_CONF
+    #define STRIDE_MAX_CONF 4
+#endif
+
+struct tmem_page;
+
+struct stride_entry {
+    uint64_t ip;
+    uint64_t last_va;       // page of the last sample from ip
+    int64_t stride;         // bytes between its last two pages
+    uint64_t pred_va;       // furthest page requested along stride
+    uint64_t last_cyc;
+    uint64_t step_cyc;      // average cycles between two pages
+    uint32_t conf;          // times stride repeated, up to STRIDE_MAX_CONF
+};
+
+void stride_set_shard(uint32_t shard);
+void stride_add_page(struct tmem_page *page, uint64_t ip, uint64_t time);
+// Fills pred_pages/confs (percent) with up to max predictions, idx counts them
+void stride_predict_pages(struct tmem_page *page, uint64_t ip, struct tmem_page **pred_pages, uint8_t *confs, uint32_t *idx, uint32_t max);
+
+#endif
@@ -1,291 +1,384 @@
 #include "tmem.h"
+#include "policy.h"
+#include "region.h"
+#include "alloc-site.h"
 
-struct tmem_page *pages = NULL;
-struct fifo_list hot_list;
-struct fifo_list cold_list;
+struct hot_queue hot_queues[MAX_TIERS];
+struct fifo_list cold_lists[MAX_TIERS];
 struct fifo_list free_list;
-pthread_mutex_t pages_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
 
-long dram_free = 0;
-long dram_size = 0;
-long dram_used = 0;
-long rem_used = 0;
+static struct tmem_tier local_tiers[MAX_TIERS];
+static long local_tier_own[MAX_TIERS];
+static long local_tier_held[MAX_TIERS];
+struct tmem_tier *tiers = local_tiers;
+long *tier_own = local_tier_own;
+long *tier_held = local_tier_held;
 
 static uint64_t max_tmem_va = 0;
 static uint64_t min_tmem_va = UINT64_MAX;
 
-_Atomic bool dram_lock = false;
-
 // If the allocations are smaller than the PAGE_SIZE it's possible to 
 void add_page(struct tmem_page *page) {
-    struct tmem_page *p;
-    pthread_mutex_lock(&pages_lock);
-
-    // struct tmem_page *cur_page, *tmp;
-    // LOG_DEBUG("pages: ");
-    // HASH_ITER(hh, pages, cur_page, tmp) {
-    //     LOG_DEBUG("0x%lx, ", cur_page->va);
-    // }
-    // LOG_DEBUG("\n");
-
-    HASH_FIND(hh, pages, &(page->va), sizeof(uint64_t), p);
-    if (p != NULL) {
+    if (!pindex_insert(page->va, page)) {
         LOG_DEBUG("add_page: duplicate page: 0x%lx\n", page->va);
-        // free(page);
-        pthread_mutex_unlock(&pages_lock);
-        return;
     }
-    assert(p == NULL);
-    HASH_ADD(hh, pages, va, sizeof(uint64_t), page);
-    pthread_mutex_unlock(&pages_lock);
 }
 
 void remove_page(struct tmem_page *page)
 {
-  pthread_mutex_lock(&pages_lock);
-  HASH_DEL(pages, page);
-  pthread_mutex_unlock(&pages_lock);
+  pindex_remove(page->va, page);
 }
 
-struct tmem_page* find_page_no_lock(uint64_t va) {
-    struct tmem_page *page;
-    if (pthread_mutex_trylock(&pages_lock) != 0) {
-        return NULL;    // Abort early so no waiting
+struct tmem_page* find_page(uint64_t va)
+{
+  return pindex_lookup(va);
+}
+
+// Sizes every tier, with dram_buffer from what's free on its node
+// Also called every second by the stats thread in case used drifts over time
+void tier_refresh() {
+    // tmemd sizes the shared tiers
+    if (tmem_cfg.sample_backend == BACKEND_DAEMON) return;
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        struct tmem_tier *tier = &tiers[t];
+        tier->node = tmem_cfg.tier_nodes[t];
+        if (tmem_cfg.dram_buffer != 0) {
+            tier->size = numa_node_size(tier->node, &tier->free);
+            tier_used_refresh(tier, tier->size - tier->free);
+            if (!is_last_tier(t)) tier->size -= tmem_cfg.dram_buffer;
+        } else if (t == TOP_TIER) {
+            tier->size = tmem_cfg.dram_size;
+        } else if (!is_last_tier(t)) {
+            tier->size = tmem_cfg.tier_sizes[t - 1];
+        }
     }
-    HASH_FIND(hh, pages, &va, sizeof(uint64_t), page);
-    pthread_mutex_unlock(&pages_lock);
-    return page;
 }
 
-struct tmem_page* find_page(uint64_t va)
-{
-  struct tmem_page *page;
-  pthread_mutex_lock(&pages_lock);
-  HASH_FIND(hh, pages, &va, sizeof(uint64_t), page);
-  pthread_mutex_unlock(&pages_lock);
-  return page;
+// Range of the tracked pages' vas (page->va), lo > hi before the first mmap
+void tmem_va_range(uint64_t *lo, uint64_t *hi) {
+    *lo = __atomic_load_n(&min_tmem_va, __ATOMIC_RELAXED);
+    *hi = __atomic_load_n(&max_tmem_va, __ATOMIC_RELAXED);
 }
 
 void tmem_init() {
     internal_call = true;
-#if (DRAM_BUFFER != 0 && DRAM_SIZE != 0) || (DRAM_BUFFER == 0 && DRAM_SIZE == 0)
-    fprintf(stderr, "Can't have both DRAM_BUFFER and DRAM_SIZE\n");
-    exit(1);
-#endif
-
     // Puts non-tracked mmaps into remote memory so it doesn't exceed
     // the set DRAM capacity
-    numa_set_preferred(DRAM_NODE);
+    numa_set_preferred(tmem_cfg.tier_nodes[TOP_TIER]);
 
     // LOG_DEBUG("DRAM size: %lu, REMOTE size: %lu\n", DRAM_SIZE, REMOTE_SIZE);
 
     LOG_DEBUG("finished tmem_init\n");
 
-    struct tmem_page *dummy_page = calloc(1, sizeof(struct tmem_page));
-    add_page(dummy_page);
-
-    // check how much free space on dram
-#ifdef DRAM_BUFFER
-    dram_size = numa_node_size(DRAM_NODE, &dram_free);
-    dram_size -= dram_free;
-#endif
-#ifdef DRAM_SIZE
-    dram_size = DRAM_SIZE;
-#endif
+    // check how much free space on each tier
+    tier_refresh();
     internal_call = false;
 }
 
-#define PAGE_ROUND_UP(x) (((x) + (PAGE_SIZE)-1) & (~((PAGE_SIZE)-1)))
-#define PAGE_ROUND_DOWN(x) ((x) & (~((PAGE_SIZE)-1)))
+// Tier of the page starting at offset off of an mmap split by tier_reserve
+static uint8_t tier_of_offset(uint64_t off, const uint64_t *tier_len) {
+    uint32_t t = 0;
+    while (!is_last_tier(t) && off >= tier_len[t]) {
+        off -= tier_len[t];
+        t++;
+    }
+    return t;
+}
 
 #define PAGE_ROUND_UP_BASE(x) (((x) + (BASE_PAGE_SIZE)-1) & (~((BASE_PAGE_SIZE)-1)))
 
 
-void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    length = PAGE_ROUND_UP_BASE(length);
-    internal_call = true;
-
-    unsigned long dram_nodemask = 1UL << DRAM_NODE;
-    unsigned long rem_nodemask = 1UL << REM_NODE;
-    void *p_dram = NULL, *p_rem = NULL;
-
-    void *p = libc_mmap(addr, length, prot, flags, fd, offset);
-    assert(p != MAP_FAILED);
-
-    pthread_mutex_lock(&mmap_lock);
+// Sets up a new or recycled page for the chunk of an mmap at va_start,
+// rest is how much of the mmap is left from there
+static void init_page(struct tmem_page *page, void *va_start, uint64_t rest, uint8_t tier, uint16_t site) {
+    page->meta->va_start = va_start;
+    if (rest < tmem_cfg.page_size) {
+        page->va = (uint64_t)va_start;
+        page->meta->size = rest < BASE_PAGE_SIZE ? BASE_PAGE_SIZE : rest;   // Always at least 4KB
+    } else {
+        page->meta->size = tmem_cfg.page_size;
+        // Align va to PAGE_SIZE address for future lookups in the page index
+        page->va = PAGE_ROUND_UP((uint64_t)va_start);
+    }
+    if (page->va > max_tmem_va) max_tmem_va = page->va;
+    if (page->va < min_tmem_va) min_tmem_va = page->va;
+    page->meta->mig_up = 0;
+    page->meta->mig_down = 0;
+    page->meta->promoted_cyc = 0;
+    if (page->meta->sub != NULL) memset(page->meta->sub, 0, subpage_map_size());
+    page->meta->site = site;
+    page->accesses = 0;
+    page->local_clock = 0;
+    page->cyc_accessed = 0;
+    page->ip = 0;
+
+    page->tier = tier;
+    page->hot = false;
+    page->free = false;
+    page->migrating = false;
+    page->migrated = false;
+    page->discarded = false;
+    if (page->meta->neighbors != NULL) {
+        memset(page->meta->neighbors, 0, tmem_cfg.max_neighbors * sizeof(struct neighbor_page));
+    }
+}
 
-    if (__atomic_load_n(&dram_used, __ATOMIC_ACQUIRE) + length <= dram_size 
-        && atomic_load_explicit(&dram_lock, memory_order_acquire) == false) {
-        // can allocate all on dram
-        __atomic_fetch_add(&dram_used, length, __ATOMIC_RELEASE);
-        // dram_used += length;
-        pthread_mutex_unlock(&mmap_lock);
-        LOG_DEBUG("MMAP: All DRAM\n");
+// Hot records, cold metadata, neighbors (only used by the cluster algorithm)
+// and sub-page maps (subpage_algo) go into separate arrays so the sampling
+// path only touches the hot records. mmap memory is zeroed, including the neighbors
+static struct tmem_page* alloc_pages(uint64_t num_pages) {
+    uint64_t neighbors_size = tmem_cfg.cluster_algo ? tmem_cfg.max_neighbors * sizeof(struct neighbor_page) : 0;
+    uint64_t sub_size = subpage_maps() ? subpage_map_size() : 0;
+    uint64_t pages_mmap_size = num_pages * (sizeof(struct tmem_page) + sizeof(struct tmem_page_meta) + neighbors_size + sub_size);
+    void *pages_ptr = libc_mmap(NULL, pages_mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(pages_ptr != MAP_FAILED);
+    pebs_stats.internal_mem_overhead += pages_mmap_size;
+    struct tmem_page *pages = pages_ptr;
+    struct tmem_page_meta *metas = (struct tmem_page_meta *)(pages + num_pages);
+    struct neighbor_page *neighbors = (struct neighbor_page *)(metas + num_pages);
+    char *subs = (char *)neighbors + num_pages * neighbors_size;
+    for (uint64_t j = 0; j < num_pages; j++) {
+        pages[j].meta = &metas[j];
+        pages[j].meta->neighbors = neighbors_size ? &neighbors[j * tmem_cfg.max_neighbors] : NULL;
+        pages[j].meta->sub = sub_size ? (struct subpage_map *)(subs + j * sub_size) : NULL;
+    }
+    return pages;
+}
 
+// Pages handed out one at a time with lazy_meta
+static struct tmem_page *lazy_pages = NULL;
+static uint64_t lazy_pages_left = 0;
+
+// Starts a new batch of lazy pages once less than half of the current one is
+// left, what's left of it goes to free_list. Caller holds region_lock and
+// must be an internal call
+void tmem_pages_refill() {
+    if (lazy_pages_left >= LAZY_PAGES_BATCH / 2) return;
+    for (; lazy_pages_left > 0; lazy_pages_left--) {
+        struct tmem_page *page = lazy_pages++;
+        page->free = true;
+        enqueue_fifo(&free_list, page);
+    }
+    lazy_pages = alloc_pages(LAZY_PAGES_BATCH);
+    lazy_pages_left = LAZY_PAGES_BATCH;
+}
 
-        if (mbind(p, length, MPOL_BIND, &dram_nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT)) {
-            perror("mbind");
-            assert(0);
-        }
-        
-        p_dram = p;
-        p_rem = p_dram + length + 1;    // Used later to check which node page is in
-    } else if (dram_used + PAGE_SIZE > dram_size || atomic_load_explicit(&dram_lock, memory_order_acquire)) {
-        pthread_mutex_unlock(&mmap_lock);
-        LOG_DEBUG("MMAP: All Remote\n");
-        // dram full, all on remote
-        if (mbind(p, length, MPOL_BIND, &rem_nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT)) {
-            perror("mbind");
-            assert(0);
-        }
-        p_rem = p;
-    } else {
-        // split between dram and remote
-        uint64_t dram_mmap_size = PAGE_ROUND_DOWN(dram_size - dram_used);
-        // dram_used += dram_mmap_size;
-        __atomic_fetch_add(&dram_used, dram_mmap_size, __ATOMIC_RELEASE);
-        pthread_mutex_unlock(&mmap_lock);
-        
-        uint64_t rem_mmap_size = length - dram_mmap_size;
-
-
-        LOG_DEBUG("MMAP: dram: %lu, remote: %lu\n", dram_mmap_size, rem_mmap_size);
-        p_dram = p;
-        p_rem = p_dram + dram_mmap_size;
-        if (mbind(p_dram, dram_mmap_size, MPOL_BIND, &dram_nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT) == -1) {
-            perror("mbind");
-            assert(0);
+// Page of the mapped part of a chunk of a region (lazy_meta), recycled from
+// free_list or carved out of LAZY_PAGES_BATCH pages at a time. Callers are
+// serialized by region_lock. Returned locked and on no list if locked,
+// otherwise unlocked and on the cold list of its tier like tmem_mmap's pages.
+// NULL if it would have to mmap a new batch and may_mmap is false
+struct tmem_page* tmem_page_create(struct region_chunk *chunk, bool locked, bool may_mmap) {
+    internal_call = true;
+    struct tmem_page *page = dequeue_fifo(&free_list);
+    // a migrate worker can hold a freed page's lock (a stale hot queue entry)
+    // while it waits for region_lock, leave that page for a later mmap
+    if (page != NULL && !page_trylock(page)) {
+        enqueue_fifo(&free_list, page);
+        page = NULL;
+    }
+    if (page == NULL) {
+        if (lazy_pages_left == 0) {
+            if (!may_mmap) return NULL;
+            lazy_pages = alloc_pages(LAZY_PAGES_BATCH);
+            lazy_pages_left = LAZY_PAGES_BATCH;
         }
-        if (mbind(p_rem, rem_mmap_size, MPOL_BIND, &rem_nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT) == -1) {
+        page = lazy_pages++;
+        lazy_pages_left--;
+        // nobody has seen it yet, this never waits
+        page_lock(page);
+    }
+    init_page(page, (void *)chunk->map_lo, chunk->map_hi - chunk->map_lo, chunk->tier, chunk->site);
+    // keyed like the whole chunk even if only part of it is still mapped
+    page->va = chunk->key;
+    assert(page->list == NULL);
+    if (!locked && !is_last_tier(chunk->tier)) {
+        enqueue_fifo(&cold_lists[chunk->tier], page);
+    }
+    add_page(page);
+    if (!locked) page_unlock(page);
+    STAT_INC(lazy_pages);
+    return page;
+}
+
+// Starts tracking [p, p + length), mapped from site but not yet placed:
+// reserves it in the tiers, binds it and records its region and pages
+static void tmem_track(void *p, uint64_t length, uint16_t site) {
+    // fill the fastest tiers first, those a cold site's mmaps skip aside
+    uint32_t first = tmem_cfg.site_algo ? site_first_tier(site) : TOP_TIER;
+    if (first != TOP_TIER) pebs_stats.site_lowered_bytes += length;
+    site_mapped(site, length);
+    uint64_t tier_len[MAX_TIERS];
+    tier_reserve(length, first, tier_len);
+    void *seg = p;
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        if (tier_len[t] == 0) continue;
+        LOG_DEBUG("MMAP: tier %u: %lu\n", t, tier_len[t]);
+        unsigned long nodemask = 1UL << tiers[t].node;
+        if (mbind(seg, tier_len[t], MPOL_BIND, &nodemask, 64, MPOL_MF_MOVE | MPOL_MF_STRICT) == -1) {
             perror("mbind");
             assert(0);
         }
-        
-    }
-    
-
-
-    // LOG_DEBUG("dram_size: %ld, dram_free: %ld\n", dram_size, dram_free);
-    if (p == MAP_FAILED) {
-        LOG_DEBUG("mmap failed\n");
-        return MAP_FAILED;
+        seg += tier_len[t];
     }
     pebs_stats.mem_allocated += length;
+    region_insert((uint64_t)p, length, tier_len, site);
 
-    assert((uint64_t)p % BASE_PAGE_SIZE == 0);
+    if (tmem_cfg.lazy_meta) {
+        // pages get their metadata once they're sampled or picked for demotion
+        if ((uint64_t)p < min_tmem_va) min_tmem_va = (uint64_t)p;
+        if ((uint64_t)p + length - 1 > max_tmem_va) max_tmem_va = (uint64_t)p + length - 1;
+        return;
+    }
 
     // recycle pages from free_tmem_pages
-    uint64_t num_tmem_pages_needed = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t num_tmem_pages_needed = (length + tmem_cfg.page_size - 1) / tmem_cfg.page_size;
     uint64_t i = 0;
     for (i = 0; free_list.numentries > 0 && num_tmem_pages_needed > 0; i++) {
         // printf("recycling pages\n");
         struct tmem_page *page = dequeue_fifo(&free_list);
         if (page == NULL) break;
-        pthread_mutex_lock(&page->page_lock);
+        page_lock(page);
 
         // use lock to cause atomic update of page
         assert(page->free);
-        page->va_start = p + (i * PAGE_SIZE);
-        if (length - (i * PAGE_SIZE) < PAGE_SIZE) {
-            page->va = (uint64_t)(page->va_start);
-            page->size = length - (i * PAGE_SIZE);
-            if (page->size < BASE_PAGE_SIZE) page->size = BASE_PAGE_SIZE;   // Always at least 4KB
-        } else {
-            page->size = PAGE_SIZE;
-            // Align va to PAGE_SIZE address for future lookups in hashmap
-            page->va = PAGE_ROUND_UP((uint64_t)(page->va_start));
-        }
-        if (page->va > max_tmem_va) max_tmem_va = page->va;
-        if (page->va < min_tmem_va) min_tmem_va = page->va;
-        page->mig_up = 0;
-        page->mig_down = 0;
-        page->accesses = 0;
-        page->migrating = false;
-        page->local_clock = 0;
-        page->cyc_accessed = 0;
-        page->ip = 0;
-
-        // page->prev = NULL;
-        // page->next = NULL;
-
-
-        page->in_dram = (page->va_start >= p_rem) ? IN_REM : IN_DRAM;
-        page->hot = false;
-        page->free = false;
-        page->migrating = false;
-        page->migrated = false;
-        memset(page->neighbors, 0, MAX_NEIGHBORS * sizeof(struct neighbor_page));
+        init_page(page, p + (i * tmem_cfg.page_size), length - (i * tmem_cfg.page_size), tier_of_offset(i * tmem_cfg.page_size, tier_len), site);
 
         assert(page->list == NULL);
-        if (page->in_dram == IN_DRAM) {
-            enqueue_fifo(&cold_list, page);
+        if (!is_last_tier(page->tier)) {
+            enqueue_fifo(&cold_lists[page->tier], page);
         }
 
-        pthread_mutex_unlock(&page->page_lock);
-
-        // pthread_mutex_init(&page->page_lock, NULL);
+        page_unlock(page);
 
         // LOG_DEBUG("adding recycled page: 0x%lx\n", (uint64_t)page);
         add_page(page);
         num_tmem_pages_needed--;
     }
 
-    if (num_tmem_pages_needed == 0) {
-        internal_call = false; 
-        return p;
-    }
+    if (num_tmem_pages_needed == 0) return;
 
-    uint64_t pages_mmap_size = num_tmem_pages_needed * sizeof(struct tmem_page);
-    void *pages_ptr = libc_mmap(NULL, pages_mmap_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-    assert(pages_ptr != MAP_FAILED);
-    pebs_stats.internal_mem_overhead += pages_mmap_size;
-    
+    struct tmem_page *pages = alloc_pages(num_tmem_pages_needed);
     for (uint64_t j = 0; num_tmem_pages_needed > 0; j++) {
-        // struct tmem_page* page = create_tmem_page(page_boundry, pages_ptr);
-        struct tmem_page *page = (struct tmem_page *)(pages_ptr + (j * sizeof(struct tmem_page)));
+        struct tmem_page *page = &pages[j];
 
         // Don't need lock since first creation of page so no threads have cached data on it
-        page->va_start = p + (i * PAGE_SIZE);
-        if (length - (i * PAGE_SIZE) < PAGE_SIZE) {
-            page->va = (uint64_t)(page->va_start);
-            page->size = length - (i * PAGE_SIZE);
-            if (page->size < BASE_PAGE_SIZE) page->size = BASE_PAGE_SIZE;   // Always at least 4KB
-        } else {
-            page->size = PAGE_SIZE;
-            // Align va to PAGE_SIZE address for future lookups in hashmap
-            page->va = PAGE_ROUND_UP((uint64_t)(page->va_start));
+        init_page(page, p + (i * tmem_cfg.page_size), length - (i * tmem_cfg.page_size), tier_of_offset(i * tmem_cfg.page_size, tier_len), site);
+        if (!is_last_tier(page->tier)) {
+            enqueue_fifo(&cold_lists[page->tier], page);
         }
-        if (page->va > max_tmem_va) max_tmem_va = page->va;
-        if (page->va < min_tmem_va) min_tmem_va = page->va;
-        page->mig_up = 0;
-        page->mig_down = 0;
-        page->accesses = 0;
-        page->local_clock = 0;
-        page->cyc_accessed = 0;
-        page->ip = 0;
-
-        page->prev = NULL;
-        page->next = NULL;
 
-        page->in_dram = (page->va_start >= p_rem) ? IN_REM : IN_DRAM;
-        page->hot = false;
-        page->free = false;
-        page->migrating = false;
-        page->migrated = false;
-        memset(page->neighbors, 0, MAX_NEIGHBORS * sizeof(struct neighbor_page));
-        pthread_mutex_init(&page->page_lock, NULL);
-        page->list = NULL;
-        if (page->in_dram == IN_DRAM) {
-            enqueue_fifo(&cold_list, page);
-        }
-
-        
         // LOG_DEBUG("adding page: 0x%lx\n", (uint64_t)page);
         add_page(page);
         num_tmem_pages_needed--;
         i++;
     }
+}
+
+// Cuts [lo, hi) out of the locked page. A page covers one range, so if that
+// leaves two the smaller one isn't tracked anymore. Sub-page state follows
+// the new start of the page
+static void page_trim(struct tmem_page *page, uint64_t lo, uint64_t hi) {
+    struct tmem_page_meta *meta = page->meta;
+    uint64_t start = (uint64_t)meta->va_start, end = start + meta->size;
+    bool keep_front = lo - start >= end - hi;
+    uint64_t new_start = keep_front ? start : hi;
+    uint64_t new_size = (keep_front ? lo : end) - new_start;
+
+    if (!page->discarded) page_charge(page, -1);
+    pebs_stats.mem_allocated -= meta->size - new_size;
+    struct subpage_map *map = meta->sub;
+    if (map != NULL) {
+        memset(sub_sampled(map), 0, subpage_words() * sizeof(uint64_t));
+        map->samples = 0;
+    }
+    if (page_sub_bytes(page) != 0) {
+        uint64_t sub = subpage_size();
+        uint64_t shift = (new_start - start) / sub;
+        uint64_t promoted[SUBPAGE_WORDS] = {0};
+        uint64_t bytes = 0;
+        for (uint64_t i = 0; i + shift < SUBPAGE_BITS && i * sub < new_size; i++) {
+            uint64_t j = i + shift;
+            if (!(sub_promoted(map)[j / 64] >> (j % 64) & 1)) continue;
+            promoted[i / 64] |= 1ULL << (i % 64);
+            bytes += (i + 1) * sub <= new_size ? sub : new_size - i * sub;
+        }
+        memcpy(sub_promoted(map), promoted, subpage_words() * sizeof(uint64_t));
+        if (bytes == 0) {
+            // none of the promoted sub-pages are left, the rest is all one tier down
+            if (page->list != NULL) page_list_remove_page(page->list, page);
+            page->tier++;
+            page->hot = false;
+            if (!is_last_tier(page->tier) && !page->discarded) enqueue_fifo(&cold_lists[page->tier], page);
+        }
+        // 0 is also all of it promoted
+        map->bytes = bytes < new_size ? bytes : 0;
+    }
+    meta->va_start = (void *)new_start;
+    meta->size = new_size;
+    if (!page->discarded) page_charge(page, 1);
+}
+
+static bool unmap_chunk(struct region_chunk *chunk, void *arg) {
+    struct tmem_page *page = find_page(chunk->key);
+    if (page == NULL) {
+        // no metadata yet (lazy_meta), still counted where the mmap put it
+        site_mapped(chunk->site, -(long)(chunk->hi - chunk->lo));
+        tier_used_add(chunk->tier, -(long)(chunk->hi - chunk->lo));
+        pebs_stats.mem_allocated -= chunk->hi - chunk->lo;
+        return true;
+    }
+    if (!page_trylock(page)) return false;
+    site_mapped(chunk->site, -(long)(chunk->hi - chunk->lo));
+    assert(page->free == false);
+    uint64_t start = (uint64_t)page->meta->va_start, end = start + page->meta->size;
+    uint64_t lo = chunk->lo > start ? chunk->lo : start;
+    uint64_t hi = chunk->hi < end ? chunk->hi : end;
+    if (lo >= hi) {
+        // the part of the chunk the page let go of
+    } else if (lo > start || hi < end) {
+        page_trim(page, lo, hi);
+        STAT_INC(partial_unmaps);
+    } else {
+        if (!page->discarded) page_charge(page, -1);
+        page->free = true;
+        remove_page(page);
+        pebs_stats.mem_allocated -= page->meta->size;
+
+        if (page->list != NULL) {
+            page_list_remove_page(page->list, page);
+        }
+        enqueue_fifo(&free_list, page);
+    }
+    page_unlock(page);
+    return true;
+}
+
+// Stops tracking [addr, addr + length), its pages are freed or trimmed and
+// their bytes given back to their tiers
+static void tmem_untrack(void *addr, uint64_t length) {
+    region_for_each_chunk((uint64_t)addr, length, unmap_chunk, NULL);
+    region_remove((uint64_t)addr, length);
+}
+
+void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    length = PAGE_ROUND_UP_BASE(length);
+    internal_call = true;
+
+    void *p = libc_mmap(addr, length, prot, flags, fd, offset);
+    assert(p != MAP_FAILED);
+
+    // LOG_DEBUG("dram_size: %ld, dram_free: %ld\n", dram_size, dram_free);
+    if (p == MAP_FAILED) {
+        LOG_DEBUG("mmap failed\n");
+        return MAP_FAILED;
+    }
+    assert((uint64_t)p % BASE_PAGE_SIZE == 0);
+
+    // replaces whatever was mapped there
+    if (flags & MAP_FIXED) tmem_untrack(p, length);
+    tmem_track(p, length, tmem_cfg.site_algo ? site_lookup(alloc_site_ip) : 0);
     internal_call = false;
     return p;
 }
@@ -295,38 +388,102 @@ int tmem_munmap(void *addr, size_t length) {
     LOG_DEBUG("tmem_munmap: %p, length: %lu\n", addr, length);
     LOG_DEBUG("tmem va range: 0x%lx - 0x%lx\n", min_tmem_va, max_tmem_va);
 
-    uint64_t num_tmem_pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t i = 0; i < num_tmem_pages; i++) {
-        void *va_start = addr + (i * PAGE_SIZE);
-        uint64_t va;
-        if (length - (i * PAGE_SIZE) < PAGE_SIZE) {
-            va = (uint64_t)(va_start);
-        } else {
-            va = PAGE_ROUND_UP((uint64_t)(va_start));
-        }
-        struct tmem_page *page = find_page(va);
-        if (page != NULL) {
-            pthread_mutex_lock(&page->page_lock);
-            assert(page->free == false);
-            page->free = true;
-            remove_page(page);
-            // if (page->in_dram == IN_DRAM) {
-            //     dram_used -= page->size;
-            // }
-            pebs_stats.mem_allocated -= page->size;
-
-            if (page->list != NULL) {
-                page_list_remove_page(page->list, page);
-            }
-            enqueue_fifo(&free_list, page);
-
-            pthread_mutex_unlock(&page->page_lock);
-        }
-    }
+    tmem_untrack(addr, PAGE_ROUND_UP_BASE(length));
     internal_call = false;
     return 0;
 }
 
+// Re-keys the page of a chunk moving by delta bytes. Physical pages don't move,
+// so it stays in its tier. A page only partly in the range is trimmed instead
+static bool move_chunk(struct region_chunk *chunk, void *arg) {
+    int64_t delta = *(int64_t *)arg;
+    struct tmem_page *page = find_page(chunk->key);
+    if (page == NULL) return true;
+    if (!page_trylock(page)) return false;
+    uint64_t start = (uint64_t)page->meta->va_start, end = start + page->meta->size;
+    uint64_t lo = chunk->lo > start ? chunk->lo : start;
+    uint64_t hi = chunk->hi < end ? chunk->hi : end;
+    if (lo < hi && (lo > start || hi < end)) {
+        page_trim(page, lo, hi);
+    } else if (lo < hi) {
+        remove_page(page);
+        page->va = chunk_key(chunk->start + delta, chunk->size);
+        page->meta->va_start += delta;
+        add_page(page);
+        if (page->va > max_tmem_va) max_tmem_va = page->va;
+        if (page->va < min_tmem_va) min_tmem_va = page->va;
+    }
+    page_unlock(page);
+    return true;
+}
+
+// The pages of the old range go with it, the part it shrank by is unmapped
+// and the part it grew by is tracked like a new mmap
+void* tmem_mremap(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr) {
+    internal_call = true;
+    old_size = PAGE_ROUND_UP_BASE(old_size);
+    new_size = PAGE_ROUND_UP_BASE(new_size);
+    bool tracked = old_size != 0 && region_tracked((uint64_t)old_addr);
+
+    void *p = libc_mremap(old_addr, old_size, new_size, flags, new_addr);
+    if (p == MAP_FAILED || !tracked) {
+        internal_call = false;
+        return p;
+    }
+    LOG_DEBUG("tmem_mremap: %p, %lu -> %p, %lu\n", old_addr, old_size, p, new_size);
+
+    if (new_size < old_size) tmem_untrack(old_addr + new_size, old_size - new_size);
+    uint64_t kept = new_size < old_size ? new_size : old_size;
+    if (p != old_addr) {
+        // MREMAP_FIXED unmapped what was there. With MREMAP_DONTUNMAP the old
+        // range stays mapped but empty, it isn't tracked anymore
+        if (flags & MREMAP_FIXED) tmem_untrack(p, new_size);
+        int64_t delta = (uint64_t)p - (uint64_t)old_addr;
+        region_for_each_chunk((uint64_t)old_addr, kept, move_chunk, &delta);
+        region_move((uint64_t)old_addr, kept, (uint64_t)p);
+    }
+    if (new_size > old_size) {
+        tmem_track(p + old_size, new_size - old_size, tmem_cfg.site_algo ? site_lookup(alloc_site_ip) : 0);
+    }
+    STAT_INC(remaps);
+    internal_call = false;
+    return p;
+}
+
+static bool discard_chunk(struct region_chunk *chunk, void *arg) {
+    struct tmem_page *page = find_page(chunk->key);
+    if (page == NULL) {
+        // a chunk without metadata (lazy_meta) needs a page to remember it's gone
+        if (chunk->lo != chunk->map_lo || chunk->hi != chunk->map_hi) return true;
+        page = tmem_page_create(chunk, true, true);
+    } else if (!page_trylock(page)) {
+        return false;
+    }
+    uint64_t start = (uint64_t)page->meta->va_start, end = start + page->meta->size;
+    // part of a page is still counted, it can't tell which part is gone
+    if (!page->discarded && chunk->lo <= start && chunk->hi >= end) {
+        page_charge(page, -1);
+        if (page->list != NULL) page_list_remove_page(page->list, page);
+        page->hot = false;
+        page->discarded = true;
+        STAT_INC(discards);
+    }
+    page_unlock(page);
+    return true;
+}
+
+// MADV_DONTNEED and MADV_FREE give the memory of the range back, the pages
+// it covers stop counting in their tiers until a sample shows they're in use again
+int tmem_madvise(void *addr, size_t length, int advice) {
+    internal_call = true;
+    int ret = madvise(addr, length, advice);
+    if (ret == 0) {
+        region_for_each_chunk((uint64_t)addr, PAGE_ROUND_UP_BASE(length), discard_chunk, NULL);
+    }
+    internal_call = false;
+    return ret;
+}
+
 void tmem_cleanup() {
     kill_threads();
     // TODO: unmap pages (very difficult since libc_munmap works on 4KB and will unmap multiple pages at a time if in same region)
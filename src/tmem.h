@@ -2,18 +2,29 @@
 #define _TMEM_HEADER
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifndef TMEM_SIM
 #include <numa.h>
 #include <numaif.h>
+#endif
 
+#include "config.h"
 #include "pebs.h"
-#include "uthash.h"
+#include "page-index.h"
 #include "algorithm.h"
+#include "hot-queue.h"
 
 // #define DRAM_SIZE (14 * (1024UL * 1024UL * 1024UL))
 // #define REMOTE_SIZE (6 * (1024UL * 1024UL * 1024UL))
 
-#define DRAM_NODE 0
-#define REM_NODE 1
+// NUMA nodes of the memory tiers, fastest first (tmem_cfg.tier_nodes)
+#ifndef TIER_NODES
+#define TIER_NODES 0, 1
+#endif
+
+#define TOP_TIER 0
 
 // #define PAGE_SIZE 4096UL              // 4KB
 // #define PAGE_SIZE (1 * (1024UL * 1024UL))
@@ -23,41 +34,102 @@
 // #define PAGE_SIZE (256 * 1024UL) // 256KB
 #define BASE_PAGE_SIZE 4096UL
 
-#define PAGE_MASK (~(PAGE_SIZE - 1))
+// PAGE_SIZE is only the default, the page size in use is tmem_cfg.page_size
+#define PAGE_MASK (~(tmem_cfg.page_size - 1))
 #define BASE_PAGE_MASK (~(BASE_PAGE_SIZE - 1))
 
+#define PAGE_ROUND_UP(x) (((x) + tmem_cfg.page_size - 1) & ~(tmem_cfg.page_size - 1))
+#define PAGE_ROUND_DOWN(x) ((x) & ~(tmem_cfg.page_size - 1))
+
 // Use either DRAM_BUFFER or DRAM_SIZE
 #ifndef DRAM_BUFFER 
 #define DRAM_BUFFER (1 * 1024L * 1024L * 1024L)     // How much to leave available on DRAM node
 #endif
 
+// Create page metadata when a page is first sampled or demoted instead of in tmem_mmap (region.h)
+#ifndef LAZY_META
+    #define LAZY_META 0
+#endif
+
+// Serve small allocations from tracked arenas (arena.h)
+#ifndef ARENA_ALGO
+    #define ARENA_ALGO 0
+#endif
+
+// Start new mmaps in a tier picked by their allocation site (alloc-site.h)
+#ifndef SITE_ALGO
+    #define SITE_ALGO 0
+#endif
+
+// Pages allocated at once for lazily created metadata
+#ifndef LAZY_PAGES_BATCH
+    #define LAZY_PAGES_BATCH 512
+#endif
+
 #ifndef DRAM_SIZE
     #define DRAM_SIZE (0)
     // #define DRAM_SIZE (2 * 1024L * 1024L * 1024L)
 #endif
 
 
-extern struct fifo_list hot_list;
-extern struct fifo_list cold_list;
+struct tmem_tier {
+    int node;
+    long size;              // capacity for tracked pages, not checked for the last tier
+    long used;              // includes room reserved by migrate workers
+    long reserved;          // of that, room held by migrations in flight
+    long free;              // only refreshed with dram_buffer
+};
+
+// MAX_TIERS entries, shared by every process attached to tmemd (see tmemd.h)
+extern struct tmem_tier *tiers;
+// Bytes of each tier this process holds, the part of tiers[t].used that's ours
+extern long *tier_own;
+// Room this process's migrations hold, its part of tiers[t].reserved
+extern long *tier_held;
+
+static inline void tier_used_add(uint32_t t, long bytes) {
+    __atomic_fetch_add(&tiers[t].used, bytes, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&tier_own[t], bytes, __ATOMIC_RELAXED);
+}
+
+// Room a migration holds in tier t until it's done, on top of used
+static inline void tier_reserved_add(uint32_t t, long bytes) {
+    __atomic_fetch_add(&tiers[t].reserved, bytes, __ATOMIC_ACQ_REL);
+    __atomic_fetch_add(&tier_held[t], bytes, __ATOMIC_RELAXED);
+}
+
+// With dram_buffer, sets used to what the node holds plus the room held by
+// migrations in flight, which the node doesn't show yet. Through a CAS so a
+// reservation made meanwhile isn't lost: it either lands first and is in
+// reserved, or its own CAS fails and it's taken again from the new used
+static inline void tier_used_refresh(struct tmem_tier *tier, long node_used) {
+    long used = __atomic_load_n(&tier->used, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&tier->used, &used, node_used + __atomic_load_n(&tier->reserved, __ATOMIC_ACQUIRE),
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// cold_lists are in fifo.h, they need the complete fifo_list
 extern struct fifo_list free_list;
 
-extern long dram_free;
-extern long dram_size;
-extern long dram_used;
-extern long rem_used;
 extern pthread_mutex_t mmap_lock;
-extern _Atomic bool dram_lock;
 
-enum {
-    IN_DRAM,
-    IN_REM
-};
+static inline bool is_last_tier(uint32_t tier) {
+    return tier == tmem_cfg.num_tiers - 1;
+}
 
 #ifndef MAX_NEIGHBORS
 #define MAX_NEIGHBORS 4
 #endif
 
+// Sub-pages tracked per page with subpage_algo, each covers
+// page_size / SUBPAGE_BITS (at least 4KB, so 4KB sub-pages of a 2MB page)
+#ifndef SUBPAGE_BITS
+#define SUBPAGE_BITS 512
+#endif
+#define SUBPAGE_WORDS ((SUBPAGE_BITS + 63) / 64)
+
 struct tmem_page;
+struct region_chunk;
 
 struct neighbor_page {
     struct tmem_page *page;
@@ -65,36 +137,149 @@ struct neighbor_page {
     uint64_t time_diff;
 };
 
-struct tmem_page {
-    uint64_t va;
+// Sub-page hotness of a page (subpage_algo), in its own array next to the
+// metadata so pages don't carry it without subpage_algo or with 4KB pages.
+// The sampled map is written by the scan thread and reset when the page cools
+struct subpage_map {
+    uint32_t samples;
+    // A sparse page promoted by its sampled sub-pages: only the promoted
+    // sub-pages (bytes) are in page->tier, the rest stays one tier down
+    uint64_t bytes;         // 0 if the whole page is in page->tier
+    uint64_t words[];       // subpage_words() of the sampled map, then of the promoted one
+};
+
+// Cold per page metadata, touched on list moves, migrations and mmap/munmap
+struct tmem_page_meta {
+    struct tmem_page *next, *prev;
     void* va_start;
     uint64_t size;
     uint64_t mig_up, mig_down;
+    uint64_t mig_start;
+    uint64_t promoted_cyc;  // last promotion, 0 if not promoted since its last demotion
+    struct subpage_map *sub;            // NULL without subpage_algo
+    struct neighbor_page *neighbors;    // tmem_cfg.max_neighbors entries, NULL without cluster_algo
+    uint16_t site;          // allocation site of its mmap (site_algo), 0 if unknown
+};
+
+// Per page state read and written for every sample, fits in one cache line
+struct tmem_page {
+    uint64_t va;
     uint64_t accesses;
-    uint64_t local_clock;
+    uint32_t local_clock;
+    _Atomic uint32_t lock;      // see page_lock, here so the sampling path's trylock stays in this line
     uint64_t cyc_accessed;
     uint64_t ip;
-    uint64_t mig_start;
-    pthread_mutex_t page_lock;
-
-    UT_hash_handle hh;
-    struct tmem_page *next, *prev;
-    struct neighbor_page neighbors[MAX_NEIGHBORS];
     struct fifo_list *list;
+    struct tmem_page_meta *meta;
 
     // Page states
-    _Atomic uint8_t in_dram;
+    _Atomic uint8_t tier;       // index into tiers, TOP_TIER is DRAM
     _Atomic bool hot;
     _Atomic bool free;
     _Atomic bool migrating;
     _Atomic bool migrated;
-};
+    _Atomic bool queued;        // in a hot queue
+    _Atomic bool referenced;    // sampled since the clock last passed (LRU_CLOCK)
+    _Atomic bool discarded;     // madvise freed its memory, on no list and not counted in the tiers
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct tmem_page) == 64, "tmem_page should be one cache line");
+
+// Page lock: 0 free, 1 locked, 2 locked and someone may be waiting on the
+// futex. Held across mbind, so waiters sleep instead of spinning
+static inline bool page_trylock(struct tmem_page *page) {
+    uint32_t c = 0;
+    return atomic_compare_exchange_strong_explicit(&page->lock, &c, 1, memory_order_acquire, memory_order_relaxed);
+}
+
+static inline void page_lock(struct tmem_page *page) {
+    uint32_t c = 0;
+    if (atomic_compare_exchange_strong_explicit(&page->lock, &c, 1, memory_order_acquire, memory_order_relaxed)) return;
+    if (c != 2) c = atomic_exchange_explicit(&page->lock, 2, memory_order_acquire);
+    while (c != 0) {
+        syscall(SYS_futex, &page->lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = atomic_exchange_explicit(&page->lock, 2, memory_order_acquire);
+    }
+}
+
+static inline void page_unlock(struct tmem_page *page) {
+    if (atomic_exchange_explicit(&page->lock, 0, memory_order_release) == 2) {
+        syscall(SYS_futex, &page->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static inline uint64_t subpage_size() {
+    uint64_t sub = tmem_cfg.page_size / SUBPAGE_BITS;
+    return sub < BASE_PAGE_SIZE ? BASE_PAGE_SIZE : sub;
+}
+
+static inline uint64_t subpage_words() {
+    return (tmem_cfg.page_size / subpage_size() + 63) / 64;
+}
+
+static inline uint64_t subpage_map_size() {
+    return sizeof(struct subpage_map) + 2 * subpage_words() * sizeof(uint64_t);
+}
+
+// Whether new pages get a subpage_map, a page of one sub-page has nothing to split
+static inline bool subpage_maps() {
+    return tmem_cfg.subpage_algo && tmem_cfg.page_size > subpage_size();
+}
+
+static inline uint64_t* sub_sampled(struct subpage_map *sub) {
+    return sub->words;
+}
+
+static inline uint64_t* sub_promoted(struct subpage_map *sub) {
+    return sub->words + subpage_words();
+}
+
+// Bytes of a partly promoted page that are in page->tier, 0 if it's all there
+static inline uint64_t page_sub_bytes(struct tmem_page *page) {
+    return page->meta->sub != NULL ? page->meta->sub->bytes : 0;
+}
+
+static inline void page_sub_clear(struct tmem_page *page) {
+    if (page->meta->sub != NULL) page->meta->sub->bytes = 0;
+}
+
+// Bytes that move with the page, only the promoted sub-pages of a partly promoted page
+static inline uint64_t page_bytes(struct tmem_page *page) {
+    uint64_t sub_bytes = page_sub_bytes(page);
+    return sub_bytes != 0 ? sub_bytes : page->meta->size;
+}
+
+// Adds (sign 1) or takes out (sign -1) the bytes of page to the tiers they're in,
+// the sub-pages that weren't promoted are one tier down
+static inline void page_charge(struct tmem_page *page, long sign) {
+    uint64_t bytes = page_bytes(page);
+    tier_used_add(page->tier, sign * (long)bytes);
+    if (bytes < page->meta->size) tier_used_add(page->tier + 1, sign * (long)(page->meta->size - bytes));
+}
+
+// Tier the memory at addr of page is in
+static inline uint8_t page_addr_tier(struct tmem_page *page, uint64_t addr) {
+    if (page_sub_bytes(page) == 0) return page->tier;
+    uint64_t idx = (addr - (uint64_t)page->meta->va_start) / subpage_size();
+    if (idx >= SUBPAGE_BITS) return page->tier + 1;
+    return (sub_promoted(page->meta->sub)[idx / 64] >> (idx % 64) & 1) ? page->tier : page->tier + 1;
+}
 
 void tmem_init();
+void tier_refresh();
+void tmem_va_range(uint64_t *lo, uint64_t *hi);
+struct tmem_page* tmem_page_create(struct region_chunk *chunk, bool locked, bool may_mmap);
+void tmem_pages_refill();
 void* tmem_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int tmem_munmap(void *addr, size_t length);
+void* tmem_mremap(void *old_addr, size_t old_size, size_t new_size, int flags, void *new_addr);
+int tmem_madvise(void *addr, size_t length, int advice);
 void tmem_cleanup();
 struct tmem_page* find_page(uint64_t va);
-struct tmem_page* find_page_no_lock(uint64_t va);
+
+// Lock-free, safe to call from the sampling thread
+static inline struct tmem_page* find_page_no_lock(uint64_t va) {
+    return pindex_lookup(va);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "tmemd.h"
+#include "policy.h"
+#include "region.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+    Daemon sampling backend (sample_backend=2)
+
+    Attaches to the segment of a running tmemd instead of opening perf
+    buffers, so N processes don't run N copies of PEBS on every CPU. The
+    tiers live in the segment, which puts the DRAM budget of every attached
+    process in one place. The single scan thread drains the samples tmemd
+    forwards for this process, hands tmemd's demotion decisions to the
+    migrate workers and publishes what tmemd ranks the processes by.
+*/
+
+static struct tmemd_shm *shm = NULL;
+static struct tmemd_tenant *tenant = NULL;
+
+void tmemd_client_init() {
+    int fd = shm_open(TMEMD_SHM_NAME, O_RDWR, 0);
+    if (fd < 0) {
+        perror("daemon backend: shm_open " TMEMD_SHM_NAME " (is tmemd running?)");
+        exit(1);
+    }
+    // mapped as big as tmemd made it, touching past its end would be a SIGBUS
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < offsetof(struct tmemd_shm, daemon_pid)) {
+        fprintf(stderr, "daemon backend: tmemd segment not ready or from another version\n");
+        exit(1);
+    }
+    shm = libc_mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED || atomic_load(&shm->magic) != TMEMD_MAGIC) {
+        fprintf(stderr, "daemon backend: tmemd segment not ready or from another version\n");
+        exit(1);
+    }
+    if (shm->size != tmemd_shm_size() || (size_t)st.st_size != tmemd_shm_size() || shm->max_tiers != MAX_TIERS
+        || shm->max_tenants != TMEMD_MAX_TENANTS || shm->sample_ring_size != TMEMD_SAMPLE_RING_SIZE
+        || shm->decision_ring_size != TMEMD_DECISION_RING_SIZE) {
+        fprintf(stderr, "daemon backend: tmemd was built with MAX_TIERS=%u TMEMD_MAX_TENANTS=%u TMEMD_SAMPLE_RING_SIZE=%u "
+                "TMEMD_DECISION_RING_SIZE=%u, this library with %u %u %u %u\n",
+                shm->max_tiers, shm->max_tenants, shm->sample_ring_size, shm->decision_ring_size,
+                MAX_TIERS, TMEMD_MAX_TENANTS, TMEMD_SAMPLE_RING_SIZE, TMEMD_DECISION_RING_SIZE);
+        exit(1);
+    }
+    if (shm->num_tiers != tmem_cfg.num_tiers) {
+        fprintf(stderr, "daemon backend: tmemd has %u tiers, tier_nodes has %u\n", shm->num_tiers, tmem_cfg.num_tiers);
+        exit(1);
+    }
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        if (shm->tiers[t].node != tmem_cfg.tier_nodes[t]) {
+            fprintf(stderr, "daemon backend: tier %u is node %d in tmemd, %ld in tier_nodes\n", t, shm->tiers[t].node, tmem_cfg.tier_nodes[t]);
+            exit(1);
+        }
+    }
+
+    int pid = getpid();
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS && tenant == NULL; i++) {
+        int free_slot = 0;
+        // tmemd empties a slot before it frees it
+        if (atomic_compare_exchange_strong(&shm->tenants[i].pid, &free_slot, pid)) tenant = &shm->tenants[i];
+    }
+    if (tenant == NULL) {
+        fprintf(stderr, "daemon backend: all %d tmemd slots taken\n", TMEMD_MAX_TENANTS);
+        exit(1);
+    }
+
+    // nothing is reserved yet (pebs_init runs before tmem_init), switch to the shared tiers
+    tiers = shm->tiers;
+    tier_own = tenant->own;
+    tier_held = tenant->held;
+    LOG_DEBUG("daemon backend: slot %ld of tmemd %d\n", tenant - shm->tenants, shm->daemon_pid);
+}
+
+uint64_t tmemd_client_drops() {
+    return __atomic_load_n(&tenant->drops, __ATOMIC_RELAXED);
+}
+
+static void tmemd_publish() {
+    uint64_t lo, hi;
+    tmem_va_range(&lo, &hi);
+    __atomic_store_n(&tenant->va_lo, lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&tenant->va_hi, hi + tmem_cfg.page_size, __ATOMIC_RELAXED);
+    for (uint32_t t = TOP_TIER + 1; t < tmem_cfg.num_tiers; t++) {
+        __atomic_store_n(&tenant->hot_bytes[t], hot_queue_len(&hot_queues[t]) * tmem_cfg.page_size, __ATOMIC_RELAXED);
+    }
+
+    struct tmemd_decision dec;
+    while (spsc_ring_pop(tmemd_ring(shm, tenant->decisions_off), &dec)) {
+        if (dec.tier >= tmem_cfg.num_tiers - 1) continue;
+        LOG_DEBUG("daemon backend: demote %lu bytes out of tier %u\n", dec.bytes, dec.tier);
+        __atomic_fetch_add(&pebs_stats.tmemd_demote_bytes, dec.bytes, __ATOMIC_RELAXED);
+        request_demotion(dec.tier, dec.bytes);
+    }
+}
+
+void* tmemd_scan_thread(void *arg) {
+    internal_call = true;
+    algo_set_shard(0);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(tmem_cfg.scan_cpu, &cpuset);
+    int s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    assert(s == 0);
+
+    struct spsc_ring *samples = tmemd_ring(shm, tenant->samples_off);
+    struct tmemd_sample rec;
+    uint64_t num_samples = 0;
+    while (true) {
+        if (!spsc_ring_pop(samples, &rec)) {
+            tmemd_publish();
+            usleep(TMEMD_POLL_US);
+            continue;
+        }
+        if ((++num_samples & 0xFFF) == 0) tmemd_publish();
+
+        struct tmem_page *page = find_page_no_lock(rec.va & PAGE_MASK);
+        // Try 4KB aligned page if not 2MB aligned page
+        if (page == NULL) page = find_page_no_lock(rec.va & BASE_PAGE_MASK);
+        if (page == NULL && tmem_cfg.lazy_meta) page = region_page(rec.va);
+        if (page == NULL) continue;
+        process_sample(page, rec.va, rec.ip, rec.time, rec.cpu, rec.evt);
+    }
+    return NULL;
+}
@@ -0,0 +1,339 @@
+/*
+    Tiering daemon (make tmemd)
+
+    One tmemd per machine replaces the perf buffers and scan threads every
+    process preloading libtmem.so would otherwise open on every CPU. It
+    samples loads machine wide, forwards each sample to the process it
+    belongs to and owns the memory tiers all of them reserve from, so the
+    DRAM budget is split by heat across processes instead of first come
+    first served. See tmemd.h for the shared segment.
+
+    Processes attach with TMEM_SAMPLE_BACKEND=2 and keep their own migrate
+    workers: every TMEMD_INTERVAL_MS tmemd ranks them by samples per byte of
+    each tier and, when a tier is full while a process has pages waiting to
+    be promoted into it, asks the process with the coldest share of the tier
+    to demote some of it.
+
+    Knobs are read like the library's (TMEM_<KNOB> / TMEM_CONFIG): tier_nodes,
+    dram_size/dram_buffer, tier_sizes, sample_period, pebs_nprocs and scan_cpu.
+    Stats go to stdout once per interval.
+
+    Usage: tmemd
+*/
+
+#include "tmemd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+// Permissions of the segment, processes of other users can't attach by default
+#ifndef TMEMD_SHM_MODE
+    #define TMEMD_SHM_MODE 0600
+#endif
+
+// Normally provided by interpose.c and pebs.c
+_Thread_local bool internal_call = true;
+void* (*libc_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset) = mmap;
+struct pebs_stats pebs_stats = {0};
+
+void trace_log(const char *fmt, ...) {
+}
+
+struct perf_sample {
+    __u64 ip;               /* if PERF_SAMPLE_IP*/
+    __u32 pid, tid;         /* if PERF_SAMPLE_TID */
+    __u64 time;             /* if PERF_SAMPLE_TIME */
+    __u64 addr;             /* if PERF_SAMPLE_ADDR */
+};
+
+static struct tmemd_shm *shm = NULL;
+static int pfd[PEBS_NPROCS][NPBUFTYPES];
+static struct perf_event_mmap_page *perf_page[PEBS_NPROCS][NPBUFTYPES];
+static volatile sig_atomic_t stop = 0;
+
+// this interval
+static uint64_t forwarded = 0, unowned = 0, decisions = 0;
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static void shm_setup() {
+    // a segment left behind by a tmemd that was killed
+    shm_unlink(TMEMD_SHM_NAME);
+    int fd = shm_open(TMEMD_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, TMEMD_SHM_MODE);
+    if (fd < 0 || ftruncate(fd, tmemd_shm_size()) != 0) {
+        perror("tmemd: shm " TMEMD_SHM_NAME);
+        exit(1);
+    }
+    shm = mmap(NULL, tmemd_shm_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("tmemd: mmap " TMEMD_SHM_NAME);
+        exit(1);
+    }
+
+    // ftruncate zeroed it
+    shm->size = tmemd_shm_size();
+    shm->max_tiers = MAX_TIERS;
+    shm->max_tenants = TMEMD_MAX_TENANTS;
+    shm->sample_ring_size = TMEMD_SAMPLE_RING_SIZE;
+    shm->decision_ring_size = TMEMD_DECISION_RING_SIZE;
+    shm->daemon_pid = getpid();
+    shm->num_tiers = tmem_cfg.num_tiers;
+    uint64_t off = sizeof(struct tmemd_shm);
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+        struct tmemd_tenant *tn = &shm->tenants[i];
+        tn->samples_off = off;
+        spsc_ring_place(tmemd_ring(shm, off), sizeof(struct tmemd_sample), TMEMD_SAMPLE_RING_SIZE);
+        off += TMEMD_SAMPLE_RING_BYTES;
+        tn->decisions_off = off;
+        spsc_ring_place(tmemd_ring(shm, off), sizeof(struct tmemd_decision), TMEMD_DECISION_RING_SIZE);
+        off += TMEMD_DECISION_RING_BYTES;
+    }
+    assert(off == tmemd_shm_size());
+}
+
+// Same sizing as tier_refresh in the library
+static void size_tiers() {
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        struct tmem_tier *tier = &shm->tiers[t];
+        tier->node = tmem_cfg.tier_nodes[t];
+        if (tmem_cfg.dram_buffer != 0) {
+            tier->size = numa_node_size(tier->node, &tier->free);
+            tier_used_refresh(tier, tier->size - tier->free);
+            if (!is_last_tier(t)) tier->size -= tmem_cfg.dram_buffer;
+        } else if (t == TOP_TIER) {
+            tier->size = tmem_cfg.dram_size;
+        } else if (!is_last_tier(t)) {
+            tier->size = tmem_cfg.tier_sizes[t - 1];
+        }
+    }
+}
+
+static inline long perf_event_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+    return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
+}
+
+// Like perf_setup in pebs.c, plus the pid of every sample
+static struct perf_event_mmap_page* perf_setup(__u64 config, uint32_t cpu_idx, int cpu, int type) {
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_RAW;
+    attr.size = sizeof(struct perf_event_attr);
+    attr.config = config;
+    attr.sample_period = tmem_cfg.sample_period;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.exclude_callchain_user = 1;
+    attr.precise_ip = 1;
+
+    pfd[cpu_idx][type] = perf_event_open(&attr, -1, cpu, -1, 0);
+    if (pfd[cpu_idx][type] == -1) {
+        perror("tmemd: perf_event_open");
+        exit(1);
+    }
+    size_t mmap_size = sysconf(_SC_PAGESIZE) * PERF_PAGES;
+    struct perf_event_mmap_page *p = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, pfd[cpu_idx][type], 0);
+    assert(p != MAP_FAILED);
+    return p;
+}
+
+static struct tmemd_tenant* find_tenant(int pid) {
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+        if (atomic_load_explicit(&shm->tenants[i].pid, memory_order_relaxed) == pid) return &shm->tenants[i];
+    }
+    return NULL;
+}
+
+static void forward(const struct perf_sample *rec, uint32_t cpu_idx, int evt) {
+    struct tmemd_tenant *tn = find_tenant(rec->pid);
+    if (tn == NULL || rec->addr < __atomic_load_n(&tn->va_lo, __ATOMIC_RELAXED)
+        || rec->addr >= __atomic_load_n(&tn->va_hi, __ATOMIC_RELAXED)) {
+        unowned++;
+        return;
+    }
+    if (evt == DRAMREAD) tn->dram_samples++;
+    else tn->rem_samples++;
+
+    struct tmemd_sample s = {
+        .va = rec->addr,
+        .ip = rec->ip,
+        .time = rec->time,
+        .cpu = cpu_idx,
+        .evt = evt
+    };
+    if (spsc_ring_push(tmemd_ring(shm, tn->samples_off), &s)) forwarded++;
+    else __atomic_fetch_add(&tn->drops, 1, __ATOMIC_RELAXED);
+}
+
+// Drains up to 128 records like process_perf_buffer, returns the records read
+static uint32_t drain_perf_buffer(uint32_t cpu_idx, int evt) {
+    struct perf_event_mmap_page *p = perf_page[cpu_idx][evt];
+    char *data = (char *)p + p->data_offset;
+    uint32_t num_loops = 0;
+    while (p->data_head != p->data_tail && num_loops++ != 128) {
+        uint64_t wrapped_tail = p->data_tail & (p->data_size - 1);
+        struct perf_event_header *hdr = (struct perf_event_header *)(data + wrapped_tail);
+        if (hdr->type == PERF_RECORD_SAMPLE && wrapped_tail + hdr->size <= p->data_size
+            && hdr->size - sizeof(struct perf_event_header) == sizeof(struct perf_sample)) {
+            struct perf_sample rec;
+            memcpy(&rec, data + wrapped_tail + sizeof(struct perf_event_header), sizeof(struct perf_sample));
+            if (rec.addr != 0) forward(&rec, cpu_idx, evt);
+        }
+        p->data_tail += hdr->size;
+    }
+    return num_loops;
+}
+
+// Frees the slots of processes that exited, with their share of fixed size
+// tiers and the room their migrations held (node sizes show the rest)
+static void reap_tenants() {
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+        struct tmemd_tenant *tn = &shm->tenants[i];
+        int pid = atomic_load(&tn->pid);
+        if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;
+
+        printf("tmemd: pid %d exited, freeing slot %u\n", pid, i);
+        for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+            // own includes held, with dram_buffer the next size_tiers drops
+            // held from used once it's out of reserved
+            if (tmem_cfg.dram_buffer == 0) __atomic_fetch_sub(&shm->tiers[t].used, tn->own[t], __ATOMIC_RELEASE);
+            __atomic_fetch_sub(&shm->tiers[t].reserved, tn->held[t], __ATOMIC_RELEASE);
+            tn->own[t] = 0;
+            tn->held[t] = 0;
+            tn->hot_bytes[t] = 0;
+        }
+        tn->va_lo = tn->va_hi = 0;
+        tn->dram_samples = tn->rem_samples = tn->drops = 0;
+        spsc_ring_place(tmemd_ring(shm, tn->samples_off), sizeof(struct tmemd_sample), TMEMD_SAMPLE_RING_SIZE);
+        spsc_ring_place(tmemd_ring(shm, tn->decisions_off), sizeof(struct tmemd_decision), TMEMD_DECISION_RING_SIZE);
+        atomic_store(&tn->pid, 0);
+    }
+}
+
+// Samples per MB a tenant got from its share of tier t this interval.
+// The events only tell DRAM from the rest, all lower tiers count as one
+static double tenant_heat(struct tmemd_tenant *tn, uint32_t t) {
+    long bytes = 0;
+    if (t == TOP_TIER) {
+        bytes = __atomic_load_n(&tn->own[TOP_TIER], __ATOMIC_RELAXED);
+    } else {
+        for (uint32_t u = TOP_TIER + 1; u < tmem_cfg.num_tiers; u++) bytes += __atomic_load_n(&tn->own[u], __ATOMIC_RELAXED);
+    }
+    uint64_t samples = (t == TOP_TIER) ? tn->dram_samples : tn->rem_samples;
+    return bytes <= 0 ? INFINITY : samples / ((double)bytes / (1 << 20));
+}
+
+// Global ranking of tier upper: once it's full, the tenant with the most
+// bytes waiting to move up into it gets room from the tenant whose share of
+// it is the coldest, if that share is colder than both the waiting pages and
+// the waiting tenant's own share (which its promotions demote by themselves)
+static void rank_tier(uint32_t upper) {
+    struct tmem_tier *tier = &shm->tiers[upper];
+    if (tier->size - __atomic_load_n(&tier->used, __ATOMIC_ACQUIRE) >= (long)tmem_cfg.page_size) return;
+
+    struct tmemd_tenant *waiting = NULL, *victim = NULL;
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+        struct tmemd_tenant *tn = &shm->tenants[i];
+        if (atomic_load(&tn->pid) == 0) continue;
+        uint64_t hot_bytes = __atomic_load_n(&tn->hot_bytes[upper + 1], __ATOMIC_RELAXED);
+        if (hot_bytes != 0 && (waiting == NULL || hot_bytes > waiting->hot_bytes[upper + 1])) waiting = tn;
+    }
+    if (waiting == NULL) return;
+
+    double victim_heat = fmin(tenant_heat(waiting, upper), tenant_heat(waiting, upper + 1));
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+        struct tmemd_tenant *tn = &shm->tenants[i];
+        if (tn == waiting || atomic_load(&tn->pid) == 0) continue;
+        if (__atomic_load_n(&tn->own[upper], __ATOMIC_RELAXED) < (long)tmem_cfg.page_size) continue;
+        double heat = tenant_heat(tn, upper);
+        if (heat < victim_heat) {
+            victim = tn;
+            victim_heat = heat;
+        }
+    }
+    if (victim == NULL) return;
+
+    uint64_t bytes = waiting->hot_bytes[upper + 1];
+    if (bytes > (uint64_t)victim->own[upper]) bytes = victim->own[upper];
+    if (bytes > TMEMD_DEMOTE_MAX) bytes = TMEMD_DEMOTE_MAX;
+    struct tmemd_decision dec = {.tier = upper, .bytes = bytes};
+    if (spsc_ring_push(tmemd_ring(shm, victim->decisions_off), &dec)) decisions++;
+}
+
+static void print_stats() {
+    printf("forwarded: [%lu]\tunowned: [%lu]\tdecisions: [%lu]\n", forwarded, unowned, decisions);
+    for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) {
+        printf("\ttier: [%u]\tnode: [%d]\tused: [%ld]\tsize: [%ld]\tfree: [%ld]\n",
+                t, shm->tiers[t].node, shm->tiers[t].used, shm->tiers[t].size, shm->tiers[t].free);
+    }
+    for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+        struct tmemd_tenant *tn = &shm->tenants[i];
+        int pid = atomic_load(&tn->pid);
+        if (pid == 0) continue;
+        printf("\tslot: [%u]\tpid: [%d]\tdram_samples: [%lu]\trem_samples: [%lu]\tdrops: [%lu]\town:", i, pid, tn->dram_samples, tn->rem_samples, tn->drops);
+        for (uint32_t t = 0; t < tmem_cfg.num_tiers; t++) printf(" [%ld]", tn->own[t]);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s (knobs come from TMEM_<KNOB> / TMEM_CONFIG)\n", argv[0]);
+        exit(1);
+    }
+    tmem_config_init();
+    tmem_config_print(stdout);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(tmem_cfg.scan_cpu, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) perror("tmemd: sched_setaffinity");
+
+    for (uint32_t i = 0; i < tmem_cfg.pebs_nprocs; i++) {
+        perf_page[i][DRAMREAD] = perf_setup(0x1d3, i, i * 2, DRAMREAD);     // MEM_LOAD_L3_MISS_RETIRED.LOCAL_DRAM
+        perf_page[i][REMREAD] = perf_setup(0x4d3, i, i * 2, REMREAD);       // MEM_LOAD_L3_MISS_RETIRED.REMOTE_DRAM
+    }
+
+    shm_setup();
+    size_tiers();
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    // attaching processes check the magic, everything else has to be ready
+    atomic_store(&shm->magic, TMEMD_MAGIC);
+    printf("tmemd: %s ready\n", TMEMD_SHM_NAME);
+    fflush(stdout);
+
+    struct timespec last = get_time();
+    while (!stop) {
+        uint32_t records = 0;
+        for (uint32_t i = 0; i < tmem_cfg.pebs_nprocs; i++) {
+            for (int evt = 0; evt < NPBUFTYPES; evt++) records += drain_perf_buffer(i, evt);
+        }
+        if (records == 0) usleep(TMEMD_POLL_US);
+
+        struct timespec now = get_time();
+        if (elapsed_time(last, now) * 1000 < TMEMD_INTERVAL_MS) continue;
+        last = now;
+
+        reap_tenants();
+        if (tmem_cfg.dram_buffer != 0) size_tiers();
+        for (uint32_t t = TOP_TIER; t < tmem_cfg.num_tiers - 1; t++) rank_tier(t);
+        print_stats();
+        forwarded = unowned = decisions = 0;
+        for (uint32_t i = 0; i < TMEMD_MAX_TENANTS; i++) {
+            shm->tenants[i].dram_samples = 0;
+            shm->tenants[i].rem_samples = 0;
+        }
+    }
+
+    shm_unlink(TMEMD_SHM_NAME);
+    printf("tmemd: exiting\n");
+    return 0;
+}
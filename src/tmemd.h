@@ -0,0 +1,110 @@
+#ifndef _TMEMD_HEADER
+#define _TMEMD_HEADER
+
+/*
+    Shared memory between tmemd, the tiering daemon, and the processes it
+    manages (sample_backend=2)
+
+    tmemd owns PEBS for the whole machine and the memory tiers. It creates
+    the segment TMEMD_SHM_NAME holding the tiers every attached process
+    reserves from, so all of them share one DRAM budget, and a slot per
+    process (tenant) with two rings:
+        samples     tmemd -> tenant, the PEBS samples of the tenant's tracked
+                    pages, drained by its scan thread like its own perf buffers
+        decisions   tmemd -> tenant, bytes to demote out of a tier to make
+                    room for the hotter pages of another tenant
+    A tenant publishes what tmemd needs to rank it against the others: the
+    bytes it holds of every tier, the bytes waiting for promotion and the va
+    range of its tracked pages. Pages still move with mbind in the tenant,
+    tmemd never touches another process's memory.
+*/
+
+#include "tmem.h"
+#include "spsc-ring.h"
+
+#ifndef TMEMD_SHM_NAME
+    #define TMEMD_SHM_NAME "/tmemd"
+#endif
+
+#ifndef TMEMD_MAX_TENANTS
+    #define TMEMD_MAX_TENANTS 16
+#endif
+
+// Samples in flight per tenant before tmemd drops new ones, must be a power of 2
+#ifndef TMEMD_SAMPLE_RING_SIZE
+    #define TMEMD_SAMPLE_RING_SIZE (1 << 16)
+#endif
+
+#ifndef TMEMD_DECISION_RING_SIZE
+    #define TMEMD_DECISION_RING_SIZE 64
+#endif
+
+// How often tmemd ranks the tenants and sends out decisions
+#ifndef TMEMD_INTERVAL_MS
+    #define TMEMD_INTERVAL_MS 1000
+#endif
+
+// Most bytes one decision asks a tenant to demote
+#ifndef TMEMD_DEMOTE_MAX
+    #define TMEMD_DEMOTE_MAX (256L << 20)
+#endif
+
+// How long a tenant's scan thread sleeps on an empty sample ring
+#ifndef TMEMD_POLL_US
+    #define TMEMD_POLL_US 100
+#endif
+
+#define TMEMD_MAGIC 0x746d656d64000002UL     // "tmemd", layout version 2
+
+struct tmemd_sample {
+    uint64_t va;
+    uint64_t ip;
+    uint64_t time;
+    uint32_t cpu;
+    uint8_t evt;
+};
+
+struct tmemd_decision {
+    uint32_t tier;      // demote out of tier into tier + 1
+    uint64_t bytes;
+};
+
+struct tmemd_tenant {
+    _Atomic int pid;                    // 0 = free slot
+    // written by the tenant
+    uint64_t va_lo, va_hi;              // tracked pages, samples outside aren't forwarded
+    long own[MAX_TIERS];                // tier_own of the tenant
+    long held[MAX_TIERS];               // tier_held of the tenant, given back if it dies mid-migration
+    uint64_t hot_bytes[MAX_TIERS];      // waiting in hot_queues[t]
+    // written by tmemd
+    uint64_t dram_samples, rem_samples; // this interval
+    uint64_t drops;                     // samples lost to a full ring
+    uint64_t samples_off, decisions_off;    // rings, from the start of the segment
+} __attribute__((aligned(64)));
+
+struct tmemd_shm {
+    _Atomic uint64_t magic;             // set last, once the segment is ready
+    // what the layout was built with, at the same offset whatever it was built
+    // with so a process built with other knobs can tell before it touches the rest
+    uint64_t size;                      // tmemd_shm_size()
+    uint32_t max_tiers, max_tenants;
+    uint32_t sample_ring_size, decision_ring_size;
+    int daemon_pid;
+    uint32_t num_tiers;
+    struct tmem_tier tiers[MAX_TIERS];
+    struct tmemd_tenant tenants[TMEMD_MAX_TENANTS];
+};
+
+#define TMEMD_SAMPLE_RING_BYTES spsc_ring_bytes(sizeof(struct tmemd_sample), TMEMD_SAMPLE_RING_SIZE)
+#define TMEMD_DECISION_RING_BYTES spsc_ring_bytes(sizeof(struct tmemd_decision), TMEMD_DECISION_RING_SIZE)
+
+// Header, then the two rings of every tenant
+static inline size_t tmemd_shm_size() {
+    return sizeof(struct tmemd_shm) + TMEMD_MAX_TENANTS * (TMEMD_SAMPLE_RING_BYTES + TMEMD_DECISION_RING_BYTES);
+}
+
+static inline struct spsc_ring* tmemd_ring(struct tmemd_shm *shm, uint64_t off) {
+    return (struct spsc_ring *)((char *)shm + off);
+}
+
+#endif
@@ -0,0 +1,255 @@
+#include "trace.h"
+#include "tmem.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+
+struct trace_entry {
+    uint8_t file;
+    struct pebs_rec rec;
+} __attribute__((packed));
+
+enum producer_state {
+    PRODUCER_LIVE,      // its thread traces into it
+    PRODUCER_EXITED,    // its thread is gone, the writer still has to drain it
+    PRODUCER_FREE       // drained, the next thread that traces takes it over
+};
+
+// One per tracing thread. Never unmapped so the writer can't race with thread
+// exit, the rings are handed to another thread once they're drained
+struct trace_producer {
+    struct spsc_ring *recs;
+    struct spsc_ring *logs;
+    _Atomic uint32_t state;
+};
+
+// Staging block of one output file, only touched with drain_lock held
+struct trace_stage {
+    int fd;
+    size_t len;
+    char *buf;
+};
+
+static const char *trace_file_names[NUM_TRACE_FILES] = {
+    [TRACE_SAMPLES] = "tmem_trace.bin",
+    [TRACE_PREDS] = "preds.bin",
+    [TRACE_MIGS] = "mig.bin",
+    [TRACE_COLD] = "cold.bin",
+    [TRACE_DEBUG] = "debuglog.txt",
+};
+
+static struct trace_producer *producers[MAX_TRACE_PRODUCERS];
+static _Atomic uint32_t num_producers = 0;
+static struct trace_stage stages[NUM_TRACE_FILES];
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer_thread;
+static bool trace_ready = false;
+
+// Its destructor gives the thread's producer back when the thread exits
+static pthread_key_t producer_key;
+
+static _Thread_local struct trace_producer *producer = NULL;
+static _Thread_local bool registering = false;
+
+static void* trace_alloc(size_t size) {
+    void *p = libc_mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(p != MAP_FAILED);
+    // application threads register producers too
+    __atomic_fetch_add(&pebs_stats.internal_mem_overhead, size, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void put_producer(void *arg) {
+    struct trace_producer *p = arg;
+    producer = NULL;
+    // orders its last pushes before the writer sees it gone
+    atomic_store_explicit(&p->state, PRODUCER_EXITED, memory_order_release);
+}
+
+// A producer a thread that exited left behind, NULL if there's none
+static struct trace_producer* reuse_producer() {
+    uint32_t n = atomic_load(&num_producers);
+    if (n > MAX_TRACE_PRODUCERS) n = MAX_TRACE_PRODUCERS;
+    for (uint32_t i = 0; i < n; i++) {
+        struct trace_producer *p = __atomic_load_n(&producers[i], __ATOMIC_ACQUIRE);
+        uint32_t free_state = PRODUCER_FREE;
+        if (p != NULL && atomic_compare_exchange_strong(&p->state, &free_state, PRODUCER_LIVE)) return p;
+    }
+    return NULL;
+}
+
+// Returns NULL if the thread can't trace (too many live producers or
+// called again from inside the mmaps below, e.g. by LOG_DEBUG in the mmap hook)
+static struct trace_producer* get_producer() {
+    if (producer != NULL) return producer;
+    if (!trace_ready || registering) return NULL;
+
+    registering = true;
+    bool was_internal = internal_call;
+    internal_call = true;
+
+    struct trace_producer *p = reuse_producer();
+    if (p == NULL) {
+        uint32_t slot = atomic_fetch_add(&num_producers, 1);
+        if (slot < MAX_TRACE_PRODUCERS) {
+            p = trace_alloc(sizeof(struct trace_producer));
+            p->recs = spsc_ring_init(sizeof(struct trace_entry), TRACE_RING_SIZE);
+            p->logs = spsc_ring_init(TRACE_LOG_LEN, TRACE_LOG_RING_SIZE);
+            p->state = PRODUCER_LIVE;
+            __atomic_store_n(&producers[slot], p, __ATOMIC_RELEASE);
+        }
+    }
+    if (p != NULL) {
+        pthread_setspecific(producer_key, p);
+        producer = p;
+    }
+
+    internal_call = was_internal;
+    registering = false;
+    return producer;
+}
+
+void trace_rec(enum trace_file file, const struct pebs_rec *rec) {
+    struct trace_producer *p = get_producer();
+    struct trace_entry entry = {
+        .file = file,
+        .rec = *rec
+    };
+    if (p == NULL || !spsc_ring_push(p->recs, &entry)) {
+        __atomic_fetch_add(&pebs_stats.trace_drops, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void trace_log(const char *fmt, ...) {
+    struct trace_producer *p = get_producer();
+    if (p == NULL) {
+        __atomic_fetch_add(&pebs_stats.log_drops, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char line[TRACE_LOG_LEN];
+    int len = snprintf(line, sizeof(line), "[%.9f]\t", elapsed_time(log_start_time, get_time()));
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line + len, sizeof(line) - len, fmt, args);
+    va_end(args);
+
+    if (!spsc_ring_push(p->logs, line)) {
+        __atomic_fetch_add(&pebs_stats.log_drops, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void stage_write(struct trace_stage *stage) {
+    size_t off = 0;
+    while (off < stage->len) {
+        ssize_t n = write(stage->fd, stage->buf + off, stage->len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("trace write");
+            break;
+        }
+        off += n;
+    }
+    stage->len = 0;
+}
+
+static void stage_append(enum trace_file file, const char *data, size_t len) {
+    struct trace_stage *stage = &stages[file];
+    while (len > 0) {
+        size_t n = TRACE_BLOCK_SIZE - stage->len;
+        if (n > len) n = len;
+        memcpy(stage->buf + stage->len, data, n);
+        stage->len += n;
+        data += n;
+        len -= n;
+        // only whole blocks are written outside of trace_flush
+        if (stage->len == TRACE_BLOCK_SIZE) {
+            stage_write(stage);
+        }
+    }
+}
+
+// drain_lock must be held, returns the number of records drained
+static uint64_t drain_producers() {
+    uint64_t drained = 0;
+    uint32_t n = atomic_load(&num_producers);
+    if (n > MAX_TRACE_PRODUCERS) n = MAX_TRACE_PRODUCERS;
+
+    struct trace_entry entry;
+    char line[TRACE_LOG_LEN];
+    for (uint32_t i = 0; i < n; i++) {
+        // slot can be taken but not published yet
+        struct trace_producer *p = __atomic_load_n(&producers[i], __ATOMIC_ACQUIRE);
+        if (p == NULL) continue;
+        // read before draining, an exited thread's records are all in by then
+        uint32_t state = atomic_load_explicit(&p->state, memory_order_acquire);
+        if (state == PRODUCER_FREE) continue;
+
+        while (spsc_ring_pop(p->recs, &entry)) {
+            stage_append(entry.file, (const char *)&entry.rec, sizeof(struct pebs_rec));
+            drained++;
+        }
+        while (spsc_ring_pop(p->logs, line)) {
+            stage_append(TRACE_DEBUG, line, strnlen(line, TRACE_LOG_LEN));
+            drained++;
+        }
+        if (state == PRODUCER_EXITED) {
+            atomic_store_explicit(&p->state, PRODUCER_FREE, memory_order_release);
+        }
+    }
+    return drained;
+}
+
+static void* trace_writer_thread() {
+    internal_call = true;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(tmem_cfg.stats_cpu, &cpuset);
+    int s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    assert(s == 0);
+
+    while (true) {
+        pthread_mutex_lock(&drain_lock);
+        uint64_t drained = drain_producers();
+        pthread_mutex_unlock(&drain_lock);
+
+        if (drained == 0) {
+            usleep(TRACE_WRITER_SLEEP_US);
+        }
+    }
+    return NULL;
+}
+
+// Writes out everything traced so far, including partial blocks
+void trace_flush() {
+    if (!trace_ready) return;
+    pthread_mutex_lock(&drain_lock);
+    drain_producers();
+    for (int i = 0; i < NUM_TRACE_FILES; i++) {
+        stage_write(&stages[i]);
+    }
+    pthread_mutex_unlock(&drain_lock);
+}
+
+// Must be an internal call
+void trace_init() {
+    int s = pthread_key_create(&producer_key, put_producer);
+    assert(s == 0);
+    for (int i = 0; i < NUM_TRACE_FILES; i++) {
+        stages[i].fd = open(trace_file_names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stages[i].fd < 0) {
+            perror("trace file open");
+        }
+        assert(stages[i].fd >= 0);
+        // page aligned so every full block is a page aligned write
+        stages[i].buf = trace_alloc(TRACE_BLOCK_SIZE);
+        stages[i].len = 0;
+    }
+    trace_ready = true;
+
+    atexit(trace_flush);
+
+    s = pthread_create(&writer_thread, NULL, trace_writer_thread, NULL);
+    assert(s == 0);
+}
@@ -0,0 +1,61 @@
+#ifndef _TRACE_HEADER
+#define _TRACE_HEADER
+
+/*
+    Asynchronous trace writer (RECORD=1)
+
+    Every thread that traces gets its own lock-free spsc ring (registered on
+    first use, taken over by a later thread once its thread exited and the
+    writer drained it) so producers never take a lock or do IO. A writer thread drains
+    all rings into TRACE_BLOCK_SIZE staging blocks per file and writes them out
+    whole. Records that don't fit in a full ring are dropped and counted in
+    pebs_stats.trace_drops / log_drops.
+
+    LOG_DEBUG goes through trace_log, which formats on the calling thread
+    but never flushes.
+*/
+
+#include <stdint.h>
+
+struct pebs_rec;
+
+enum trace_file {
+    TRACE_SAMPLES,  // tmem_trace.bin
+    TRACE_PREDS,    // preds.bin
+    TRACE_MIGS,     // mig.bin
+    TRACE_COLD,     // cold.bin
+    TRACE_DEBUG,    // debuglog.txt, only written by trace_log
+    NUM_TRACE_FILES
+};
+
+#ifndef TRACE_RING_SIZE
+    #define TRACE_RING_SIZE (1 << 16)   // pebs_recs per producer
+#endif
+
+#ifndef TRACE_LOG_RING_SIZE
+    #define TRACE_LOG_RING_SIZE (1 << 12)   // log lines per producer
+#endif
+
+#ifndef TRACE_LOG_LEN
+    #define TRACE_LOG_LEN 256
+#endif
+
+#ifndef TRACE_BLOCK_SIZE
+    #define TRACE_BLOCK_SIZE (1 << 20)
+#endif
+
+#ifndef MAX_TRACE_PRODUCERS
+    #define MAX_TRACE_PRODUCERS 128
+#endif
+
+// How long the writer sleeps when all rings are empty
+#ifndef TRACE_WRITER_SLEEP_US
+    #define TRACE_WRITER_SLEEP_US 1000
+#endif
+
+void trace_init();
+void trace_rec(enum trace_file file, const struct pebs_rec *rec);
+void trace_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void trace_flush();
+
+#endif